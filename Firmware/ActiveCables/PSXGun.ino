@@ -1,5 +1,6 @@
 // Need pullup on RX. Goes to any digital IO of LightGunVerter
 // Everything else goes to PSX and shouldn't need pull ups/downs
+// TX prints link and timing stats once a second when REPORT_STATS is set (1Mbaud)
 
 #define IN_CMD MOSI
 #define OUT_DATA MISO
@@ -7,43 +8,104 @@
 #define IN_ATT SS
 #define IN_CLK SCK
 #define OUT_LED 2
+#define IN_MODE 4   // Ground to be a GunCon (NPC-103), leave open to be a Justifier. Can be changed while running.
 
-#define GUNCON 0
-#define CONTROLLER_DATA_SIZE 8  // From LightGunVerter
+// Framed serial protocol from LightGunVerter (see Firmware/main/serial_protocol.h)
+#define SERIAL_BAUD 1000000
+#define FRAME_SYNC 0xA5
+#define FRAME_HEADER_SIZE 4
+#define FRAME_PAYLOAD_SIZE 18   // Version 1 payload, later versions can only add to the end
+#define FRAME_TIMING_PAYLOAD_SIZE 26  // Version 2 adds where each spot is drawn (line and time after hsync)
+#define FRAME_MAX_SIZE 40
+#define FRAME_FLAG_VISIBLE (1<<0)
+#define RX_BUFFER_SIZE 64       // Power of two, over two frames
+
+// Timing. Timer1 counts CPU cycles (16MHz) to measure the interrupts, Timer2 ticks every 0.5us to time ACK.
+#define ACK_LENGTH 4            // Timer2 ticks ACK is held low for (plus the time to get into its interrupt)
+#define ISR_OVERHEAD 50         // Cycles to get into and out of an interrupt that the measurements can't see
+#define ACK_LATENCY_BUDGET 320  // Cycles (20us) from a byte finishing to ACK, about twice what a real pad takes
+#define REPORT_STATS 1          // Print link and interrupt timing stats on TX
+#define STATS_PERIOD 244        // Timer1 overflows (4.096ms each) between stats, about a second
 
 #include <SPI.h>
+#include <util/crc16.h>
 
-#if GUNCON
-#define DATA_SIZE 8             // From PSX
-uint8_t ReadMask[DATA_SIZE]   = { 0xFF, 0xFF, 0, 0, 0, 0, 0, 0 };
-uint8_t ReadExpect[DATA_SIZE] = { 0x01, 0x42, 0, 0, 0, 0, 0, 0 };
-uint8_t Reply[DATA_SIZE] = { 0x63, 0x5A, 0xFF, 0xFF, 0x01, 0x00, 0x05, 0x00 };
-#else
-#define DATA_SIZE 4             // From PSX
-uint8_t ReadMask[DATA_SIZE]   = { 0xFF, 0xFF, 0, 0 };
-uint8_t ReadExpect[DATA_SIZE] = { 0x01, 0x42, 0, 0 };
-uint8_t Reply[DATA_SIZE] = { 0x31, 0x5A, 0xFF, 0xFF };
-#endif
+// GunCon coordinates. X counts an 8MHz clock from the start of hsync and Y counts lines from vsync, just like
+// the spot timing LightGunVerter sends. Offsets are for matching a real GunCon, games calibrate out the rest.
+#define GUNCON_X_OFFSET 0
+#define GUNCON_Y_OFFSET 0
+#define GUNCON_NO_LIGHT_X 0x01
+#define GUNCON_NO_LIGHT_Y 0x0A
+
+#define MAX_DATA_SIZE 8         // From PSX
+#define GUNCON_DATA_SIZE 8
+#define JUSTIFIER_DATA_SIZE 4
+uint8_t ReadMask[MAX_DATA_SIZE]   = { 0xFF, 0xFF, 0, 0, 0, 0, 0, 0 };
+uint8_t ReadExpect[MAX_DATA_SIZE] = { 0x01, 0x42, 0, 0, 0, 0, 0, 0 };
+const uint8_t GunConHeader[GUNCON_DATA_SIZE] = { 0x63, 0x5A, 0xFF, 0xFF, GUNCON_NO_LIGHT_X, 0x00, GUNCON_NO_LIGHT_Y, 0x00 };
+const uint8_t JustifierHeader[JUSTIFIER_DATA_SIZE] = { 0x31, 0x5A, 0xFF, 0xFF };
 
-uint8_t ControllerReadIndex = 0;
-uint8_t ControllerData[CONTROLLER_DATA_SIZE];
-uint8_t DataIndex = 0;
-bool bDataGood = true;
+// The SPI interrupt only ever reads the front reply. New data goes in the back one and is swapped in when the
+// PSX next pulls ATT low, so a poll never mixes X from one frame with Y from another.
+uint8_t Replies[2][MAX_DATA_SIZE];
+volatile uint8_t FrontReply = 0;
+volatile bool bReplyReady = false;  // Back reply has something newer
+volatile uint8_t DataSize = 0;      // Bytes in the current mode's reply
+bool bGunCon = false;
+
+uint8_t RxBuffer[RX_BUFFER_SIZE];
+volatile uint8_t RxHead = 0;  // Written by the UART interrupt
+volatile uint8_t RxTail = 0;  // Written by loop()
+
+uint8_t Frame[FRAME_MAX_SIZE];
+uint8_t FrameIndex = 0;
+uint8_t LastSequence = 0;
+bool bHadFrame = false;
+uint16_t GoodFrames = 0;
+uint16_t MissedFrames = 0;  // Sequence gaps
+uint16_t BadFrames = 0;     // Failed CRC or wouldn't fit
+volatile uint16_t RxOverflows = 0;
+volatile uint16_t MaxBlocking = 0;  // Longest any other interrupt has held off the SPI one (cycles)
+volatile uint16_t MaxAck = 0;       // Longest from entering the SPI interrupt to ACK (cycles)
+uint8_t StatsTicks = 0;
+volatile uint8_t DataIndex = 0;
+volatile bool bDataGood = true;
 
 #define ReadAttention() (PINB&(1<<2))
 #define WriteAckLow() (DDRD|=(1<<7))
 #define WriteAckHigh() (DDRD&=~(1<<7))
 #define WriteLEDLow() (PORTD&=~(1<<2))
 #define WriteLEDHigh() (PORTD|=(1<<2))
-#define DelayMicro() asm("NOP\nNOP\nNOP\nNOP\nNOP\nNOP\nNOP\nNOP\n")
+#define ReadGunConMode() ((PIND&(1<<4)) == 0)
 
 inline int ReadCommand()
 {
   return digitalRead(IN_CMD);
 }
 
+// Switches what the PSX sees. Only call while ATT is high so a poll in progress isn't cut short.
+void SetMode(bool bNewGunCon)
+{
+  const uint8_t *Header = bNewGunCon ? GunConHeader : JustifierHeader;
+  uint8_t Size = bNewGunCon ? GUNCON_DATA_SIZE : JUSTIFIER_DATA_SIZE;
+  uint8_t OldSREG = SREG;
+  cli();
+  for (uint8_t i = 0; i < Size; i++)
+  {
+    Replies[0][i] = Header[i];
+    Replies[1][i] = Header[i];
+  }
+  DataSize = Size;
+  bReplyReady = false;
+  bGunCon = bNewGunCon;
+  SREG = OldSREG;
+}
+
 void setup()
 {
+  pinMode(IN_MODE, INPUT_PULLUP);
+  SetMode(ReadGunConMode());
+
   // LED for debugging
   pinMode(OUT_LED, OUTPUT);
   digitalWrite(OUT_LED, LOW);
@@ -52,32 +114,59 @@ void setup()
   pinMode(OUT_ACK, INPUT);
   digitalWrite(OUT_ACK, 0);
 
+  // Nothing uses millis() and its interrupt would only add to the SPI interrupt's latency
+  TIMSK0 = 0;
+
+  // Timer1 free running at the CPU clock for measuring, Timer2 at 0.5us for ACK
+  TCCR1A = 0;
+  TCCR1B = bit(CS10);
+  TIMSK1 = 0;
+  TCCR2A = 0;
+  TCCR2B = bit(CS21);
+  TIMSK2 = 0;
+
   // Set up SPI
   pinMode(MISO, OUTPUT);
   SPCR |= bit (SPE)|bit(DORD)|bit(CPOL)|bit(CPHA);
   SPI.attachInterrupt();
 
-  // Set up LightGunVerter serial
-  Serial.begin(9600);
+  // Both edges of ATT for swapping replies and starting a new transaction
+  PCMSK0 |= bit(PCINT2);
+  PCICR |= bit(PCIE0);
+
+  // Set up LightGunVerter serial (1Mbaud is exact at double speed)
+  UCSR0A = bit(U2X0);
+  UBRR0 = (F_CPU / (8UL * SERIAL_BAUD)) - 1;
+  UCSR0C = bit(UCSZ01)|bit(UCSZ00);
+  UCSR0B = bit(RXEN0)|bit(RXCIE0)|(REPORT_STATS ? bit(TXEN0) : 0);
+}
+
+inline void NoteBlocking(uint16_t Start)
+{
+  uint16_t Cycles = TCNT1 - Start;
+  if (Cycles > MaxBlocking)
+    MaxBlocking = Cycles;
 }
 
 ISR (SPI_STC_vect)
 {
+  uint16_t Start = TCNT1;
   uint8_t DataIn = SPDR;
 
-  if (DataIndex < DATA_SIZE)  // Acknowledge
+  if (DataIndex < DataSize)  // Acknowledge
   {
     bDataGood &= ((DataIn & ReadMask[DataIndex]) == ReadExpect[DataIndex]);
     if (bDataGood)
     {
-      SPDR = Reply[DataIndex];
+      SPDR = Replies[FrontReply][DataIndex];
     
       WriteAckLow();
-      DelayMicro();
-      DelayMicro();
-      DelayMicro();
-      DelayMicro();
-      WriteAckHigh();
+      OCR2A = TCNT2 + ACK_LENGTH;
+      TIFR2 = bit(OCF2A);
+      TIMSK2 = bit(OCIE2A);
+      uint16_t Cycles = TCNT1 - Start;
+      if (Cycles > MaxAck)
+        MaxAck = Cycles;
     }
     else
     {
@@ -91,65 +180,227 @@ ISR (SPI_STC_vect)
   }
 }
 
-void loop()
+// End of the ACK pulse
+ISR (TIMER2_COMPA_vect)
 {
-  if (ReadAttention() != 0)
+  uint16_t Start = TCNT1;
+  WriteAckHigh();
+  TIMSK2 = 0;
+  NoteBlocking(Start);
+}
+
+ISR (PCINT0_vect)
+{
+  uint16_t Start = TCNT1;
+  if (ReadAttention() != 0) // Transaction over
   {
-    if (DataIndex != 0)
-    {
-      DataIndex = 0;
-      bDataGood = true;
-    }
-    if (Serial.available())
+    DataIndex = 0;
+    bDataGood = true;
+  }
+  else if (bReplyReady) // Transaction starting so take the newest reply
+  {
+    FrontReply ^= 1;
+    bReplyReady = false;
+  }
+  NoteBlocking(Start);
+}
+
+ISR (USART_RX_vect)
+{
+  uint16_t Start = TCNT1;
+  uint8_t Data = UDR0;
+  uint8_t Next = (RxHead + 1) & (RX_BUFFER_SIZE - 1);
+  if (Next != RxTail)
+  {
+    RxBuffer[RxHead] = Data;
+    RxHead = Next;
+  }
+  else
+  {
+    RxOverflows++;
+  }
+  NoteBlocking(Start);
+}
+
+inline uint16_t Read16(const uint8_t *Data)
+{
+  return Data[0] | (Data[1] << 8);
+}
+
+// Fills in the back reply (after the fixed header bytes) for swapping in at the start of the next poll
+void PublishReply(const uint8_t *Data)
+{
+  uint8_t OldSREG = SREG;
+  cli(); // Only long enough to stop the swap happening half way through
+  uint8_t *Back = Replies[FrontReply ^ 1];
+  for (uint8_t i = 2; i < DataSize; i++)
+    Back[i] = Data[i];
+  bReplyReady = true;
+  SREG = OldSREG;
+}
+
+// Player 1's 7 bytes of a frame (X, Y, buttons, flags) and where the spot is drawn if the frame has it
+void UsePlayerData(const uint8_t *Player, const uint8_t *Timing)
+{
+  uint16_t WiimoteButtons = Read16(Player + 4);
+  uint16_t Buttons = 0xFFFF;
+  if (WiimoteButtons & (1<<0)) // Left
+    Buttons &= ~(1<<3);
+  if (WiimoteButtons & (1<<1)) // Right
+    Buttons &= ~(1<<14);
+  if (WiimoteButtons & (1<<10)) // B
+    Buttons &= ~(bGunCon ? (1<<13) : (1<<15));
+
+  uint8_t Reply[MAX_DATA_SIZE];
+  Reply[2] = Buttons & 0xFF;
+  Reply[3] = Buttons >> 8;
+  if (bGunCon)
+  {
+    uint16_t GunX = GUNCON_NO_LIGHT_X;
+    uint16_t GunY = GUNCON_NO_LIGHT_Y;
+    if (Player[6] & FRAME_FLAG_VISIBLE)
     {
-      uint8_t SerialData = Serial.read();
-      if (SerialData == 0x80)
+      if (Timing)
       {
-        if (ControllerReadIndex == CONTROLLER_DATA_SIZE) // Last lot of serial data was good
+        uint16_t Line = Read16(Timing);
+        if (Line != 0xFFFF)
         {
-          if (ControllerData[0] == 0x80 && ControllerData[1] == 0x00) // Player 1 data
-          {
-            uint16_t Buttons = 0xFFFF;
-            if (ControllerData[7] & (1<<0)) // Left
-              Buttons &= ~(1<<3);
-            if (ControllerData[7] & (1<<1)) // Right
-              Buttons &= ~(1<<14);
-#if GUNCON
-            if (ControllerData[6] & (1<<3)) // B
-              Buttons &= ~(1<<13);
-#else
-            if (ControllerData[6] & (1<<3)) // B
-              Buttons &= ~(1<<15);
-            uint16_t GunX = (ControllerData[2] << 7) + ControllerData[3];
-            uint16_t GunY = (ControllerData[4] << 7) + ControllerData[5];
-            if (GunX == 0x3FFF && GunY == 0x3FFF)
-            {
-              GunX = 0x01;
-              GunY = 0x0A;
-            }
-            else
-            {
-              GunX = 0x4D + (((1023 - GunX) * 3)  >> 3);
-              GunY = 0x20 + ((GunY * 11) >> 5);
-            }
-#endif
-            Reply[2] = Buttons & 0xFF;
-            Reply[3] = Buttons >> 8;
-#if GUNCON
-            Reply[4] = GunX & 0xFF;
-            Reply[5] = GunX >> 8;
-            Reply[6] = GunY & 0xFF;
-            Reply[7] = GunY >> 8;
-#endif
-          }
+          GunX = GUNCON_X_OFFSET + Read16(Timing + 2) / 10; // 80ths of a microsecond to 8MHz
+          GunY = GUNCON_Y_OFFSET + Line;
         }
-        ControllerReadIndex = 0;
       }
-      if (ControllerReadIndex < CONTROLLER_DATA_SIZE)
+      else // Older LightGunVerter, spread the screen over the usual range
       {
-        ControllerData[ControllerReadIndex] = SerialData;
+        GunX = 0x4D + (((1023 - Read16(Player)) * 3)  >> 3);
+        GunY = 0x20 + ((Read16(Player + 2) * 11) >> 5);
       }
-      ControllerReadIndex++;
+    }
+    Reply[4] = GunX & 0xFF;
+    Reply[5] = GunX >> 8;
+    Reply[6] = GunY & 0xFF;
+    Reply[7] = GunY >> 8;
+  }
+  PublishReply(Reply);
+}
+
+// Throws away the first Count bytes of the frame buffer
+void DropBytes(uint8_t Count)
+{
+  FrameIndex -= Count;
+  memmove(Frame, Frame + Count, FrameIndex);
+}
+
+// Collects frames a byte at a time. Only acts on one once the CRC matches and if it doesn't, starts looking
+// again from the next sync byte already received so a stray one can't hide the real frame.
+void ReceiveByte(uint8_t Data)
+{
+  if (FrameIndex == FRAME_MAX_SIZE)
+    DropBytes(1);
+  Frame[FrameIndex++] = Data;
+  while (FrameIndex > 0)
+  {
+    if (Frame[0] != FRAME_SYNC)
+    {
+      DropBytes(1);
+      continue;
+    }
+    if (FrameIndex < FRAME_HEADER_SIZE)
+      return;
+    if (Frame[1] == 0 || Frame[3] < FRAME_PAYLOAD_SIZE || Frame[3] > FRAME_MAX_SIZE - FRAME_HEADER_SIZE - 2)
+    {
+      BadFrames++;
+      DropBytes(1);
+      continue;
+    }
+    uint8_t Size = FRAME_HEADER_SIZE + Frame[3] + 2;
+    if (FrameIndex < Size)
+      return;
+
+    uint16_t CRC = 0xFFFF;
+    for (uint8_t i = 1; i < Size - 2; i++)
+      CRC = _crc_xmodem_update(CRC, Frame[i]);
+    if (CRC != Read16(Frame + Size - 2))
+    {
+      BadFrames++;
+      DropBytes(1);
+      continue;
+    }
+    if (bHadFrame)
+      MissedFrames += (uint8_t)(Frame[2] - LastSequence - 1);
+    LastSequence = Frame[2];
+    bHadFrame = true;
+    GoodFrames++;
+    UsePlayerData(Frame + 8, Frame[3] >= FRAME_TIMING_PAYLOAD_SIZE ? Frame + FRAME_HEADER_SIZE + FRAME_PAYLOAD_SIZE : NULL);
+    DropBytes(Size);
+  }
+}
+
+#if REPORT_STATS
+void SendChar(char Char)
+{
+  while (!(UCSR0A & bit(UDRE0)));
+  UDR0 = Char;
+}
+
+void SendStat(const char *Name, uint16_t Value)
+{
+  while (*Name)
+    SendChar(*(Name++));
+  char Digits[5];
+  uint8_t NumDigits = 0;
+  do
+  {
+    Digits[NumDigits++] = '0' + (Value % 10);
+    Value /= 10;
+  } while (Value != 0);
+  while (NumDigits > 0)
+    SendChar(Digits[--NumDigits]);
+}
+#endif
+
+// Worst case time from the PSX finishing a byte to ACK is another interrupt having just started plus the SPI
+// interrupt's own time. Lights the LED if that's ever over budget.
+void CheckStats()
+{
+  uint8_t OldSREG = SREG;
+  cli();
+  uint16_t Blocking = MaxBlocking;
+  uint16_t Ack = MaxAck;
+  uint16_t Overflows = RxOverflows;
+  SREG = OldSREG;
+  uint16_t Latency = Blocking + Ack + 2 * ISR_OVERHEAD;
+  if (Latency > ACK_LATENCY_BUDGET)
+    WriteLEDHigh();
+#if REPORT_STATS
+  SendStat("frames ", GoodFrames);
+  SendStat(" missed ", MissedFrames);
+  SendStat(" bad ", BadFrames);
+  SendStat(" overflows ", Overflows);
+  SendStat(" ack latency ", Latency);
+  SendStat("/", ACK_LATENCY_BUDGET);
+  SendChar('\r');
+  SendChar('\n');
+#endif
+}
+
+void loop()
+{
+  if (ReadGunConMode() != bGunCon && ReadAttention() != 0)
+    SetMode(!bGunCon);
+
+  while (RxTail != RxHead)
+  {
+    ReceiveByte(RxBuffer[RxTail]);
+    RxTail = (RxTail + 1) & (RX_BUFFER_SIZE - 1);
+  }
+
+  if (TIFR1 & bit(TOV1))
+  {
+    TIFR1 = bit(TOV1);
+    if (++StatsTicks >= STATS_PERIOD)
+    {
+      StatsTicks = 0;
+      CheckStats();
     }
   }
 }
@@ -0,0 +1,256 @@
+// (c) Charlie Cole 2017
+//
+// This is licensed under
+// - Creative Commons Attribution-NonCommercial 3.0 Unported
+// - https://creativecommons.org/licenses/by-nc/3.0/
+// - Or see LICENSE.txt
+//
+// The short of it is...
+//   You are free to:
+//     Share — copy and redistribute the material in any medium or format
+//     Adapt — remix, transform, and build upon the material
+//   Under the following terms:
+//     NonCommercial — You may not use the material for commercial purposes.
+//     Attribution — You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+
+
+// Runs the pointer filter over synthetic Wiimote tracks and reports what each setting costs and buys:
+// - Jitter: RMS wobble of the drawn reticule while the Wiimote is held still
+// - Latency: how far behind a steady sweep the drawn reticule is, in milliseconds
+// - Flick: RMS error following quick side to side aiming
+// Errors are measured against where the Wiimote really points when the beam draws the reticule's line, so
+// the unfiltered case still shows the time taken to get the report onto the screen.
+//
+// Then projects the sensor bar through a pinhole camera to check the tracker's roll and distance compensation.
+// It's calibrated level at one distance and every aim point across the screen is compared with where it came out
+// then, from other distances and rolls, with and without the LED separation it was calibrated at.
+//
+// Usage: filter_bench [seconds per test]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <random>
+#include "ir_tracker.h"
+
+#define REPORT_INTERVAL 10000		// Wiimote reports every 10ms (microseconds)
+#define REPORT_JITTER 1000			// give or take this much
+#define CAMERA_NOISE 0.6f			// Camera pixels (standard deviation)
+#define FIELD_PERIOD 16683			// NTSC field (microseconds)
+#define LINE_PERIOD 64				// Microseconds
+#define TARGET_LINE 140				// Middle of the screen
+#define PROCESSING_TIME 500			// Report to reticule position being set (microseconds)
+#define SWEEP_SPEED 400.0f			// Camera pixels per second
+#define FLICK_AMPLITUDE 200.0f		// Camera pixels
+#define FLICK_RATE 1.5f				// Hz
+#define CAMERA_FOCAL_LENGTH 1370.0f	// Camera pixels, about 41 degrees across 1024
+#define LED_SEPARATION 0.2f			// Metres between the sensor bar's LED clusters
+#define SCREEN_WIDTH 0.65f			// Metres (32" 4:3 TV)
+#define SCREEN_HEIGHT 0.49f
+#define BAR_HEIGHT 0.27f			// Sensor bar above the middle of the screen (metres)
+#define CALIBRATION_DISTANCE 2.5f	// Metres from the screen
+#define AIM_STEPS 5					// Aim points across (and down) the screen
+#define SETTLE_REPORTS 30			// Reports of the same scene before reading the tracker
+
+enum Motion
+{
+	kMotion_Still,
+	kMotion_Sweep,
+	kMotion_Flick
+};
+
+static float TruePosition(Motion Type, double Seconds)
+{
+	switch (Type)
+	{
+		case kMotion_Sweep: return 100.0f + SWEEP_SPEED * (float)fmod(Seconds, 2.0); // Back to the start every 2 seconds
+		case kMotion_Flick: return 512.0f + FLICK_AMPLITUDE * sinf(2.0f * (float)M_PI * FLICK_RATE * (float)Seconds);
+		default: return 512.0f;
+	}
+}
+
+// When the reticule's line is next drawn after the position has been set
+static uint32_t DrawTime(uint32_t Time)
+{
+	uint32_t Ready = Time + PROCESSING_TIME;
+	uint32_t Field = (Ready / FIELD_PERIOD + 1) * FIELD_PERIOD;
+	return Field + TARGET_LINE * LINE_PERIOD;
+}
+
+// Returns the RMS error (or the mean signed error for sweeps, which is the lag)
+static float Run(Motion Type, int Strength, bool bPredict, double Duration)
+{
+	std::mt19937 Random(1234);
+	std::normal_distribution<float> Noise(0.0f, CAMERA_NOISE);
+	std::uniform_int_distribution<int> Jitter(-REPORT_JITTER, REPORT_JITTER);
+	PointerFilter Filter;
+	Filter.Configure(Strength, bPredict);
+	double SumError = 0.0;
+	double SumSquared = 0.0;
+	int NumSamples = 0;
+	uint32_t Time = 0;
+	while (Time < Duration * 1000000.0)
+	{
+		Time += REPORT_INTERVAL + Jitter(Random);
+		float Seen = TruePosition(Type, Time * 0.000001) + Noise(Random);
+		Filter.Update(Seen, 384.0f, Time);
+		uint32_t Drawn = DrawTime(Time);
+		float X, Y;
+		Filter.Predict(Drawn, X, Y);
+		double Truth = TruePosition(Type, Drawn * 0.000001);
+		if (Type == kMotion_Sweep && fmod(Drawn * 0.000001, 2.0) < 0.25)
+			continue; // Skip the jump back to the start and the filter catching up from it
+		if (Time < 500000)
+			continue; // Settled
+		SumError += Truth - X;
+		SumSquared += (Truth - X) * (Truth - X);
+		NumSamples++;
+	}
+	if (Type == kMotion_Sweep)
+		return (float)(SumError / NumSamples);
+	return (float)sqrt(SumSquared / NumSamples);
+}
+
+// Camera image of the sensor bar with the Wiimote at the given distance in front of the middle of the screen,
+// aiming at (AimX, AimY) metres from the middle and rolled right by Roll radians. False if an LED is out of view.
+static bool Project(float Distance, float AimX, float AimY, float Roll, bool bAccelerometer, WiimoteData &Data)
+{
+	memset(&Data, 0, sizeof(Data));
+	for (int i = 0; i < 4; i++)
+		Data.IRSpot[i].X = Data.IRSpot[i].Y = 0x3FF;
+
+	// Looking along Forward with Right level and Up completing the set (screen is the Z=0 plane, Wiimote at Z=Distance)
+	float Forward[3] = { AimX, AimY, -Distance };
+	float Length = sqrtf(Forward[0]*Forward[0] + Forward[1]*Forward[1] + Forward[2]*Forward[2]);
+	for (int i = 0; i < 3; i++)
+		Forward[i] /= Length;
+	float Right[3] = { -Forward[2], 0.0f, Forward[0] };
+	Length = sqrtf(Right[0]*Right[0] + Right[2]*Right[2]);
+	Right[0] /= Length;
+	Right[2] /= Length;
+	float Up[3] = { Right[1]*Forward[2] - Right[2]*Forward[1], Right[2]*Forward[0] - Right[0]*Forward[2], Right[0]*Forward[1] - Right[1]*Forward[0] };
+
+	for (int i = 0; i < 2; i++)
+	{
+		float LED[3] = { (i ? 0.5f : -0.5f) * LED_SEPARATION, BAR_HEIGHT, -Distance };
+		float Depth = LED[0]*Forward[0] + LED[1]*Forward[1] + LED[2]*Forward[2];
+		float U = CAMERA_FOCAL_LENGTH * (LED[0]*Right[0] + LED[1]*Right[1] + LED[2]*Right[2]) / Depth;
+		float V = CAMERA_FOCAL_LENGTH * (LED[0]*Up[0] + LED[1]*Up[1] + LED[2]*Up[2]) / Depth;
+		// Rolling the Wiimote turns the image the other way about the middle of the camera
+		float X = 511.5f + U*cosf(Roll) - V*sinf(Roll);
+		float Y = 383.5f + U*sinf(Roll) + V*cosf(Roll);
+		if (X < 0.0f || X > 1023.0f || Y < 0.0f || Y > 767.0f)
+			return false;
+		Data.IRSpot[i].X = (uint16_t)lrintf(X);
+		Data.IRSpot[i].Y = (uint16_t)lrintf(Y);
+	}
+
+	// 1g down in the Wiimote's X/Z plane, or nothing that reads as gravity
+	Data.AccelX = (int32_t)lrintf(512.0f + (bAccelerometer ? 104.0f * sinf(Roll) : 0.0f));
+	Data.AccelY = 512;
+	Data.AccelZ = (int32_t)lrintf(512.0f + (bAccelerometer ? 104.0f * cosf(Roll) : 0.0f));
+	return true;
+}
+
+// Tracker's pointing position after a run of identical reports
+static bool Track(const WiimoteData &Data, float ReferenceSeparation, float &X, float &Y, float &Separation)
+{
+	SensorBarTracker Tracker;
+	Tracker.SetReferenceSeparation(ReferenceSeparation);
+	for (int i = 0; i < SETTLE_REPORTS; i++)
+	{
+		if (!Tracker.Update(Data))
+			return false;
+	}
+	X = Tracker.GetX();
+	Y = Tracker.GetY();
+	Separation = Tracker.GetSmoothedSeparation();
+	return true;
+}
+
+static float AimX(int Column) { return SCREEN_WIDTH * ((float)Column / (AIM_STEPS - 1) - 0.5f); }
+static float AimY(int Row) { return SCREEN_HEIGHT * (0.5f - (float)Row / (AIM_STEPS - 1)); }
+
+// Worst distance (camera pixels) from the calibration view over the aim points in view
+static float WorstError(float Distance, float Roll, bool bAccelerometer, float ReferenceSeparation, const float (*Truth)[2], int &NumInView)
+{
+	float Worst = 0.0f;
+	NumInView = 0;
+	for (int i = 0; i < AIM_STEPS * AIM_STEPS; i++)
+	{
+		WiimoteData Data;
+		float X, Y, Separation;
+		if (!Project(Distance, AimX(i % AIM_STEPS), AimY(i / AIM_STEPS), Roll, bAccelerometer, Data) || !Track(Data, ReferenceSeparation, X, Y, Separation))
+			continue;
+		float Error = sqrtf((X - Truth[i][0])*(X - Truth[i][0]) + (Y - Truth[i][1])*(Y - Truth[i][1]));
+		Worst = (Error > Worst) ? Error : Worst;
+		NumInView++;
+	}
+	return Worst;
+}
+
+static void RunPinhole()
+{
+	// Calibrate like the firmware does: level, uncompensated, reference is the mean separation at the corners
+	float Truth[AIM_STEPS * AIM_STEPS][2];
+	float SumSeparation = 0.0f;
+	for (int i = 0; i < AIM_STEPS * AIM_STEPS; i++)
+	{
+		int Column = i % AIM_STEPS;
+		int Row = i / AIM_STEPS;
+		WiimoteData Data;
+		float Separation;
+		if (!Project(CALIBRATION_DISTANCE, AimX(Column), AimY(Row), 0.0f, true, Data) || !Track(Data, 0.0f, Truth[i][0], Truth[i][1], Separation))
+		{
+			printf("Aim point %d,%d isn't in view at the calibration distance\n", Column, Row);
+			return;
+		}
+		if ((Column == 0 || Column == AIM_STEPS - 1) && (Row == 0 || Row == AIM_STEPS - 1))
+			SumSeparation += Separation;
+	}
+	float ReferenceSeparation = SumSeparation / 4.0f;
+
+	static const float Distances[] = { 1.5f, 2.0f, 2.5f, 3.0f, 4.0f };
+	static const float Rolls[] = { 0.0f, 30.0f, 170.0f };
+	printf("\nPinhole camera, calibrated level at %.1f m with the LEDs %.1f pixels apart, %dx%d aim points over a %.2fx%.2f m screen\n",
+		CALIBRATION_DISTANCE, ReferenceSeparation, AIM_STEPS, AIM_STEPS, SCREEN_WIDTH, SCREEN_HEIGHT);
+	printf("%-10s %-8s %8s %16s %16s\n", "Distance", "Roll", "In view", "Compensated px", "Uncompensated px");
+	for (unsigned d = 0; d < sizeof(Distances) / sizeof(Distances[0]); d++)
+	{
+		for (unsigned r = 0; r < sizeof(Rolls) / sizeof(Rolls[0]); r++)
+		{
+			float Roll = Rolls[r] * (float)M_PI / 180.0f;
+			int NumInView, NumUncompensated;
+			float Compensated = WorstError(Distances[d], Roll, true, ReferenceSeparation, Truth, NumInView);
+			float Uncompensated = WorstError(Distances[d], Roll, true, 0.0f, Truth, NumUncompensated);
+			printf("%-10.1f %-8.0f %8d %16.1f %16.1f\n", Distances[d], Rolls[r], NumInView, Compensated, Uncompensated);
+		}
+	}
+
+	// Upside down the pair's order can only come from the accelerometer
+	int NumInView;
+	float Flipped = WorstError(CALIBRATION_DISTANCE, 170.0f * (float)M_PI / 180.0f, false, ReferenceSeparation, Truth, NumInView);
+	printf("Rolled 170 degrees at %.1f m without the accelerometer: %.1f px\n", CALIBRATION_DISTANCE, Flipped);
+}
+
+int main(int argc, char **argv)
+{
+	double Duration = (argc > 1) ? atof(argv[1]) : 60.0;
+	static const char *Names[PointerFilter::kNumStrengths] = { "Off", "Light", "Medium", "Heavy" };
+
+	printf("%d ms reports, %.1f pixel camera noise, reticule drawn on line %d of a %.1f ms field\n", REPORT_INTERVAL / 1000, CAMERA_NOISE, TARGET_LINE, FIELD_PERIOD / 1000.0f);
+	printf("%-8s %-8s %10s %12s %12s\n", "Filter", "Predict", "Jitter px", "Latency ms", "Flick px");
+	for (int Strength = 0; Strength < PointerFilter::kNumStrengths; Strength++)
+	{
+		for (int Predict = 0; Predict < 2; Predict++)
+		{
+			float Jitter = Run(kMotion_Still, Strength, Predict != 0, Duration);
+			float Lag = Run(kMotion_Sweep, Strength, Predict != 0, Duration);
+			float Flick = Run(kMotion_Flick, Strength, Predict != 0, Duration);
+			printf("%-8s %-8s %10.2f %12.1f %12.1f\n", Names[Strength], Predict ? "On" : "Off", Jitter, 1000.0f * Lag / SWEEP_SPEED, Flick);
+		}
+	}
+	RunPinhole();
+	return 0;
+}
@@ -0,0 +1,277 @@
+// (c) Charlie Cole 2017
+//
+// This is licensed under
+// - Creative Commons Attribution-NonCommercial 3.0 Unported
+// - https://creativecommons.org/licenses/by-nc/3.0/
+// - Or see LICENSE.txt
+//
+// The short of it is...
+//   You are free to:
+//     Share — copy and redistribute the material in any medium or format
+//     Adapt — remix, transform, and build upon the material
+//   Under the following terms:
+//     NonCommercial — You may not use the material for commercial purposes.
+//     Attribution — You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+
+
+// Reference model for the GunCon 2 engine. Builds the sync pulses of 480i, 240p and 576i video (equalising and
+// broad pulses included, with some jitter) and runs them through the spot generator's line counting and sync
+// measurement (GunCon2MeasureSync). Then, for random aim points, compares the engine's output with a gun that
+// only knows the picture: the beam crosses the aim on the line whose time after vertical sync is nearest it and
+// the gun latches its free running 12MHz counter against that line's own (jittered) horizontal sync.
+// The gun counts from somewhere else to the spot generator, which is what DELAY and LINE DELAY are set for, so
+// each formula is scored after taking out the difference it most often has from the gun (its origin).
+// The old fixed formula (rounded down line, no field parity) is scored the same way for comparison. The cable
+// settings were set up against it on 480i (the first mode), so shifts are from the old formula's 480i origin.
+// With the shipped offsets the engine's must be 0 in every mode or the settings would need setting again, exits
+// with 1 if not. The X formula is unchanged so only its shift is shown.
+//
+// Usage: guncon2_model [aims per field]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <map>
+#include <vector>
+#include <random>
+#include "video_timing.h"
+#include "guncon2.h"
+
+#define ARRAY_NUM(x) (sizeof(x)/sizeof(x[0]))
+#define NUM_FIELDS 40
+#define SYNC_JITTER 8				// Give or take 0.1us on each edge (80ths of a microsecond)
+#define GUN_CLOCK (12.0 / 80.0)		// 12MHz counts per 80th of a microsecond
+#define GUNCON2_DELAY 15			// The GunCon 2 cable's default settings (CableSettings in main.cpp)
+#define GUNCON2_LINE_DELAY 8
+
+struct VideoMode
+{
+	const char *Name;
+	double LinePeriod;		// 80ths of a microsecond
+	double FieldLines;		// x.5 for interlaced
+	int LineDuration;
+	int VisibleLines;
+};
+
+static const VideoMode Modes[] =
+{
+	{ "480i", 80 * 63.556, 262.5, TIMING_LINE_DURATION_NTSC, TIMING_VISIBLE_LINES_NTSC },
+	{ "240p", 80 * 63.556, 262.0, TIMING_LINE_DURATION_NTSC, TIMING_VISIBLE_LINES_NTSC },
+	{ "576i", 80 * 64.0, 312.5, TIMING_LINE_DURATION, TIMING_VISIBLE_LINES },
+	{ "480i slow", 80 * 64.2, 262.5, TIMING_LINE_DURATION_NTSC, TIMING_VISIBLE_LINES_NTSC },
+};
+
+struct Pulse
+{
+	double Nominal;		// Where the picture has it (the TV's deflection follows this)
+	double Start;		// Where the edge really is
+	double Width;
+	double FieldStart;	// Nominal start of the field it's in
+};
+
+// Vertical interval of 6 equalising, 6 broad and 6 equalising pulses every half line from the start of each
+// field, normal syncs on the whole line grid in between
+static std::vector<Pulse> MakeSyncs(const VideoMode &Mode, std::mt19937 &Random)
+{
+	std::uniform_real_distribution<double> Jitter(-SYNC_JITTER, SYNC_JITTER);
+	double H = Mode.LinePeriod;
+	std::vector<Pulse> Syncs;
+	for (int Field = 0; Field < NUM_FIELDS; Field++)
+	{
+		double FieldStart = Field * Mode.FieldLines * H;
+		double FieldEnd = (Field + 1) * Mode.FieldLines * H;
+		for (int k = 0; k < 18; k++)
+		{
+			double Width = (k >= 6 && k < 12) ? (H / 2 - 80 * 4.7) : 80 * 2.3;
+			double Nominal = FieldStart + k * H / 2;
+			Syncs.push_back({ Nominal, Nominal + Jitter(Random), Width + Jitter(Random), FieldStart });
+		}
+		for (double Line = ceil((FieldStart + 9 * H) / H - 1e-6); Line * H < FieldEnd - 1e-6; Line++)
+			Syncs.push_back({ Line * H, Line * H + Jitter(Random), 80 * 4.7 + Jitter(Random), FieldStart });
+	}
+	return Syncs;
+}
+
+// What the spot generator makes of each field, and the syncs it counted as each of its lines
+struct FieldInfo
+{
+	double FieldStart;
+	bool bLowerField;
+	uint32_t LinePeriod;
+	std::vector<const Pulse*> Lines; // Indexed by the spot generator's line number
+};
+
+static std::vector<FieldInfo> MeasureFields(const std::vector<Pulse> &Syncs)
+{
+	std::vector<FieldInfo> Fields;
+	GunCon2LineTiming Timing = {};
+	int CurrentLine = 0;
+	for (size_t i = 1; i < Syncs.size(); i++)
+	{
+		// At the start of each sync, with the width of the previous one (as main.cpp SpotGeneratorInnerLoop sees them)
+		uint32_t Time = (uint32_t)Syncs[i - 1].Width;
+		uint32_t Interval = (uint32_t)(Syncs[i].Start - Syncs[i - 1].Start);
+		bool bFieldStart = false;
+		if ((Time > TIMING_VSYNC_THRESHOLD) || (CurrentLine == 0 && Time < TIMING_SHORT_SYNC_THRESHOLD))
+		{
+			bFieldStart = (CurrentLine > 200 && CurrentLine < 400);
+			CurrentLine = 0;
+		}
+		else
+		{
+			CurrentLine++;
+		}
+		GunCon2MeasureSync(Timing, Time, Interval, bFieldStart);
+		if (bFieldStart)
+		{
+			FieldInfo Info;
+			Info.FieldStart = Syncs[i].FieldStart;
+			Info.bLowerField = Timing.bLowerField;
+			Info.LinePeriod = Timing.LinePeriod;
+			Fields.push_back(Info);
+		}
+		if (!Fields.empty())
+		{
+			std::vector<const Pulse*> &Lines = Fields.back().Lines;
+			Lines.resize(CurrentLine + 1, nullptr);
+			Lines[CurrentLine] = &Syncs[i];
+		}
+	}
+	return Fields;
+}
+
+// Most common value, which is taken as where the gun counts from
+static int Mode(const std::vector<int> &Differences)
+{
+	std::map<int, int> Counts;
+	for (int Difference : Differences)
+		Counts[Difference]++;
+	int Best = 0, BestCount = -1;
+	for (const auto &Count : Counts)
+	{
+		if (Count.second > BestCount)
+		{
+			Best = Count.first;
+			BestCount = Count.second;
+		}
+	}
+	return Best;
+}
+
+struct Score
+{
+	int Origin;		// Most common difference from the gun, which is taken out
+	double Right;	// Fraction of aims on the gun's value
+	int Worst;		// Furthest from it
+};
+
+static Score Compare(const std::vector<int> &Gun, const std::vector<int> &Formula)
+{
+	std::vector<int> Differences(Gun.size());
+	for (size_t i = 0; i < Gun.size(); i++)
+		Differences[i] = Formula[i] - Gun[i];
+	Score Result = { Mode(Differences), 0.0, 0 };
+	for (int Difference : Differences)
+	{
+		int Error = abs(Difference - Result.Origin);
+		Result.Right += (Error == 0);
+		Result.Worst = (Error > Result.Worst) ? Error : Result.Worst;
+	}
+	Result.Right /= Differences.size();
+	return Result;
+}
+
+int main(int argc, char **argv)
+{
+	int AimsPerField = (argc > 1) ? atoi(argv[1]) : 2000;
+	std::mt19937 Random(1);
+	std::uniform_real_distribution<float> Unit(0.0f, 1023.0f);
+	std::uniform_real_distribution<double> ClockPhase(0.0, 1.0);
+
+	printf("Fields with the right parity, aims on the gun's line and 12MHz count, the engine's worst count error\n");
+	printf("and shifts from the old formula's 480i origin (lines and counts, with DELAY %d and LINE DELAY %d)\n", GUNCON2_DELAY, GUNCON2_LINE_DELAY);
+	printf("%-10s %8s %8s %10s %8s %10s %8s %8s %10s %8s\n", "Video", "Line us", "Parity", "Engine Y", "Y shift", "Engine X", "X worst", "X shift", "Old Y", "Old shift");
+	int Result = 0;
+	const Score *ReferenceY = nullptr, *ReferenceX = nullptr;
+	Score OldYScores[ARRAY_NUM(Modes)], OldXScores[ARRAY_NUM(Modes)];
+	for (int m = 0; m < (int)ARRAY_NUM(Modes); m++)
+	{
+		const VideoMode &Video = Modes[m];
+		double H = Video.LinePeriod;
+		std::vector<Pulse> Syncs = MakeSyncs(Video, Random);
+		std::vector<FieldInfo> Fields = MeasureFields(Syncs);
+
+		// AimLine counts the spot generator's lines of a field that starts on a whole line (the upper one)
+		const FieldInfo *Upper = nullptr;
+		for (size_t f = 1; f < Fields.size() && !Upper; f++)
+		{
+			if (fmod(Fields[f].FieldStart / H + 0.25, 1.0) < 0.5)
+				Upper = &Fields[f];
+		}
+
+		int NumParityRight = 0;
+		std::vector<int> GunY, GunX, EngineY, EngineX, OldY, OldX;
+		for (size_t f = 1; f < Fields.size(); f++) // First field is measured without a previous one
+		{
+			const FieldInfo &Field = Fields[f];
+			bool bTrulyLower = fmod(Field.FieldStart / H + 0.25, 1.0) >= 0.5;
+			NumParityRight += (Field.bLowerField == bTrulyLower);
+			std::vector<const Pulse*> Lit; // Syncs of lines the picture has in this field
+			for (const Pulse &Sync : Syncs)
+			{
+				if (Sync.FieldStart == Field.FieldStart && Sync.Width < TIMING_VSYNC_THRESHOLD)
+					Lit.push_back(&Sync);
+			}
+
+			for (int a = 0; a < AimsPerField; a++)
+			{
+				// As main.cpp positions the reticule for a calibrated aim
+				float SpotX = Unit(Random);
+				float SpotY = Unit(Random);
+				int XPosition = TIMING_BACK_PORCH + (Video.LineDuration * (int)SpotX) / 1024;
+				int StartLine = TIMING_BLANKED_LINES + (Video.VisibleLines * (int)SpotY) / 1024;
+				int AimLine = (TIMING_BLANKED_LINES * GUNCON2_LINE_SCALE) + (Video.VisibleLines * (int)(SpotY * GUNCON2_LINE_SCALE)) / 1024;
+
+				// Where that is on the screen, as time after vertical sync
+				int Whole = AimLine / GUNCON2_LINE_SCALE;
+				double Aim = Upper->Lines[Whole]->Nominal - Upper->FieldStart + (AimLine % GUNCON2_LINE_SCALE) * H / GUNCON2_LINE_SCALE;
+
+				// The gun sees the line lit nearest the aim (the earlier one if it's half way as that's lit first),
+				// counts whole lines since vertical sync and times the beam from the line's horizontal sync
+				const Pulse *Nearest = nullptr;
+				for (const Pulse *Sync : Lit)
+				{
+					if (!Nearest || fabs(Sync->Nominal - Field.FieldStart - Aim) < fabs(Nearest->Nominal - Field.FieldStart - Aim) - 1e-6)
+						Nearest = Sync;
+				}
+				double Crossing = Nearest->Nominal + XPosition;
+				GunY.push_back((int)floor((Nearest->Nominal - Field.FieldStart) / H + 0.25));
+				GunX.push_back((int)floor((Crossing - Nearest->Start) * GUN_CLOCK + ClockPhase(Random)));
+
+				uint16_t X, Y;
+				GunCon2Position(AimLine, XPosition, Field.bLowerField, GUNCON2_X_OFFSET + GUNCON2_DELAY * 8, GUNCON2_Y_OFFSET + GUNCON2_LINE_DELAY, X, Y);
+				EngineY.push_back(Y);
+				EngineX.push_back(X);
+
+				// What WiimoteTask used to send
+				OldY.push_back(StartLine - 8 + GUNCON2_LINE_DELAY);
+				OldX.push_back((XPosition + 40 * 8 + GUNCON2_DELAY * 8) * 12 / 80);
+			}
+		}
+		Score EngineYScore = Compare(GunY, EngineY), EngineXScore = Compare(GunX, EngineX);
+		OldYScores[m] = Compare(GunY, OldY);
+		OldXScores[m] = Compare(GunX, OldX);
+		ReferenceY = ReferenceY ? ReferenceY : &OldYScores[m];
+		ReferenceX = ReferenceX ? ReferenceX : &OldXScores[m];
+		int NumFields = (int)Fields.size() - 1;
+		int YShift = EngineYScore.Origin - ReferenceY->Origin, XShift = EngineXScore.Origin - ReferenceX->Origin;
+		printf("%-10s %8.3f %4d/%-3d %9.1f%% %8d %9.1f%% %8d %8d %9.1f%% %8d\n", Video.Name, Fields.back().LinePeriod / 80.0, NumParityRight, NumFields,
+			100.0 * EngineYScore.Right, YShift, 100.0 * EngineXScore.Right, EngineXScore.Worst, XShift,
+			100.0 * OldYScores[m].Right, OldYScores[m].Origin - ReferenceY->Origin);
+		if (YShift != 0 || XShift != 0)
+			Result = 1;
+	}
+	if (Result)
+		printf("ERROR: The engine's origin has moved, the cable settings would need setting again\n");
+	return Result;
+}
@@ -0,0 +1,1170 @@
+// (c) Charlie Cole 2017
+//
+// This is licensed under
+// - Creative Commons Attribution-NonCommercial 3.0 Unported
+// - https://creativecommons.org/licenses/by-nc/3.0/
+// - Or see LICENSE.txt
+//
+// The short of it is...
+//   You are free to:
+//     Share — copy and redistribute the material in any medium or format
+//     Adapt — remix, transform, and build upon the material
+//   Under the following terms:
+//     NonCommercial — You may not use the material for commercial purposes.
+//     Attribution — You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+
+// Runs the Wiimote Bluetooth stack (main/esp_wiimote.cpp) on a desktop so changes can be checked
+// without real Wiimotes. Either replays a captured H4 stream (btsnoop or the "Sending:"/"Receiving:"
+// lines printed with WIIMOTE_VERBOSE) or simulates a controller with Wiimotes attached.
+//
+// Usage: hci_replay [options] [trace]
+//   -s        Simulate a controller instead of replaying a trace
+//   -p N      Number of players (Wiimotes) to create (default 2)
+//   -n N      Simulated IR reports per Wiimote (default 2000)
+//   -f N      Re-inject every IR report N extra times to measure throughput
+//   -d        Simulate link loss of the first Wiimote after the reports and check it reconnects
+//   -j N      Simulated report timing jitter in microseconds
+//   -l N      Simulated report loss in percent
+//   -e        Simulated Wiimotes have an extension plugged in
+//   -m        Simulated Wiimotes have a MotionPlus (players always look for one)
+//   -W N      Simulated register write failures in percent
+//   -N N      Simulated register writes lost without an acknowledge in percent
+//   -F        Ask for full IR mode
+//   -r        Players remember the simulated Wiimotes (in reverse order) so they're paged without an inquiry
+//   -o        With -r, player 1's remembered Wiimote is switched off so it falls back to inquiry
+//   -a        Simulated Wiimotes are woken with a button and connect to us rather than being discoverable
+//   -x        With -a -r, a Wiimote's own connection wins over our page to it so the page fails just before
+//             the accepted link completes
+//   -w FILE   Write the simulated session out as a dump that can be replayed
+//   -v        Print mismatches between traced and generated outbound packets
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include "esp_wiimote.h"
+
+#define ARRAY_NUM(x) (sizeof(x)/sizeof(x[0]))
+
+enum
+{
+	H4_COMMAND = 1,
+	H4_ACL = 2,
+	H4_EVENT = 4
+};
+
+struct Packet
+{
+	Packet()
+	{
+		bReceived = false;
+		Timestamp = 0;
+	}
+
+	bool bReceived; // Controller to host
+	uint64_t Timestamp; // Microseconds, 0 if not known
+	std::vector<uint8_t> Data; // Including H4 type byte
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Host controller (see Controller in esp_wiimote.cpp)
+/////////////////////////////////////////////////////////////////////////////////////////////
+
+class HostController
+{
+public:
+	static void Init(int (*Receive)(uint8_t *Data, uint16_t Length), void (*SendAvailable)());
+	static void DeInit();
+	static bool CanSend();
+	static void Send(uint8_t *Data, uint16_t Length);
+	static uint32_t GetTime();
+};
+
+static int (*ReceiveCallback)(uint8_t *Data, uint16_t Length) = nullptr;
+static uint64_t HostTime = 0; // Follows the trace/simulation rather than the wall clock
+static std::deque<Packet> SentPackets;
+static FILE *DumpFile = nullptr;
+
+static void DumpPacket(const char *Direction, const uint8_t *Data, size_t Length)
+{
+	if (DumpFile)
+	{
+		fprintf(DumpFile, "%s", Direction);
+		for (size_t i = 0; i < Length; i++)
+		{
+			fprintf(DumpFile, " %02x", Data[i]);
+		}
+		fprintf(DumpFile, "\n");
+	}
+}
+
+void HostController::Init(int (*Receive)(uint8_t *Data, uint16_t Length), void (*SendAvailable)())
+{
+	ReceiveCallback = Receive;
+}
+
+void HostController::DeInit()
+{
+	ReceiveCallback = nullptr;
+}
+
+bool HostController::CanSend()
+{
+	return true;
+}
+
+void HostController::Send(uint8_t *Data, uint16_t Length)
+{
+	Packet Sent;
+	Sent.bReceived = false;
+	Sent.Data.assign(Data, Data + Length);
+	SentPackets.push_back(Sent);
+	DumpPacket("Sending:", Data, Length);
+}
+
+uint32_t HostController::GetTime()
+{
+	return (uint32_t)HostTime;
+}
+
+static void Receive(const std::vector<uint8_t> &Data)
+{
+	DumpPacket("Receiving:", Data.data(), Data.size());
+	ReceiveCallback(const_cast<uint8_t*>(Data.data()), (uint16_t)Data.size());
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Statistics
+/////////////////////////////////////////////////////////////////////////////////////////////
+
+struct Stats
+{
+	Stats()
+	{
+		NumEvents = NumACL = NumSent = NumMismatched = 0;
+		NumInquiries = NumPages = NumCrossedPages = NumLostWrites = 0;
+		WallSeconds = CPUSeconds = 0.0;
+	}
+
+	int NumEvents;
+	int NumACL;
+	int NumSent;
+	int NumMismatched;
+	int NumInquiries; // Simulated only
+	int NumPages;
+	int NumCrossedPages;
+	int NumLostWrites;
+	double WallSeconds;
+	double CPUSeconds;
+};
+
+static Stats GStats;
+
+// Little endian like on the wire
+static void GetSimulatedAddress(int Index, uint8_t *Address)
+{
+	uint8_t SimAddress[6] = { (uint8_t)(0x10 + Index), 0x32, 0x54, 0x76, 0x98, 0x00 };
+	memcpy(Address, SimAddress, sizeof(SimAddress));
+}
+static std::vector<IWiimote*> Wiimotes;
+static std::vector<int32_t> LastFrame;
+static std::vector<int> ReportsSeen;
+static std::vector<bool> ReachedOpen;
+
+static void TimedTick()
+{
+	std::chrono::steady_clock::time_point WallStart = std::chrono::steady_clock::now();
+	clock_t CPUStart = clock();
+	GWiimoteManager.Tick();
+	GStats.CPUSeconds += (double)(clock() - CPUStart) / CLOCKS_PER_SEC;
+	GStats.WallSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - WallStart).count();
+
+	// Watch the Wiimotes the same way PlayerInput does
+	for (size_t i = 0; i < Wiimotes.size(); i++)
+	{
+		const WiimoteData *Data = Wiimotes[i]->GetData();
+		if (Data->FrameNumber != LastFrame[i])
+		{
+			ReportsSeen[i] += (Data->FrameNumber > LastFrame[i]) ? Data->FrameNumber - LastFrame[i] : 1;
+			LastFrame[i] = Data->FrameNumber;
+		}
+		if (Wiimotes[i]->IsConnected())
+		{
+			ReachedOpen[i] = true;
+		}
+	}
+}
+
+static void DeliverAndTick(const std::vector<uint8_t> &Data)
+{
+	if (Data[0] == H4_EVENT)
+		GStats.NumEvents++;
+	else
+		GStats.NumACL++;
+	Receive(Data);
+	TimedTick();
+}
+
+static bool IsIRReport(const std::vector<uint8_t> &Data)
+{
+	// H4 type, ACL header (4), L2CAP header (4), 0xA1, report
+	if (Data.size() < 11 || Data[0] != H4_ACL || Data[9] != 0xA1)
+		return false;
+	uint16_t Channel = Data[7] | (Data[8] << 8);
+	return Channel != 1 && (Data[10] == 0x33 || Data[10] == 0x37 || Data[10] == 0x3E || Data[10] == 0x3F);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Trace loading
+/////////////////////////////////////////////////////////////////////////////////////////////
+
+static uint32_t ReadBigEndian32(const uint8_t *Data)
+{
+	return (Data[0] << 24) | (Data[1] << 16) | (Data[2] << 8) | Data[3];
+}
+
+static bool LoadBTSnoop(FILE *File, std::vector<Packet> &Packets)
+{
+	uint8_t Header[16];
+	if (fread(Header, 1, sizeof(Header), File) != sizeof(Header) || memcmp(Header, "btsnoop\0", 8) != 0)
+		return false;
+	uint32_t DataLink = ReadBigEndian32(Header + 12);
+	if (DataLink != 1001 && DataLink != 1002)
+	{
+		printf("Unsupported btsnoop datalink %u\n", DataLink);
+		return false;
+	}
+	uint8_t Record[24];
+	while (fread(Record, 1, sizeof(Record), File) == sizeof(Record))
+	{
+		uint32_t IncludedLength = ReadBigEndian32(Record + 4);
+		uint32_t Flags = ReadBigEndian32(Record + 8);
+		Packet Read;
+		Read.bReceived = (Flags & 1) != 0;
+		Read.Timestamp = ((uint64_t)ReadBigEndian32(Record + 16) << 32) | ReadBigEndian32(Record + 20);
+		if (DataLink == 1001) // Un-encapsulated HCI so rebuild the H4 type
+		{
+			bool bCommandOrEvent = (Flags & 2) != 0;
+			Read.Data.push_back(bCommandOrEvent ? (Read.bReceived ? H4_EVENT : H4_COMMAND) : H4_ACL);
+		}
+		size_t Start = Read.Data.size();
+		Read.Data.resize(Start + IncludedLength);
+		if (fread(Read.Data.data() + Start, 1, IncludedLength, File) != IncludedLength)
+			break;
+		if (Read.Data.size() > 1)
+			Packets.push_back(Read);
+	}
+	return true;
+}
+
+static void LoadDump(FILE *File, std::vector<Packet> &Packets)
+{
+	char Line[4096];
+	while (fgets(Line, sizeof(Line), File))
+	{
+		const char *Receiving = strstr(Line, "Receiving:");
+		const char *Sending = strstr(Line, "Sending:");
+		if (!Receiving && !Sending)
+			continue;
+		Packet Read;
+		Read.bReceived = (Receiving != nullptr);
+		const char *Hex = Receiving ? Receiving + strlen("Receiving:") : Sending + strlen("Sending:");
+		unsigned int Byte;
+		int Consumed;
+		while (sscanf(Hex, " %2x%n", &Byte, &Consumed) == 1)
+		{
+			Read.Data.push_back((uint8_t)Byte);
+			Hex += Consumed;
+		}
+		if (Read.Data.size() > 1)
+			Packets.push_back(Read);
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Simulated controller with Wiimotes
+/////////////////////////////////////////////////////////////////////////////////////////////
+
+class SimulatedController
+{
+public:
+	struct SimWiimote
+	{
+		uint8_t Address[6];
+		uint16_t Handle;
+		bool bConnected;
+		uint16_t HostCID[2]; // Control, Data
+		uint16_t RemoteCID[2];
+		uint8_t ReportMode;
+		int Frame;
+		bool bMotionPlusActive;
+		bool bPageLost; // Paged while it was connecting to us, fails when its own connection completes
+	};
+
+	SimulatedController(int NumWiimotes, int InJitter, int InLossPercent, int InWriteErrorPercent, int InWriteLossPercent, bool bInExtension, bool bInMotionPlus, bool bInWakeUp, bool bInCrossPages)
+	{
+		bMotionPlus = bInMotionPlus;
+		WriteErrorPercent = InWriteErrorPercent;
+		WriteLossPercent = InWriteLossPercent;
+		bWakeUp = bInWakeUp;
+		bCrossPages = bInCrossPages;
+		NextCID = 0x40;
+		bExtension = bInExtension;
+		Jitter = InJitter;
+		LossPercent = InLossPercent;
+		ReportTime = 0;
+		ReportTimestamp = 0;
+		for (int i = 0; i < NumWiimotes; i++)
+		{
+			SimWiimote Sim;
+			memset(&Sim, 0, sizeof(Sim));
+			GetSimulatedAddress(i, Sim.Address);
+			Sim.Handle = 0x80 + i;
+			Remotes.push_back(Sim);
+		}
+	}
+
+	// Turns everything the stack sent into replies from the controller/Wiimotes
+	void Process(const Packet &Sent)
+	{
+		const std::vector<uint8_t> &Data = Sent.Data;
+		if (Data[0] == H4_COMMAND && Data.size() >= 4)
+		{
+			ProcessCommand(Data[1] | (Data[2] << 8), Data.data() + 4, Data[3]);
+		}
+		else if (Data[0] == H4_ACL && Data.size() >= 9)
+		{
+			uint16_t Handle = (Data[1] | (Data[2] << 8)) & 0xFFF;
+			SimWiimote *Sim = FindByHandle(Handle);
+			if (Sim)
+			{
+				uint16_t Channel = Data[7] | (Data[8] << 8);
+				if (Channel == 1)
+					ProcessSignal(*Sim, Data.data() + 9);
+				else
+					ProcessOutputReport(*Sim, Data.data() + 9, Data.size() - 9);
+			}
+			uint8_t Completed[] = { 0x13, 0x05, 0x01, (uint8_t)Handle, (uint8_t)(Handle >> 8), 0x01, 0x00 };
+			QueueEvent(Completed, sizeof(Completed));
+		}
+	}
+
+	bool HasPending()
+	{
+		return !Pending.empty();
+	}
+
+	Packet PopPending()
+	{
+		Packet Front = Pending.front();
+		Pending.pop_front();
+		return Front;
+	}
+
+	// Generates one IR report from every Wiimote that's been asked to report, 10ms after the last lot
+	void GenerateReports()
+	{
+		ReportTime = (ReportTime + 10000 > HostTime) ? ReportTime + 10000 : HostTime; // Starts whenever the stack asked for reports
+		for (size_t i = 0; i < Remotes.size(); i++)
+		{
+			SimWiimote &Sim = Remotes[i];
+			if (!Sim.bConnected || (Sim.ReportMode != 0x33 && Sim.ReportMode != 0x37 && Sim.ReportMode != 0x3E))
+				continue;
+			if (LossPercent && (rand() % 100) < LossPercent)
+			{
+				Sim.Frame++;
+				continue;
+			}
+			ReportTimestamp = ReportTime + (Jitter ? rand() % (2 * Jitter + 1) - Jitter : 0);
+			// Two sensor bar LEDs sweeping around the camera's view
+			float Angle = Sim.Frame * 0.01f + i;
+			int CentreX = 512 + (int)(300.0f * cosf(Angle));
+			int CentreY = 384 + (int)(200.0f * sinf(Angle));
+			int Spots[4][3] = { { CentreX - 100, CentreY, 3 }, { CentreX + 100, CentreY, 3 }, { 1023, 1023, 15 }, { 1023, 1023, 15 } };
+			if (Sim.ReportMode == 0x3E)
+			{
+				QueueFullReport(Sim, 0x3E, &Spots[0]);
+				ReportTimestamp += 5000; // Assume the pair share the usual 10ms slot
+				QueueFullReport(Sim, 0x3F, &Spots[2]);
+				ReportTimestamp = 0;
+				Sim.Frame++;
+				continue;
+			}
+			std::vector<uint8_t> Report;
+			Report.push_back(0xA1);
+			Report.push_back(Sim.ReportMode);
+			Report.push_back(0x00); // Buttons
+			Report.push_back(0x00);
+			Report.push_back(0x80); // Accelerometer at rest
+			Report.push_back(0x80);
+			Report.push_back(0x9A);
+			if (Sim.ReportMode == 0x37)
+			{
+				for (int Spot = 0; Spot < 4; Spot += 2)
+				{
+					int X1 = Spots[Spot][0], Y1 = Spots[Spot][1];
+					int X2 = Spots[Spot + 1][0], Y2 = Spots[Spot + 1][1];
+					Report.push_back(X1 & 0xFF);
+					Report.push_back(Y1 & 0xFF);
+					Report.push_back((((Y1 >> 8) & 3) << 6) | (((X1 >> 8) & 3) << 4) | (((Y2 >> 8) & 3) << 2) | ((X2 >> 8) & 3));
+					Report.push_back(X2 & 0xFF);
+					Report.push_back(Y2 & 0xFF);
+				}
+				if (Sim.bMotionPlusActive)
+				{
+					// Turning slowly: yaw +10 deg/s, roll 0, pitch -5 deg/s (20 units per deg/s in slow mode)
+					int Yaw = 8192 + 200, Roll = 8192, Pitch = 8192 - 100;
+					Report.push_back(Yaw & 0xFF);
+					Report.push_back(Roll & 0xFF);
+					Report.push_back(Pitch & 0xFF);
+					Report.push_back(((Yaw >> 6) & 0xFC) | 0x03); // Yaw and pitch in slow mode
+					Report.push_back(((Roll >> 6) & 0xFC) | 0x02); // Roll in slow mode, no extension behind it
+					Report.push_back(((Pitch >> 6) & 0xFC) | 0x02); // MotionPlus data
+				}
+				else
+				{
+					for (int Byte = 0; Byte < 6; Byte++)
+					{
+						Report.push_back(0x00); // Extension data
+					}
+				}
+			}
+			else
+			{
+				for (int Spot = 0; Spot < 4; Spot++)
+				{
+					int X = Spots[Spot][0];
+					int Y = Spots[Spot][1];
+					Report.push_back(X & 0xFF);
+					Report.push_back(Y & 0xFF);
+					Report.push_back((((Y >> 8) & 3) << 6) | (((X >> 8) & 3) << 4) | (Spots[Spot][2] & 0xF));
+				}
+			}
+			QueueData(Sim, Sim.HostCID[1], Report.data(), Report.size());
+			ReportTimestamp = 0;
+			Sim.Frame++;
+		}
+	}
+
+	void QueueFullReport(SimWiimote &Sim, uint8_t ReportCode, const int (*Spots)[3])
+	{
+		std::vector<uint8_t> Report;
+		Report.push_back(0xA1);
+		Report.push_back(ReportCode);
+		Report.push_back(0x00); // Buttons (and Z accelerometer bits)
+		Report.push_back(0x00);
+		Report.push_back(0x80); // X or Y accelerometer
+		for (int Spot = 0; Spot < 2; Spot++)
+		{
+			int X = Spots[Spot][0];
+			int Y = Spots[Spot][1];
+			bool bVisible = (X != 1023 || Y != 1023);
+			Report.push_back(X & 0xFF);
+			Report.push_back(Y & 0xFF);
+			Report.push_back((((Y >> 8) & 3) << 6) | (((X >> 8) & 3) << 4) | (Spots[Spot][2] & 0xF));
+			Report.push_back(bVisible ? (uint8_t)((X - 4) >> 3) : 0xFF); // Bounding box
+			Report.push_back(bVisible ? (uint8_t)((Y - 4) >> 3) : 0xFF);
+			Report.push_back(bVisible ? (uint8_t)((X + 4) >> 3) : 0xFF);
+			Report.push_back(bVisible ? (uint8_t)((Y + 4) >> 3) : 0xFF);
+			Report.push_back(0x00);
+			Report.push_back(bVisible ? 0xC0 : 0xFF); // Intensity
+		}
+		QueueData(Sim, Sim.HostCID[1], Report.data(), Report.size());
+	}
+
+	void Disconnect(int Index, uint8_t Reason)
+	{
+		SimWiimote &Sim = Remotes[Index];
+		if (!Sim.bConnected)
+			return;
+		uint8_t Event[] = { 0x05, 0x04, 0x00, (uint8_t)Sim.Handle, (uint8_t)(Sim.Handle >> 8), Reason };
+		QueueEvent(Event, sizeof(Event));
+		Sim.bConnected = false;
+		Sim.ReportMode = 0;
+		Sim.bMotionPlusActive = false; // Back to how it powers up
+	}
+
+private:
+	SimWiimote* FindByHandle(uint16_t Handle)
+	{
+		for (size_t i = 0; i < Remotes.size(); i++)
+		{
+			if (Remotes[i].bConnected && Remotes[i].Handle == Handle)
+				return &Remotes[i];
+		}
+		return nullptr;
+	}
+
+	SimWiimote* FindByAddress(const uint8_t *Address)
+	{
+		for (size_t i = 0; i < Remotes.size(); i++)
+		{
+			if (memcmp(Remotes[i].Address, Address, 6) == 0)
+				return &Remotes[i];
+		}
+		return nullptr;
+	}
+
+	void QueueEvent(const uint8_t *Event, size_t Length)
+	{
+		Packet Data;
+		Data.bReceived = true;
+		Data.Data.push_back(H4_EVENT);
+		Data.Data.insert(Data.Data.end(), Event, Event + Length);
+		Pending.push_back(Data);
+	}
+
+	void QueueCommandComplete(uint16_t OpCode, const uint8_t *Return, size_t ReturnLength)
+	{
+		std::vector<uint8_t> Event;
+		Event.push_back(0x0E);
+		Event.push_back((uint8_t)(3 + ReturnLength));
+		Event.push_back(1); // NumPackets
+		Event.push_back(OpCode & 0xFF);
+		Event.push_back(OpCode >> 8);
+		Event.insert(Event.end(), Return, Return + ReturnLength);
+		QueueEvent(Event.data(), Event.size());
+	}
+
+	void QueueCommandStatus(uint16_t OpCode, uint8_t Status)
+	{
+		uint8_t Event[] = { 0x0F, 0x04, Status, 0x01, (uint8_t)OpCode, (uint8_t)(OpCode >> 8) };
+		QueueEvent(Event, sizeof(Event));
+	}
+
+	void QueueACL(SimWiimote &Sim, uint16_t Channel, const uint8_t *Payload, size_t Length)
+	{
+		Packet ACL;
+		ACL.bReceived = true;
+		ACL.Timestamp = ReportTimestamp;
+		std::vector<uint8_t> &Data = ACL.Data;
+		Data.push_back(H4_ACL);
+		Data.push_back(Sim.Handle & 0xFF);
+		Data.push_back(((Sim.Handle >> 8) & 0xF) | 0x20);
+		Data.push_back((uint8_t)(Length + 4));
+		Data.push_back((uint8_t)((Length + 4) >> 8));
+		Data.push_back((uint8_t)Length);
+		Data.push_back((uint8_t)(Length >> 8));
+		Data.push_back(Channel & 0xFF);
+		Data.push_back(Channel >> 8);
+		Data.insert(Data.end(), Payload, Payload + Length);
+		Pending.push_back(ACL);
+	}
+
+	void QueueSignal(SimWiimote &Sim, uint8_t Code, uint8_t MsgId, const uint8_t *Payload, size_t Length)
+	{
+		std::vector<uint8_t> Signal;
+		Signal.push_back(Code);
+		Signal.push_back(MsgId);
+		Signal.push_back((uint8_t)Length);
+		Signal.push_back((uint8_t)(Length >> 8));
+		Signal.insert(Signal.end(), Payload, Payload + Length);
+		QueueACL(Sim, 1, Signal.data(), Signal.size());
+	}
+
+	void QueueData(SimWiimote &Sim, uint16_t Channel, const uint8_t *Report, size_t Length)
+	{
+		QueueACL(Sim, Channel, Report, Length);
+	}
+
+	void ProcessCommand(uint16_t OpCode, const uint8_t *Params, uint8_t Length)
+	{
+		switch (OpCode)
+		{
+		case 0x0401: // Inquiry
+		{
+			GStats.NumInquiries++;
+			QueueCommandStatus(OpCode, 0);
+			// Report everything found in one event like controllers that batch results
+			int MaxResponses = Params[4] ? Params[4] : 255;
+			std::vector<SimWiimote*> Found;
+			for (size_t i = 0; i < Remotes.size() && (int)Found.size() < MaxResponses; i++)
+			{
+				if (!Remotes[i].bConnected && !bWakeUp)
+					Found.push_back(&Remotes[i]);
+			}
+			if (!Found.empty())
+			{
+				std::vector<uint8_t> Event;
+				Event.push_back(0x02);
+				Event.push_back((uint8_t)(1 + Found.size() * 14));
+				Event.push_back((uint8_t)Found.size());
+				for (size_t i = 0; i < Found.size(); i++)
+					Event.insert(Event.end(), Found[i]->Address, Found[i]->Address + 6);
+				for (size_t i = 0; i < Found.size(); i++)
+					Event.push_back(0x01); // Page_Scan_Repetition_Mode
+				for (size_t i = 0; i < Found.size() * 2; i++)
+					Event.push_back(0x00); // Reserved
+				for (size_t i = 0; i < Found.size(); i++)
+				{
+					Event.push_back(0x04); // Class
+					Event.push_back(0x25);
+					Event.push_back(0x00);
+				}
+				for (size_t i = 0; i < Found.size(); i++)
+				{
+					Event.push_back((uint8_t)(0x10 * i)); // Clock_Offset
+					Event.push_back(0x00);
+				}
+				QueueEvent(Event.data(), Event.size());
+			}
+			uint8_t Complete[] = { 0x01, 0x01, 0x00 };
+			QueueEvent(Complete, sizeof(Complete));
+			break;
+		}
+		case 0x0405: // Create_Connection
+		{
+			GStats.NumPages++;
+			QueueCommandStatus(OpCode, 0);
+			SimWiimote *Sim = FindByAddress(Params);
+			if (Sim && !Sim->bConnected && bWakeUp && bCrossPages)
+			{
+				Sim->bPageLost = true; // Its Connection_Request is already on the way
+				break;
+			}
+			uint8_t Event[] = { 0x03, 0x0B, 0x04, 0x00, 0x00, 0, 0, 0, 0, 0, 0, 0x01, 0x00 }; // Page timeout unless found
+			memcpy(Event + 5, Params, 6);
+			if (Sim && !Sim->bConnected)
+			{
+				Sim->bConnected = true;
+				Sim->Frame = 0;
+				Event[2] = 0x00;
+				Event[3] = Sim->Handle & 0xFF;
+				Event[4] = Sim->Handle >> 8;
+			}
+			QueueEvent(Event, sizeof(Event));
+			break;
+		}
+		case 0x0409: // Accept_Connection_Request
+		case 0x040A: // Reject_Connection_Request
+		{
+			QueueCommandStatus(OpCode, 0);
+			SimWiimote *Sim = FindByAddress(Params);
+			if (Sim && Sim->bPageLost)
+			{
+				uint8_t Lost[] = { 0x03, 0x0B, 0x04, 0x00, 0x00, 0, 0, 0, 0, 0, 0, 0x01, 0x00 }; // Our page timing out
+				memcpy(Lost + 5, Params, 6);
+				QueueEvent(Lost, sizeof(Lost));
+				Sim->bPageLost = false;
+				GStats.NumCrossedPages++;
+			}
+			uint8_t Event[] = { 0x03, 0x0B, 0x0F, 0x00, 0x00, 0, 0, 0, 0, 0, 0, 0x01, 0x00 }; // Unacceptable BD_ADDR unless accepted
+			memcpy(Event + 5, Params, 6);
+			if (Sim && !Sim->bConnected && OpCode == 0x0409)
+			{
+				Sim->bConnected = true;
+				Sim->Frame = 0;
+				Event[2] = 0x00;
+				Event[3] = Sim->Handle & 0xFF;
+				Event[4] = Sim->Handle >> 8;
+			}
+			QueueEvent(Event, sizeof(Event));
+			if (Sim && Sim->bConnected && OpCode == 0x0409)
+			{
+				// Open control then data like a Wiimote reconnecting to its Wii
+				for (int Pipe = 0; Pipe < 2; Pipe++)
+				{
+					uint16_t PSM = Pipe ? 0x13 : 0x11;
+					Sim->RemoteCID[Pipe] = NextCID++;
+					uint8_t Request[] = { (uint8_t)PSM, (uint8_t)(PSM >> 8), (uint8_t)Sim->RemoteCID[Pipe], (uint8_t)(Sim->RemoteCID[Pipe] >> 8) };
+					QueueSignal(*Sim, 0x02, (uint8_t)(0x40 + Pipe), Request, sizeof(Request));
+				}
+			}
+			break;
+		}
+		case 0x0406: // Disconnect
+		{
+			QueueCommandStatus(OpCode, 0);
+			uint16_t Handle = Params[0] | (Params[1] << 8);
+			for (size_t i = 0; i < Remotes.size(); i++)
+			{
+				if (Remotes[i].bConnected && Remotes[i].Handle == Handle)
+					Disconnect((int)i, 0x16);
+			}
+			break;
+		}
+		case 0x0807: // QoS_Setup
+		{
+			QueueCommandStatus(OpCode, 0);
+			uint8_t Event[] = { 0x0D, 0x15, 0x00, Params[0], Params[1], 0x00, Params[3], 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+			memcpy(Event + 7, Params + 4, 16); // Grant whatever was asked for
+			QueueEvent(Event, sizeof(Event));
+			break;
+		}
+		case 0x080D: // Write_Link_Policy_Settings
+		{
+			uint8_t Return[] = { 0x00, Params[0], Params[1] };
+			QueueCommandComplete(OpCode, Return, sizeof(Return));
+			break;
+		}
+		case 0x0C1A: // Write_Scan_Enable
+		{
+			uint8_t Return[] = { 0x00 };
+			QueueCommandComplete(OpCode, Return, sizeof(Return));
+			if (!bWakeUp || !(Params[0] & 0x02))
+				break;
+			for (size_t i = 0; i < Remotes.size(); i++)
+			{
+				if (Remotes[i].bConnected)
+					continue;
+				uint8_t Event[] = { 0x04, 0x0A, 0, 0, 0, 0, 0, 0, 0x04, 0x25, 0x00, 0x01 }; // Connection_Request from a Wiimote
+				memcpy(Event + 2, Remotes[i].Address, 6);
+				QueueEvent(Event, sizeof(Event));
+			}
+			break;
+		}
+		case 0x1005: // Read_Buffer_Size
+		{
+			uint8_t Return[] = { 0x00, 0xFD, 0x03, 0x40, 0x08, 0x00, 0x01, 0x00 }; // 1021 byte ACL, 8 ACL packets
+			QueueCommandComplete(OpCode, Return, sizeof(Return));
+			break;
+		}
+		case 0x1009: // Read_BD_ADDR
+		{
+			uint8_t Return[] = { 0x00, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11 };
+			QueueCommandComplete(OpCode, Return, sizeof(Return));
+			break;
+		}
+		default:
+		{
+			uint8_t Return[] = { 0x00 };
+			QueueCommandComplete(OpCode, Return, sizeof(Return));
+			break;
+		}
+		}
+	}
+
+	void ProcessSignal(SimWiimote &Sim, const uint8_t *Signal)
+	{
+		uint8_t Code = Signal[0];
+		uint8_t MsgId = Signal[1];
+		const uint8_t *Params = Signal + 4;
+		switch (Code)
+		{
+		case 0x02: // Connection request
+		{
+			uint16_t PSM = Params[0] | (Params[1] << 8);
+			uint16_t HostCID = Params[2] | (Params[3] << 8);
+			int Pipe = (PSM == 0x13) ? 1 : 0;
+			uint16_t RemoteCID = NextCID++;
+			Sim.HostCID[Pipe] = HostCID;
+			Sim.RemoteCID[Pipe] = RemoteCID;
+			uint8_t Response[] = { (uint8_t)RemoteCID, (uint8_t)(RemoteCID >> 8), (uint8_t)HostCID, (uint8_t)(HostCID >> 8), 0, 0, 0, 0 };
+			QueueSignal(Sim, 0x03, MsgId, Response, sizeof(Response));
+			break;
+		}
+		case 0x03: // Connection response to a channel we opened
+		{
+			uint16_t HostCID = Params[0] | (Params[1] << 8);
+			uint16_t RemoteCID = Params[2] | (Params[3] << 8);
+			int Pipe = (RemoteCID == Sim.RemoteCID[1]) ? 1 : 0;
+			Sim.HostCID[Pipe] = HostCID;
+			break;
+		}
+		case 0x04: // Configuration request
+		{
+			uint16_t RemoteCID = Params[0] | (Params[1] << 8);
+			uint16_t HostCID = (RemoteCID == Sim.RemoteCID[1]) ? Sim.HostCID[1] : Sim.HostCID[0];
+			uint8_t Response[] = { (uint8_t)HostCID, (uint8_t)(HostCID >> 8), 0, 0, 0, 0 };
+			QueueSignal(Sim, 0x05, MsgId, Response, sizeof(Response));
+			// Then configure our end like a real Wiimote does
+			uint8_t Config[] = { (uint8_t)HostCID, (uint8_t)(HostCID >> 8), 0, 0 };
+			QueueSignal(Sim, 0x04, 0x80 | MsgId, Config, sizeof(Config));
+			break;
+		}
+		case 0x06: // Disconnection request
+		{
+			uint8_t Response[4];
+			memcpy(Response, Params, sizeof(Response));
+			QueueSignal(Sim, 0x07, MsgId, Response, sizeof(Response));
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	void QueueStatus(SimWiimote &Sim)
+	{
+		bool bPluggedIn = bExtension || Sim.bMotionPlusActive;
+		uint8_t Status[] = { 0xA1, 0x20, 0x00, 0x00, (uint8_t)(bPluggedIn ? 0x02 : 0x00), 0x00, 0x00, 0xC0 };
+		QueueData(Sim, Sim.HostCID[1], Status, sizeof(Status));
+	}
+
+	void ProcessOutputReport(SimWiimote &Sim, const uint8_t *Report, size_t Length)
+	{
+		if (Length < 2 || Report[0] != 0xA2)
+			return;
+		switch (Report[1])
+		{
+		case 0x12: // Report mode
+			Sim.ReportMode = Report[3];
+			break;
+		case 0x15: // Status request
+			QueueStatus(Sim);
+			break;
+		case 0x16: // Write memory
+		{
+			if (WriteLossPercent && (rand() % 100) < WriteLossPercent)
+			{
+				GStats.NumLostWrites++;
+				break; // Never arrived
+			}
+			uint8_t Ack[] = { 0xA1, 0x22, 0x00, 0x00, 0x16, 0x00 };
+			if (WriteErrorPercent && (rand() % 100) < WriteErrorPercent)
+				Ack[5] = 0x03; // Busy
+			QueueData(Sim, Sim.HostCID[1], Ack, sizeof(Ack));
+			uint32_t Register = (Report[3] << 16) | (Report[4] << 8) | Report[5];
+			if (Ack[5] == 0 && bMotionPlus && Register == 0xA600FE && Report[7] == 0x04)
+			{
+				Sim.bMotionPlusActive = true; // Shows up as an extension being plugged in
+				QueueStatus(Sim);
+			}
+			break;
+		}
+		case 0x17: // Read memory
+		{
+			uint32_t Register = (Report[3] << 16) | (Report[4] << 8) | Report[5];
+			uint8_t Reply[22] = { 0xA1, 0x21, 0x00, 0x00, 0x57, (uint8_t)(Register >> 8), (uint8_t)Register };
+			if (bMotionPlus && !Sim.bMotionPlusActive && Register == 0xA600FA)
+			{
+				uint8_t ID[] = { 0x00, 0x00, 0xA6, 0x20, 0x00, 0x05 };
+				memcpy(Reply + 7, ID, sizeof(ID));
+				Reply[4] = 0x50; // 6 bytes, no error
+			}
+			else
+			{
+				Reply[4] = 0x07; // Nothing there
+			}
+			QueueData(Sim, Sim.HostCID[1], Reply, sizeof(Reply));
+			break;
+		}
+		default:
+			break;
+		}
+	}
+
+	std::vector<SimWiimote> Remotes;
+	std::deque<Packet> Pending;
+	uint16_t NextCID;
+	int Jitter;
+	int LossPercent;
+	int WriteErrorPercent;
+	int WriteLossPercent;
+	bool bExtension;
+	bool bMotionPlus;
+	bool bWakeUp;
+	bool bCrossPages;
+	uint64_t ReportTime;
+	uint64_t ReportTimestamp;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// Main
+/////////////////////////////////////////////////////////////////////////////////////////////
+
+static int FloodCount = 0;
+static bool bVerbose = false;
+
+static void DeliverWithFlood(const Packet &Received)
+{
+	if (Received.Timestamp)
+		HostTime = Received.Timestamp;
+	else if (IsIRReport(Received.Data))
+		HostTime += 10000 / Wiimotes.size(); // No timing in the trace so assume 100Hz from each Wiimote
+	DeliverAndTick(Received.Data);
+	if (FloodCount && IsIRReport(Received.Data))
+	{
+		for (int i = 0; i < FloodCount; i++)
+		{
+			DeliverAndTick(Received.Data);
+		}
+	}
+}
+
+static void CompareSent(const Packet *Expected)
+{
+	while (!SentPackets.empty())
+	{
+		Packet Sent = SentPackets.front();
+		SentPackets.pop_front();
+		GStats.NumSent++;
+		if (Expected && Sent.Data != Expected->Data)
+		{
+			GStats.NumMismatched++;
+			if (bVerbose)
+			{
+				printf("Outbound mismatch:\n  expected");
+				for (size_t i = 0; i < Expected->Data.size(); i++)
+					printf(" %02x", Expected->Data[i]);
+				printf("\n  sent    ");
+				for (size_t i = 0; i < Sent.Data.size(); i++)
+					printf(" %02x", Sent.Data[i]);
+				printf("\n");
+			}
+		}
+		Expected = nullptr; // Only compare the first one, trace and stack can interleave differently
+	}
+}
+
+static void Replay(const std::vector<Packet> &Packets)
+{
+	TimedTick();
+	const Packet *Expected = nullptr;
+	for (size_t i = 0; i < Packets.size(); i++)
+	{
+		if (Packets[i].bReceived)
+		{
+			DeliverWithFlood(Packets[i]);
+		}
+		else
+		{
+			Expected = &Packets[i];
+		}
+		CompareSent(Expected);
+		Expected = nullptr;
+	}
+}
+
+// Returns false if a Wiimote didn't reconnect after the simulated link loss
+static bool Simulate(int NumPlayers, int NumReports, bool bDisconnect, int Jitter, int LossPercent, int WriteErrorPercent, int WriteLossPercent, bool bExtension, bool bMotionPlus, bool bWakeUp, bool bCrossPages)
+{
+	SimulatedController Sim(NumPlayers, Jitter, LossPercent, WriteErrorPercent, WriteLossPercent, bExtension, bMotionPlus, bWakeUp, bCrossPages);
+	TimedTick();
+	int Report = 0;
+	int IdleTicks = 0;
+	uint64_t GiveUpTime = HostTime + 60000000ull + NumReports * 10000ull; // A minute to connect on top of the reports
+	while (Report < NumReports && IdleTicks < 10000 && HostTime < GiveUpTime)
+	{
+		while (!SentPackets.empty())
+		{
+			Sim.Process(SentPackets.front());
+			SentPackets.pop_front();
+			GStats.NumSent++;
+		}
+		if (Sim.HasPending())
+		{
+			DeliverWithFlood(Sim.PopPending());
+			IdleTicks = 0;
+			continue;
+		}
+		bool bAllOpen = true;
+		for (size_t i = 0; i < Wiimotes.size(); i++)
+		{
+			bAllOpen &= Wiimotes[i]->IsConnected();
+		}
+		if (bAllOpen)
+		{
+			Sim.GenerateReports();
+			Report++;
+		}
+		else
+		{
+			HostTime += 1000; // Waiting on something so a 1kHz tick of WiimoteTask goes by
+			TimedTick();
+			IdleTicks++;
+		}
+	}
+	if (bDisconnect)
+	{
+		Sim.Disconnect(0, 0x08); // Supervision timeout
+		for (int i = 0; i < 1000; i++)
+		{
+			HostTime += 1000; // Ticks at 1kHz like WiimoteTask
+			while (!SentPackets.empty())
+			{
+				Sim.Process(SentPackets.front());
+				SentPackets.pop_front();
+				GStats.NumSent++;
+			}
+			if (Sim.HasPending())
+				DeliverAndTick(Sim.PopPending().Data);
+			else
+				TimedTick();
+		}
+		if (!Wiimotes[0]->IsConnected())
+		{
+			printf("Wiimote 1 didn't reconnect\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char **argv)
+{
+	bool bSimulate = false;
+	bool bDisconnect = false;
+	int NumPlayers = 2;
+	int NumReports = 2000;
+	int Jitter = 0;
+	int LossPercent = 0;
+	int WriteErrorPercent = 0;
+	int WriteLossPercent = 0;
+	bool bExtension = false;
+	bool bMotionPlus = false;
+	bool bFullIR = false;
+	bool bRemember = false;
+	bool bRememberedOff = false;
+	bool bWakeUp = false;
+	bool bCrossPages = false;
+	const char *TraceName = nullptr;
+	const char *DumpName = nullptr;
+	for (int i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-s") == 0)
+			bSimulate = true;
+		else if (strcmp(argv[i], "-d") == 0)
+			bDisconnect = true;
+		else if (strcmp(argv[i], "-v") == 0)
+			bVerbose = true;
+		else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+			NumPlayers = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			NumReports = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-e") == 0)
+			bExtension = true;
+		else if (strcmp(argv[i], "-m") == 0)
+			bMotionPlus = true;
+		else if (strcmp(argv[i], "-F") == 0)
+			bFullIR = true;
+		else if (strcmp(argv[i], "-r") == 0)
+			bRemember = true;
+		else if (strcmp(argv[i], "-o") == 0)
+			bRememberedOff = true;
+		else if (strcmp(argv[i], "-a") == 0)
+			bWakeUp = true;
+		else if (strcmp(argv[i], "-x") == 0)
+			bCrossPages = true;
+		else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+			Jitter = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+			LossPercent = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-W") == 0 && i + 1 < argc)
+			WriteErrorPercent = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-N") == 0 && i + 1 < argc)
+			WriteLossPercent = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+			FloodCount = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+			DumpName = argv[++i];
+		else if (argv[i][0] != '-')
+			TraceName = argv[i];
+		else
+		{
+			printf("Unknown option %s\n", argv[i]);
+			return 2;
+		}
+	}
+
+	std::vector<Packet> Packets;
+	if (!bSimulate)
+	{
+		if (!TraceName)
+		{
+			printf("Usage: hci_replay [-s] [-p players] [-n reports] [-f flood] [-d] [-j jitter] [-l loss] [-W errors] [-N lost] [-e] [-m] [-F] [-r] [-o] [-a] [-x] [-w dump] [-v] [trace]\n");
+			return 2;
+		}
+		FILE *File = fopen(TraceName, "rb");
+		if (!File)
+		{
+			printf("Couldn't open %s\n", TraceName);
+			return 2;
+		}
+		if (!LoadBTSnoop(File, Packets))
+		{
+			rewind(File);
+			LoadDump(File, Packets);
+		}
+		fclose(File);
+		printf("Loaded %zu packets from %s\n", Packets.size(), TraceName);
+	}
+
+	if (DumpName)
+	{
+		DumpFile = fopen(DumpName, "w");
+	}
+
+	GWiimoteManager.Init();
+	for (int i = 0; i < NumPlayers; i++)
+	{
+		uint8_t KnownAddress[6];
+		GetSimulatedAddress(bRememberedOff && i == 0 ? 0xEE : NumPlayers - 1 - i, KnownAddress);
+		IWiimote *Wiimote = GWiimoteManager.CreateNewWiimote(bRemember ? KnownAddress : nullptr);
+		if (!Wiimote)
+		{
+			printf("Only %d players supported\n", i);
+			return 2;
+		}
+		if (bFullIR)
+			Wiimote->SetIRMode(kWiimoteIRMode_Full);
+		Wiimote->SetMotionPlus(true);
+		Wiimotes.push_back(Wiimote);
+		LastFrame.push_back(0);
+		ReportsSeen.push_back(0);
+		ReachedOpen.push_back(false);
+	}
+
+	bool bReconnected = true;
+	if (bSimulate)
+		bReconnected = Simulate(NumPlayers, NumReports, bDisconnect, Jitter, LossPercent, WriteErrorPercent, WriteLossPercent, bExtension, bMotionPlus, bWakeUp, bCrossPages);
+	else
+		Replay(Packets);
+
+	GWiimoteManager.DeInit();
+	if (DumpFile)
+	{
+		fclose(DumpFile);
+	}
+
+	int TotalReports = 0;
+	bool bAnyOpen = false;
+	bool bAllOpen = true;
+	for (size_t i = 0; i < Wiimotes.size(); i++)
+	{
+		const WiimoteReportStats *ReportStats = Wiimotes[i]->GetReportStats();
+		printf("Wiimote %zu: %s, %d reports (interval %uus, jitter %uus, max %uus, dropped %u)\n", i + 1, ReachedOpen[i] ? "reached STATE_OPEN" : "never opened", ReportsSeen[i],
+			ReportStats->MeanInterval, ReportStats->Jitter, ReportStats->MaxInterval, ReportStats->NumDropped);
+		const WiimoteData *Data = Wiimotes[i]->GetData();
+		printf("  Last spots:");
+		for (int Spot = 0; Spot < 4; Spot++)
+		{
+			printf(" (%d,%d size %d intensity %d)", Data->IRSpot[Spot].X, Data->IRSpot[Spot].Y, Data->IRSpot[Spot].Size, Data->IRSpot[Spot].Intensity);
+		}
+		if (Data->bMotionPlus)
+			printf(" with MotionPlus (yaw %d pitch %d roll %d)\n", Data->GyroYaw, Data->GyroPitch, Data->GyroRoll);
+		else
+			printf("%s\n", Data->bExtension ? " with extension" : "");
+		uint8_t Address[6];
+		if (Wiimotes[i]->GetAddress(Address))
+			printf("  Address: %02x:%02x:%02x:%02x:%02x:%02x\n", Address[5], Address[4], Address[3], Address[2], Address[1], Address[0]);
+		TotalReports += ReportsSeen[i];
+		bAnyOpen |= ReachedOpen[i];
+		bAllOpen &= ReachedOpen[i];
+	}
+	int NumPackets = GStats.NumEvents + GStats.NumACL;
+	printf("Packets in: %d (%d events, %d ACL), packets out: %d", NumPackets, GStats.NumEvents, GStats.NumACL, GStats.NumSent);
+	if (!bSimulate)
+		printf(" (%d differ from trace)", GStats.NumMismatched);
+	printf("\n");
+	if (bSimulate)
+	{
+		printf("Inquiries: %d, pages: %d (%d lost to the Wiimote connecting)\n", GStats.NumInquiries, GStats.NumPages, GStats.NumCrossedPages);
+		if (GStats.NumLostWrites)
+			printf("Register writes lost: %d\n", GStats.NumLostWrites);
+	}
+	if (GStats.WallSeconds > 0.0)
+		printf("Throughput: %.0f packets/s\n", NumPackets / GStats.WallSeconds);
+	if (TotalReports)
+		printf("CPU per report: %.3f us\n", 1000000.0 * GStats.CPUSeconds / TotalReports);
+
+	// Simulated sessions must connect everyone, a replayed trace at least one.
+	// Skips static destructors as the stack is never torn down on the ESP32.
+	fflush(stdout);
+	_Exit((bSimulate ? bAllOpen && bReconnected : bAnyOpen) ? 0 : 1);
+}
@@ -0,0 +1,282 @@
+// (c) Charlie Cole 2017
+//
+// This is licensed under
+// - Creative Commons Attribution-NonCommercial 3.0 Unported
+// - https://creativecommons.org/licenses/by-nc/3.0/
+// - Or see LICENSE.txt
+//
+// The short of it is...
+//   You are free to:
+//     Share — copy and redistribute the material in any medium or format
+//     Adapt — remix, transform, and build upon the material
+//   Under the following terms:
+//     NonCommercial — You may not use the material for commercial purposes.
+//     Attribution — You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+
+
+// Compares ways of turning a camera position into a screen position for a calibrated player:
+// - Bilinear: what PlayerInput used to do (solves a quadratic per axis plus four edge tests)
+// - Float: the precomputed homography
+// - Fixed: the homography in integer maths
+// - Grid: the table baked by a 16 point calibration (main/calibration_grid.cpp)
+// Prints the time per sample and how far the fixed-point result strays from the float one. Then bows the
+// camera image like a wide lens and compares how well the 4 point and 16 point calibrations cope with it.
+//
+// Usage: mapping_bench [samples]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+#include "homography.h"
+#include "calibration_grid.h"
+
+struct Vector2D
+{
+	float X;
+	float Y;
+};
+
+static Vector2D Sub(const Vector2D &A, const Vector2D &B)
+{
+	Vector2D Result = { A.X - B.X, A.Y - B.Y };
+	return Result;
+}
+
+static float Cross(const Vector2D &LHS, const Vector2D &RHS)
+{
+	return LHS.X*RHS.Y - LHS.Y*RHS.X;
+}
+
+// Copied from the old PlayerInput
+static bool Within(const Vector2D *Cal, const Vector2D &Pos)
+{
+	if (Cross(Sub(Cal[1], Cal[0]), Sub(Pos, Cal[0])) > 0.0f)
+		return false;
+	if (Cross(Sub(Cal[3], Cal[1]), Sub(Pos, Cal[1])) > 0.0f)
+		return false;
+	if (Cross(Sub(Cal[2], Cal[3]), Sub(Pos, Cal[3])) > 0.0f)
+		return false;
+	if (Cross(Sub(Cal[0], Cal[2]), Sub(Pos, Cal[2])) > 0.0f)
+		return false;
+	return true;
+}
+
+static float Remap(const Vector2D *CalibrationData, const Vector2D &Pos, int a, int b, int c, int d)
+{
+	Vector2D Cal[4];
+	for (int i = 0; i < 4; i++)
+	{
+		Cal[i] = Sub(CalibrationData[i], Pos);
+	}
+	float Qa = Cross(Sub(Cal[b], Cal[d]), Sub(Cal[c], Cal[a]));
+	float Qb = 2.0f*Cross(Cal[b], Cal[a]);
+	Qb -= Cross(Cal[b], Cal[c]);
+	Qb -= Cross(Cal[d], Cal[a]);
+	float Qc = Cross(Cal[a], Cal[b]);
+	if (Qa == 0.0f)
+		return -Qc / Qb;
+	float Inner = Qb*Qb - 4.0f*Qa*Qc;
+	if (Inner < 0.0f)
+		return -1.0f;
+	float Root = sqrtf(Inner);
+	float Result = (-Qb + Root) / (2.0f*Qa);
+	if (Result<0.0f || Result>1.0f)
+		Result = (-Qb - Root) / (2.0f*Qa);
+	return Result;
+}
+
+// Barrel distortion applied to where a perfect camera would see a point
+static void Distort(float X, float Y, float &OutX, float &OutY)
+{
+	const float Amount = -0.06f;
+	float DX = (X - 511.5f) / 512.0f;
+	float DY = (Y - 383.5f) / 512.0f;
+	float Scale = 1.0f + Amount*(DX*DX + DY*DY);
+	OutX = 511.5f + (X - 511.5f)*Scale;
+	OutY = 383.5f + (Y - 383.5f)*Scale;
+}
+
+template <typename Function>
+static double NanosecondsPerSample(int NumSamples, Function Run)
+{
+	auto Start = std::chrono::steady_clock::now();
+	Run();
+	auto End = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(End - Start).count() / NumSamples;
+}
+
+int main(int argc, char **argv)
+{
+	int NumSamples = (argc > 1) ? atoi(argv[1]) : 1000000;
+
+	// A sensor bar below a TV seen from off to one side (camera X is mirrored)
+	Vector2D Cal[4] = { { 820.0f, 130.0f }, { 190.0f, 170.0f }, { 790.0f, 610.0f }, { 230.0f, 580.0f } };
+	float CornerX[4], CornerY[4];
+	for (int i = 0; i < 4; i++)
+	{
+		CornerX[i] = Cal[i].X;
+		CornerY[i] = Cal[i].Y;
+	}
+	Homography Mapping;
+	if (!Mapping.Calibrate(CornerX, CornerY))
+	{
+		printf("Calibration failed\n");
+		return 1;
+	}
+
+	std::vector<Vector2D> Samples(NumSamples);
+	std::vector<int32_t> FixedX(NumSamples), FixedY(NumSamples);
+	for (int i = 0; i < NumSamples; i++)
+	{
+		// Sweeps over the whole camera like someone waving the Wiimote around so it's realistic for the branches
+		Samples[i].X = 511.5f + 511.5f * sinf(i * 0.0013f);
+		Samples[i].Y = 383.5f + 383.5f * sinf(i * 0.0021f);
+		FixedX[i] = (int32_t)(Samples[i].X * 16.0f);
+		FixedY[i] = (int32_t)(Samples[i].Y * 16.0f);
+	}
+
+	// 16 targets seen through a perfect lens, so the grid should come out matching the homography
+	float GridX[16], GridY[16], GridU[16], GridV[16];
+	for (int i = 0; i < 16; i++)
+	{
+		GridU[i] = (i % 4) / 3.0f;
+		GridV[i] = (i / 4) / 3.0f;
+		Mapping.Unmap(GridU[i], GridV[i], GridX[i], GridY[i]);
+	}
+	CalibrationGrid Grid;
+	if (!Grid.Fit(GridX, GridY, GridU, GridV, 16))
+	{
+		printf("Grid calibration failed\n");
+		return 1;
+	}
+
+	volatile float Sink = 0.0f; // Stops the loops being optimised away
+	double BilinearTime = NanosecondsPerSample(NumSamples, [&]()
+	{
+		float Sum = 0.0f;
+		for (int i = 0; i < NumSamples; i++)
+		{
+			if (Within(Cal, Samples[i]))
+				Sum += Remap(Cal, Samples[i], 0, 2, 1, 3) + Remap(Cal, Samples[i], 0, 1, 2, 3);
+		}
+		Sink = Sum;
+	});
+	double FloatTime = NanosecondsPerSample(NumSamples, [&]()
+	{
+		float Sum = 0.0f;
+		for (int i = 0; i < NumSamples; i++)
+		{
+			float U, V;
+			if (Mapping.Map(Samples[i].X, Samples[i].Y, U, V))
+				Sum += U + V;
+		}
+		Sink = Sum;
+	});
+	double FixedTime = NanosecondsPerSample(NumSamples, [&]()
+	{
+		int32_t Sum = 0;
+		for (int i = 0; i < NumSamples; i++)
+		{
+			int32_t U, V;
+			if (Mapping.MapFixed(FixedX[i], FixedY[i], U, V))
+				Sum += U + V;
+		}
+		Sink = (float)Sum;
+	});
+	double GridTime = NanosecondsPerSample(NumSamples, [&]()
+	{
+		float Sum = 0.0f;
+		for (int i = 0; i < NumSamples; i++)
+		{
+			float U, V;
+			if (Grid.Map(Samples[i].X, Samples[i].Y, U, V))
+				Sum += U + V;
+		}
+		Sink = Sum;
+	});
+	(void)Sink;
+
+	// Accuracy: corners should land on the screen's corners and fixed should track float
+	float CornerError = 0.0f;
+	for (int i = 0; i < 4; i++)
+	{
+		float U, V;
+		Mapping.Map(Cal[i].X, Cal[i].Y, U, V);
+		CornerError = fmaxf(CornerError, fmaxf(fabsf(U - (float)(i & 1)), fabsf(V - (float)(i >> 1))));
+	}
+	float FixedError = 0.0f;
+	float RoundTripError = 0.0f;
+	int NumInside = 0;
+	int NumDisagree = 0;
+	for (int i = 0; i < NumSamples; i++)
+	{
+		float U, V;
+		int32_t FixedU, FixedV;
+		float X = FixedX[i] / 16.0f, Y = FixedY[i] / 16.0f;
+		bool bInside = Mapping.Map(X, Y, U, V);
+		bool bFixedInside = Mapping.MapFixed(FixedX[i], FixedY[i], FixedU, FixedV);
+		NumInside += bInside ? 1 : 0;
+		NumDisagree += (bInside != Within(Cal, Samples[i])) ? 1 : 0;
+		if (bInside)
+		{
+			FixedError = fmaxf(FixedError, fmaxf(fabsf(FixedU / 65536.0f - U), fabsf(FixedV / 65536.0f - V)));
+			float BackX, BackY;
+			Mapping.Unmap(U, V, BackX, BackY);
+			RoundTripError = fmaxf(RoundTripError, fmaxf(fabsf(BackX - X), fabsf(BackY - Y)));
+		}
+		(void)bFixedInside;
+	}
+	float GridError = 0.0f;
+	for (int i = 0; i < NumSamples; i++)
+	{
+		float U, V, GridU, GridV;
+		if (Mapping.Map(Samples[i].X, Samples[i].Y, U, V))
+		{
+			Grid.Map(Samples[i].X, Samples[i].Y, GridU, GridV);
+			GridError = fmaxf(GridError, fmaxf(fabsf(GridU - U), fabsf(GridV - V)));
+		}
+	}
+
+	// Same targets through a bowed lens. Accuracy is judged across the whole screen not just at the targets.
+	float BowedX[16], BowedY[16];
+	for (int i = 0; i < 16; i++)
+		Distort(GridX[i], GridY[i], BowedX[i], BowedY[i]);
+	float BowedCornerX[4] = { BowedX[0], BowedX[3], BowedX[12], BowedX[15] };
+	float BowedCornerY[4] = { BowedY[0], BowedY[3], BowedY[12], BowedY[15] };
+	Homography BowedCorners;
+	CalibrationGrid BowedGrid;
+	if (!BowedCorners.Calibrate(BowedCornerX, BowedCornerY) || !BowedGrid.Fit(BowedX, BowedY, GridU, GridV, 16))
+	{
+		printf("Bowed calibration failed\n");
+		return 1;
+	}
+	float CornerBowError = 0.0f;
+	float GridBowError = 0.0f;
+	for (int Row = 0; Row <= 32; Row++)
+	{
+		for (int Column = 0; Column <= 32; Column++)
+		{
+			float U = Column / 32.0f, V = Row / 32.0f;
+			float X, Y, MappedU, MappedV;
+			Mapping.Unmap(U, V, X, Y);
+			Distort(X, Y, X, Y);
+			BowedCorners.Map(X, Y, MappedU, MappedV);
+			CornerBowError = fmaxf(CornerBowError, fmaxf(fabsf(MappedU - U), fabsf(MappedV - V)));
+			BowedGrid.Map(X, Y, MappedU, MappedV);
+			GridBowError = fmaxf(GridBowError, fmaxf(fabsf(MappedU - U), fabsf(MappedV - V)));
+		}
+	}
+
+	printf("%d samples, %d on screen\n", NumSamples, NumInside);
+	printf("Bilinear: %.1f ns/sample\n", BilinearTime);
+	printf("Float:    %.1f ns/sample\n", FloatTime);
+	printf("Fixed:    %.1f ns/sample\n", FixedTime);
+	printf("Grid:     %.1f ns/sample\n", GridTime);
+	printf("Corner error %.6f, fixed vs float %.6f of the screen, round trip %.4f pixels\n", CornerError, FixedError, RoundTripError);
+	printf("Edge tests disagreeing with the mapped bounds: %d (rounding at the edges)\n", NumDisagree);
+	printf("Grid vs float %.6f of the screen (radial %.4f)\n", GridError, Grid.GetRadial());
+	printf("Bowed lens: 4 point off by %.4f of the screen, 16 point by %.4f (radial %.4f, fit error %.4f)\n", CornerBowError, GridBowError, BowedGrid.GetRadial(), BowedGrid.GetError());
+	return 0;
+}
@@ -0,0 +1,167 @@
+// (c) Charlie Cole 2017
+//
+// This is licensed under
+// - Creative Commons Attribution-NonCommercial 3.0 Unported
+// - https://creativecommons.org/licenses/by-nc/3.0/
+// - Or see LICENSE.txt
+//
+// The short of it is...
+//   You are free to:
+//     Share — copy and redistribute the material in any medium or format
+//     Adapt — remix, transform, and build upon the material
+//   Under the following terms:
+//     NonCommercial — You may not use the material for commercial purposes.
+//     Attribution — You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+
+
+#include <math.h>
+#include "calibration_grid.h"
+
+#define GRID_SPACING 64.0f			// Camera pixels between nodes
+#define NODE_SCALE 4096.0f			// Screen units per node unit, leaves room for nodes well off the screen
+#define LENS_CENTRE_X 511.5f
+#define LENS_CENTRE_Y 383.5f
+#define LENS_RADIUS 512.0f			// R is 1 at the middle of each side
+#define MAX_RADIAL 0.3f				// Search range for the radial term either side of 0
+#define RADIAL_ITERATIONS 24		// Golden section steps, narrows the range to well under 0.001
+#define MIN_GRID_POINTS 6
+
+CalibrationGrid::CalibrationGrid()
+{
+	Reset();
+}
+
+void CalibrationGrid::Reset()
+{
+	for (int Row = 0; Row < kRows; Row++)
+	{
+		for (int Column = 0; Column < kColumns; Column++)
+		{
+			Nodes[Row][Column][0] = 0;
+			Nodes[Row][Column][1] = 0;
+		}
+	}
+	Radial = 0.0f;
+	Error = 0.0f;
+	bValid = false;
+}
+
+void CalibrationGrid::Undistort(float Radial, float X, float Y, float &OutX, float &OutY)
+{
+	float DX = (X - LENS_CENTRE_X) * (1.0f / LENS_RADIUS);
+	float DY = (Y - LENS_CENTRE_Y) * (1.0f / LENS_RADIUS);
+	float Scale = 1.0f + Radial*(DX*DX + DY*DY);
+	OutX = LENS_CENTRE_X + (X - LENS_CENTRE_X)*Scale;
+	OutY = LENS_CENTRE_Y + (Y - LENS_CENTRE_Y)*Scale;
+}
+
+// Fits the homography after taking out the given radial term and returns the RMS error (negative if it didn't fit)
+float CalibrationGrid::FitRadial(float Radial, const float *CameraX, const float *CameraY, const float *ScreenU, const float *ScreenV, int NumPoints, Homography &Result)
+{
+	float X[kMaxPoints] = {};
+	float Y[kMaxPoints] = {};
+	for (int i = 0; i < NumPoints; i++)
+		Undistort(Radial, CameraX[i], CameraY[i], X[i], Y[i]);
+	if (!Result.Fit(X, Y, ScreenU, ScreenV, NumPoints))
+		return -1.0f;
+	float Sum = 0.0f;
+	for (int i = 0; i < NumPoints; i++)
+	{
+		float U, V;
+		Result.Map(X[i], Y[i], U, V);
+		Sum += (U - ScreenU[i])*(U - ScreenU[i]) + (V - ScreenV[i])*(V - ScreenV[i]);
+	}
+	return sqrtf(Sum / NumPoints);
+}
+
+bool CalibrationGrid::Fit(const float *CameraX, const float *CameraY, const float *ScreenU, const float *ScreenV, int NumPoints)
+{
+	Reset();
+	if (NumPoints < MIN_GRID_POINTS || NumPoints > kMaxPoints)
+		return false;
+
+	// The error is smooth and has one dip in the range that matters so a golden section search finds the radial term.
+	// Each step is a fresh linear fit, which is cheap enough at this size to not bother with anything cleverer.
+	Homography Mapping;
+	const float Ratio = 0.618034f;
+	float Low = -MAX_RADIAL;
+	float High = MAX_RADIAL;
+	float A = High - Ratio*(High - Low);
+	float B = Low + Ratio*(High - Low);
+	float ErrorA = FitRadial(A, CameraX, CameraY, ScreenU, ScreenV, NumPoints, Mapping);
+	float ErrorB = FitRadial(B, CameraX, CameraY, ScreenU, ScreenV, NumPoints, Mapping);
+	for (int i = 0; i < RADIAL_ITERATIONS; i++)
+	{
+		if (ErrorB < 0.0f || (ErrorA >= 0.0f && ErrorA < ErrorB))
+		{
+			High = B;
+			B = A;
+			ErrorB = ErrorA;
+			A = High - Ratio*(High - Low);
+			ErrorA = FitRadial(A, CameraX, CameraY, ScreenU, ScreenV, NumPoints, Mapping);
+		}
+		else
+		{
+			Low = A;
+			A = B;
+			ErrorA = ErrorB;
+			B = Low + Ratio*(High - Low);
+			ErrorB = FitRadial(B, CameraX, CameraY, ScreenU, ScreenV, NumPoints, Mapping);
+		}
+	}
+	float Best = (Low + High) * 0.5f;
+	float BestError = FitRadial(Best, CameraX, CameraY, ScreenU, ScreenV, NumPoints, Mapping);
+	float PlainError = FitRadial(0.0f, CameraX, CameraY, ScreenU, ScreenV, NumPoints, Mapping);
+	if (BestError < 0.0f || (PlainError >= 0.0f && PlainError <= BestError))
+	{
+		// Lens term isn't helping (or the search wandered off) so stick with the plain homography
+		Best = 0.0f;
+		BestError = PlainError;
+	}
+	if (BestError < 0.0f || FitRadial(Best, CameraX, CameraY, ScreenU, ScreenV, NumPoints, Mapping) < 0.0f)
+		return false;
+
+	for (int Row = 0; Row < kRows; Row++)
+	{
+		for (int Column = 0; Column < kColumns; Column++)
+		{
+			float X, Y, U, V;
+			Undistort(Best, Column * GRID_SPACING, Row * GRID_SPACING, X, Y);
+			Mapping.Map(X, Y, U, V);
+			for (int Axis = 0; Axis < 2; Axis++)
+			{
+				float Node = ((Axis == 0) ? U : V) * NODE_SCALE;
+				Node = (Node > 32767.0f) ? 32767.0f : ((Node < -32768.0f) ? -32768.0f : Node);
+				Nodes[Row][Column][Axis] = (int16_t)lrintf(Node);
+			}
+		}
+	}
+	Radial = Best;
+	Error = BestError;
+	bValid = true;
+	return true;
+}
+
+bool CalibrationGrid::Map(float X, float Y, float &U, float &V) const
+{
+	float GridX = X * (1.0f / GRID_SPACING);
+	float GridY = Y * (1.0f / GRID_SPACING);
+	int Column = (int)GridX; // Rounds towards 0 but anything below 0 gets clamped to it anyway
+	int Row = (int)GridY;
+	Column = (Column < 0) ? 0 : ((Column > kColumns - 2) ? kColumns - 2 : Column);
+	Row = (Row < 0) ? 0 : ((Row > kRows - 2) ? kRows - 2 : Row);
+	float FracX = GridX - (float)Column; // Outside 0-1 off the edges of the table, which extends the edge cells
+	float FracY = GridY - (float)Row;
+
+	const int16_t *TopLeft = Nodes[Row][Column];
+	const int16_t *TopRight = Nodes[Row][Column + 1];
+	const int16_t *BottomLeft = Nodes[Row + 1][Column];
+	const int16_t *BottomRight = Nodes[Row + 1][Column + 1];
+	float TopU = TopLeft[0] + (TopRight[0] - TopLeft[0])*FracX;
+	float TopV = TopLeft[1] + (TopRight[1] - TopLeft[1])*FracX;
+	float BottomU = BottomLeft[0] + (BottomRight[0] - BottomLeft[0])*FracX;
+	float BottomV = BottomLeft[1] + (BottomRight[1] - BottomLeft[1])*FracX;
+	U = (TopU + (BottomU - TopU)*FracY) * (1.0f / NODE_SCALE);
+	V = (TopV + (BottomV - TopV)*FracY) * (1.0f / NODE_SCALE);
+	return U >= 0.0f && U <= 1.0f && V >= 0.0f && V <= 1.0f;
+}
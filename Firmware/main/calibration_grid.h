@@ -0,0 +1,66 @@
+// (c) Charlie Cole 2017
+//
+// This is licensed under
+// - Creative Commons Attribution-NonCommercial 3.0 Unported
+// - https://creativecommons.org/licenses/by-nc/3.0/
+// - Or see LICENSE.txt
+//
+// The short of it is...
+//   You are free to:
+//     Share — copy and redistribute the material in any medium or format
+//     Adapt — remix, transform, and build upon the material
+//   Under the following terms:
+//     NonCommercial — You may not use the material for commercial purposes.
+//     Attribution — You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+
+
+#ifndef __CALIBRATION_GRID_H__
+#define __CALIBRATION_GRID_H__
+
+#include <stdint.h>
+#include "homography.h"
+
+// Camera to screen mapping fitted to a 3x3 or 4x4 grid of calibration targets. On top of the homography it
+// fits a radial term about the centre of the camera to take out the lens (and CRT) bowing that four corners
+// can't see, then bakes the whole thing into a small table so mapping a sample is one bilinear lookup
+// whatever the model costs.
+class CalibrationGrid
+{
+public:
+	enum
+	{
+		kMaxPoints = 16,
+		kColumns = 17, // Nodes every 64 camera pixels from 0 to 1024
+		kRows = 13, // and 0 to 768. Outside that the edge cells are extended.
+	};
+
+	CalibrationGrid();
+
+	void Reset();
+
+	// Camera positions of the targets and where they are on the screen (0-1). Needs at least 6 points so
+	// there's something left over to fit the lens with. Returns false if they don't fit a usable mapping.
+	bool Fit(const float *CameraX, const float *CameraY, const float *ScreenU, const float *ScreenV, int NumPoints);
+
+	bool IsValid() const { return bValid; }
+
+	// Camera to screen. Returns true if the point is on the screen.
+	bool Map(float X, float Y, float &U, float &V) const;
+
+	// Radial term that was fitted (camera positions scale by 1 + Radial*R^2 with R in 512 pixel units)
+	float GetRadial() const { return Radial; }
+
+	// RMS distance of the targets from where the fit puts them (fraction of the screen)
+	float GetError() const { return Error; }
+
+private:
+	static void Undistort(float Radial, float X, float Y, float &OutX, float &OutY);
+	static float FitRadial(float Radial, const float *CameraX, const float *CameraY, const float *ScreenU, const float *ScreenV, int NumPoints, Homography &Result);
+
+	int16_t Nodes[kRows][kColumns][2]; // Screen position of each node in 1/4096ths
+	float Radial;
+	float Error;
+	bool bValid;
+};
+
+#endif // __CALIBRATION_GRID_H__
@@ -16,14 +16,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <math.h>
+#if !WIIMOTE_HOST_BUILD
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_bt.h"
+#include "esp_timer.h"
+#endif
 #include "esp_wiimote.h"
 
 // Provides a minimal Bluetooth stack for communicating with Wiimotes on ESP32
 
 #define WIIMOTE_VERBOSE 0
+#define WIIMOTE_LOW_LATENCY_LINK 1 // Keep links out of sniff and ask for the shortest poll interval
 
 #if WIIMOTE_VERBOSE
 #define VERBOSE_PRINT(...) printf(__VA_ARGS__)
@@ -61,27 +67,106 @@ enum L2CAPChannels
 	L2CAP_SIGNALING_CHANNEL = 1
 };
 
+enum L2CAPConnectionResults
+{
+	L2CAP_RESULT_SUCCESS = 0,
+	L2CAP_RESULT_PENDING = 1,
+	L2CAP_RESULT_PSM_NOT_SUPPORTED = 2,
+	L2CAP_RESULT_NO_RESOURCES = 4
+};
+
 enum
 {
 	WIIMOTE_REPORT_SET_LEDS = 0x11,
 	WIIMOTE_REPORT_REQUEST_REPORT = 0x12,
 	WIIMOTE_REPORT_IR_ENABLE_1 = 0x13,
+	WIIMOTE_REPORT_STATUS_REQUEST = 0x15,
 	WIIMOTE_REPORT_WRITE_MEMORY = 0x16,
+	WIIMOTE_REPORT_READ_MEMORY_REQUEST = 0x17,
 	WIIMOTE_REPORT_IR_ENABLE_2 = 0x1A,
 	WIIMOTE_REPORT_STATUS_INFORMATION = 0x20,
 	WIIMOTE_REPORT_READ_MEMORY = 0x21,
 	WIIMOTE_REPORT_ACKNOWLEDGE = 0x22,
 	WIIMOTE_REPORT_CORE_BUTTONS = 0x30,
-	WIIMOTE_REPORT_CORE_BUTTONS_ACC_IR12 = 0x33
+	WIIMOTE_REPORT_CORE_BUTTONS_ACC_IR12 = 0x33,
+	WIIMOTE_REPORT_CORE_BUTTONS_ACC_IR10_EXT6 = 0x37,
+	WIIMOTE_REPORT_INTERLEAVED_1 = 0x3E,
+	WIIMOTE_REPORT_INTERLEAVED_2 = 0x3F
+};
+
+enum
+{
+	WIIMOTE_REPORTING_CONTINUOUS = 0x04
+};
+
+enum
+{
+	WIIMOTE_IR_MODE_BASIC = 1,
+	WIIMOTE_IR_MODE_EXTENDED = 3,
+	WIIMOTE_IR_MODE_FULL = 5
+};
+
+enum
+{
+	WIIMOTE_WRITE_TIMEOUT = 200000 // Microseconds to wait for a register write to be acknowledged before sending it again
+};
+
+enum
+{
+	WIIMOTE_STATUS_EXTENSION = 0x02
+};
+
+enum
+{
+	WIIMOTE_MOTIONPLUS_ID = 0xA600FA, // Reads A6 20 00 05 in bytes 2-5 while inactive
+	WIIMOTE_MOTIONPLUS_INIT = 0xA600F0,
+	WIIMOTE_MOTIONPLUS_MODE = 0xA600FE, // Writing 0x04 makes it the extension (standalone)
+	WIIMOTE_MOTIONPLUS_ZERO = 8192,
+	WIIMOTE_MOTIONPLUS_PROBE_TIMEOUT = 200000 // Microseconds to wait for the ID read
+};
+
+enum
+{
+	WIIMOTE_CLASS_OF_DEVICE = 0x000500,
+	WIIMOTE_CLASS_OF_DEVICE_MASK = 0xFFDFF3 // Mask out bits which differ for Wiimote + Wiimote Plus
 };
 
 class L2CAP;
+class L2CAPConnection;
 
 /////////////////////////////////////////////////////////////////////////////////////////////
 // Helpers
 /////////////////////////////////////////////////////////////////////////////////////////////
 
-class GenericMessage
+// Counts an error that can happen on every packet. Printing each one would hold up the Bluetooth
+// task on the UART so only the 1st, 2nd, 4th, 8th... time is reported.
+class ErrorCounter
+{
+public:
+	ErrorCounter(const char *InMessage)
+	{
+		Message = InMessage;
+		Count = 0;
+	}
+
+	inline void Add(uint32_t Value)
+	{
+		Count++;
+		if ((Count & (Count - 1)) == 0)
+			printf("ERROR: %s: %x (%u times)\n", Message, Value, Count);
+	}
+
+	uint32_t GetCount()
+	{
+		return Count;
+	}
+
+private:
+	const char *Message;
+	uint32_t Count;
+};
+
+class TransmitBuffer
 {
 public:
 	enum
@@ -89,9 +174,148 @@ public:
 		kMaxMessageLength = 185 // To match MTU
 	};
 
-	GenericMessage()
+	uint8_t Data[kMaxMessageLength];
+	uint16_t Length;
+	TransmitBuffer *Next; // In whichever list it's in
+};
+
+class TransmitList
+{
+public:
+	TransmitList()
 	{
-		Ptr = Buffer;
+		Head = Tail = nullptr;
+	}
+
+	inline bool IsEmpty()
+	{
+		return Head == nullptr;
+	}
+
+	inline void Push(TransmitBuffer *Buffer)
+	{
+		Buffer->Next = nullptr;
+		if (Tail)
+			Tail->Next = Buffer;
+		else
+			Head = Buffer;
+		Tail = Buffer;
+	}
+
+	inline TransmitBuffer* Peek()
+	{
+		return Head;
+	}
+
+	inline TransmitBuffer* Pop()
+	{
+		TransmitBuffer *Buffer = Head;
+		Head = Buffer->Next;
+		if (!Head)
+			Tail = nullptr;
+		return Buffer;
+	}
+
+private:
+	TransmitBuffer *Head;
+	TransmitBuffer *Tail;
+};
+
+// Outbound packets waiting on controller credits. Commands go in order as the controller
+// allows, ACL data has a queue per link that's drained round robin so a burst of writes to
+// one Wiimote can't hold up another.
+class TransmitQueue
+{
+public:
+	enum
+	{
+		kNumBuffers = 32,
+		kMaxLinks = 8
+	};
+
+	struct Link
+	{
+		TransmitList Queue;
+		uint16_t Handle;
+		uint16_t InFlight; // Handed to the controller and not yet reported as completed
+		bool bUsed;
+	};
+
+	TransmitQueue()
+	{
+		for (int i = 0; i < kNumBuffers; i++)
+		{
+			FreeList.Push(&Buffers[i]);
+		}
+		for (int i = 0; i < kMaxLinks; i++)
+		{
+			Links[i].bUsed = false;
+			Links[i].Handle = 0;
+			Links[i].InFlight = 0;
+		}
+	}
+
+	inline TransmitBuffer* Allocate()
+	{
+		return FreeList.IsEmpty() ? nullptr : FreeList.Pop();
+	}
+
+	inline void Free(TransmitBuffer *Buffer)
+	{
+		FreeList.Push(Buffer);
+	}
+
+	Link* FindLink(uint16_t Handle, bool bCreate)
+	{
+		Link *Unused = nullptr;
+		for (int i = 0; i < kMaxLinks; i++)
+		{
+			if (Links[i].bUsed && Links[i].Handle == Handle)
+				return &Links[i];
+			if (!Links[i].bUsed && !Unused)
+				Unused = &Links[i];
+		}
+		if (!bCreate || !Unused)
+			return nullptr;
+		Unused->bUsed = true;
+		Unused->Handle = Handle;
+		Unused->InFlight = 0;
+		return Unused;
+	}
+
+	// Nothing queued or outstanding so the slot can go to another handle
+	void ReleaseIfIdle(Link *InLink)
+	{
+		if (InLink->Queue.IsEmpty() && InLink->InFlight == 0)
+			InLink->bUsed = false;
+	}
+
+	void FreeAll(TransmitList &List)
+	{
+		while (!List.IsEmpty())
+			Free(List.Pop());
+	}
+
+	TransmitList Commands;
+	Link Links[kMaxLinks];
+
+private:
+	TransmitBuffer Buffers[kNumBuffers];
+	TransmitList FreeList;
+};
+
+class GenericMessage
+{
+public:
+	enum
+	{
+		kMaxMessageLength = TransmitBuffer::kMaxMessageLength
+	};
+
+	GenericMessage(TransmitBuffer *InPacket)
+	{
+		Packet = InPacket;
+		Ptr = Packet->Data;
 	}
 
 	inline uint8_t* AddByte(uint8_t Byte)
@@ -115,6 +339,22 @@ public:
 		return Ptr - 3;
 	}
 
+	inline uint8_t* AddQuad(uint32_t Quad)
+	{
+		*(Ptr++) = (Quad & 0xFF);
+		*(Ptr++) = ((Quad >> 8) & 0xFF);
+		*(Ptr++) = ((Quad >> 16) & 0xFF);
+		*(Ptr++) = (Quad >> 24);
+		return Ptr - 4;
+	}
+
+	inline uint8_t* AddWordBigEndian(uint16_t Word)
+	{
+		*(Ptr++) = (Word >> 8);
+		*(Ptr++) = (Word & 0xFF);
+		return Ptr - 2;
+	}
+
 	inline uint8_t* AddTriBigEndian(uint32_t Tri)
 	{
 		*(Ptr++) = (Tri >> 16);
@@ -123,27 +363,15 @@ public:
 		return Ptr - 3;
 	}
 
-	inline uint8_t* SetWord(uint8_t *Start, uint16_t Word)
-	{
-		*(Start++) = (Word & 0xFF);
-		*(Start++) = (Word >> 8);
-		return Start - 2;
-	}
-
-	inline void AppendData(uint8_t *Data, int Size)
+	inline void AppendData(const uint8_t *Data, int Size)
 	{
-		check((Ptr - Buffer) + Size <= kMaxMessageLength);
+		check((Ptr - Packet->Data) + Size <= Packet->Length);
 		memcpy(Ptr, Data, Size);
 		Ptr += Size;
 	}
 
-	inline void AppendMessage(GenericMessage &SubMsg)
-	{
-		AppendData(SubMsg.Buffer, SubMsg.Ptr - SubMsg.Buffer);
-	}
-
 protected:
-	uint8_t Buffer[kMaxMessageLength];
+	TransmitBuffer *Packet;
 	uint8_t *Ptr;
 };
 
@@ -156,9 +384,10 @@ class RingBuffer
 
 public:
 	RingBuffer()
+		: Overflows("Circular buffer couldn't fit message, dropping")
+		, Truncations("Receiving buffer is too small for message")
 	{
 		Head = CallbackHead = Tail = 0;
-		bPrintError = true;
 	}
 
 	inline void Put(uint8_t *Msg, uint16_t Length)
@@ -166,14 +395,9 @@ public:
 		int Space = (sizeof(Data) - 1 + Tail - CallbackHead)&(sizeof(Data) - 1);
 		if (Space < Length)
 		{
-			if (bPrintError)
-			{
-				printf("ERROR: Circular buffer couldn't fit message (%d/%d). Dropping.\n", Length, Space);
-			}
-			bPrintError = false;
+			Overflows.Add(Length);
 			return;
 		}
-		bPrintError = true;
 		WriteByte(Length >> 8);
 		WriteByte(Length);
 		for (int i = 0; i < Length; i++)
@@ -198,7 +422,7 @@ public:
 			}
 			else
 			{
-				printf("ERROR: Receiving buffer is too small: %d/%d\n", Length, MaxLength);
+				Truncations.Add(Length);
 				for (int i = 0; i < MaxLength; i++)
 				{
 					Msg[i] = ReadByte();
@@ -228,15 +452,157 @@ private:
 	volatile int Head;	// Should be updated atomically
 	int Tail;
 	int CallbackHead;
-	bool bPrintError;
+	ErrorCounter Overflows;
+	ErrorCounter Truncations;
 	uint8_t Data[kRingBufferSize];
 };
 
+// Measures how regularly a Wiimote's continuous reports turn up
+class ReportIntervalMonitor
+{
+	enum
+	{
+		kExpectedInterval = 10000, // Continuous reporting runs at 100Hz
+		kWindowLength = 1000000 // Publish figures every second
+	};
+
+public:
+	void Reset()
+	{
+		memset(&Stats, 0, sizeof(Stats));
+		ResetWindow(0);
+	}
+
+	void Report(uint32_t Time)
+	{
+		if (Stats.NumReports++ == 0)
+		{
+			ResetWindow(Time);
+		}
+		else
+		{
+			uint32_t Interval = Time - LastTime;
+			if (Interval > kExpectedInterval + kExpectedInterval / 2)
+				Stats.NumDropped += (Interval + kExpectedInterval / 2) / kExpectedInterval - 1;
+			NumIntervals++;
+			IntervalSum += Interval;
+			IntervalSquaredSum += (uint64_t)Interval * Interval;
+			if (Interval > MaxInterval)
+				MaxInterval = Interval;
+			if (Time - WindowStart >= kWindowLength)
+			{
+				float Mean = (float)IntervalSum / NumIntervals;
+				float Variance = (float)IntervalSquaredSum / NumIntervals - Mean * Mean;
+				Stats.MeanInterval = (uint32_t)(Mean + 0.5f);
+				Stats.Jitter = (Variance > 0.0f) ? (uint32_t)(sqrtf(Variance) + 0.5f) : 0;
+				Stats.MaxInterval = MaxInterval;
+				Stats.NumWindows++;
+				ResetWindow(Time);
+			}
+		}
+		LastTime = Time;
+	}
+
+	const WiimoteReportStats* GetStats() const
+	{
+		return &Stats;
+	}
+
+private:
+	void ResetWindow(uint32_t Time)
+	{
+		WindowStart = Time;
+		NumIntervals = 0;
+		IntervalSum = 0;
+		IntervalSquaredSum = 0;
+		MaxInterval = 0;
+	}
+
+	WiimoteReportStats Stats;
+	uint32_t LastTime;
+	uint32_t WindowStart;
+	uint32_t NumIntervals;
+	uint64_t IntervalSum;
+	uint64_t IntervalSquaredSum;
+	uint32_t MaxInterval;
+};
+
 /////////////////////////////////////////////////////////////////////////////////////////////
-// ESP32 Specific code
+// Platform Specific code
 /////////////////////////////////////////////////////////////////////////////////////////////
 
-class ESPBluetooth
+// The rest of the stack only reaches the controller through Controller so it can be
+// built on a desktop and driven from captured traces (see Firmware/Tools/HCIReplay)
+
+#if WIIMOTE_HOST_BUILD
+
+class HostController // Implemented by the host tool
+{
+public:
+	static void Init(int (*Receive)(uint8_t *Data, uint16_t Length), void (*SendAvailable)());
+	static void DeInit();
+	static bool CanSend();
+	static void Send(uint8_t *Data, uint16_t Length);
+	static uint32_t GetTime();
+};
+
+typedef HostController Controller;
+
+#else
+
+class ESPController
+{
+public:
+	static void Init(int (*Receive)(uint8_t *Data, uint16_t Length), void (*SendAvailable)())
+	{
+#ifdef BT_CONTROLLER_INIT_CONFIG_DEFAULT
+		esp_bt_controller_config_t BluetoothConfig = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
+		esp_bt_controller_init(&BluetoothConfig);
+		esp_bt_controller_enable(ESP_BT_MODE_BTDM);
+#else
+		esp_bt_controller_init();
+#endif
+		VHCICallbacks.notify_host_send_available = SendAvailable;
+		VHCICallbacks.notify_host_recv = Receive;
+		esp_vhci_host_register_callback(&VHCICallbacks);
+	}
+
+	static void DeInit()
+	{
+		esp_bt_controller_disable();
+		esp_bt_controller_deinit();
+	}
+
+	static inline bool CanSend()
+	{
+		return esp_vhci_host_check_send_available();
+	}
+
+	static inline void Send(uint8_t *Data, uint16_t Length)
+	{
+		esp_vhci_host_send_packet(Data, Length);
+	}
+
+	static inline uint32_t GetTime() // Microseconds
+	{
+		return (uint32_t)esp_timer_get_time();
+	}
+
+private:
+	static esp_vhci_host_callback_t VHCICallbacks;
+};
+
+esp_vhci_host_callback_t ESPController::VHCICallbacks;
+
+typedef ESPController Controller;
+
+#endif
+
+/////////////////////////////////////////////////////////////////////////////////////////////
+// HCI Transport
+/////////////////////////////////////////////////////////////////////////////////////////////
+
+class HCITransport
 {
 private:
 	static int ReceivePacket(uint8_t *Data, uint16_t Length)
@@ -255,47 +621,141 @@ private:
 			else if (Data[0] == H4_TYPE_ACL)
 				ACLBuffer.Put(Data + 1, Length - 1);
 		}
+		Wake();
 		return 0;
 	}
 
-	static void SendReady()
+	// Called from the controller's task when there's something new to process
+	static void Wake()
 	{
+		if (WakeCallback)
+			WakeCallback();
 	}
 
 public:
-	static void InitBluetooth()
+	static void InitBluetooth(void (*InWakeCallback)())
 	{
-#ifdef BT_CONTROLLER_INIT_CONFIG_DEFAULT
-		esp_bt_controller_config_t BluetoothConfig = BT_CONTROLLER_INIT_CONFIG_DEFAULT();
-		esp_bt_controller_init(&BluetoothConfig);
-		esp_bt_controller_enable(ESP_BT_MODE_BTDM);
-#else
-		esp_bt_controller_init();
-#endif
-		VHCICallbacks.notify_host_send_available = SendReady;
-		VHCICallbacks.notify_host_recv = ReceivePacket;
-		esp_vhci_host_register_callback(&VHCICallbacks);
+		WakeCallback = InWakeCallback;
+		Controller::Init(ReceivePacket, Wake);
 	}
 	
 	static void DeInitBluetooth()
 	{
-		esp_bt_controller_disable();
-		esp_bt_controller_deinit();
+		Controller::DeInit();
 	}
 
-	static void SendPacket(uint8_t *Data, uint16_t Length)
+	static TransmitBuffer* AllocatePacket(uint16_t Length)
 	{
-		VERBOSE_PRINT("Sending:");
-		for (uint16_t i = 0; i < Length; i++)
+		check(Length <= TransmitBuffer::kMaxMessageLength);
+		TransmitBuffer *Packet = SendQueue.Allocate();
+		if (!Packet)
 		{
-			VERBOSE_PRINT(" %02x", Data[i]);
+			// Every buffer is waiting on controller credits. Waiting here would stall the whole
+			// task (and credits only come back through events) so the message is dropped instead.
+			if ((NumDropped++ & 0xFF) == 0)
+				printf("ERROR: Out of transmit buffers, dropped %d messages\n", NumDropped);
+			Packet = &DroppedPacket;
 		}
-		VERBOSE_PRINT("\n");
-		while (!esp_vhci_host_check_send_available())
+		Packet->Length = Length;
+		return Packet;
+	}
+
+	static void FreePacket(TransmitBuffer *Packet)
+	{
+		if (Packet != &DroppedPacket)
+			SendQueue.Free(Packet);
+	}
+
+	static void QueuePacket(TransmitBuffer *Packet)
+	{
+		if (Packet == &DroppedPacket)
+			return;
+		if (Packet->Data[0] == H4_TYPE_ACL)
+		{
+			uint16_t Handle = (Packet->Data[1] | (Packet->Data[2] << 8)) & 0xFFF;
+			TransmitQueue::Link *Link = SendQueue.FindLink(Handle, true);
+			if (!Link)
+			{
+				printf("ERROR: Too many links to queue for handle %x\n", Handle);
+				SendQueue.Free(Packet);
+				return;
+			}
+			Link->Queue.Push(Packet);
+		}
+		else
 		{
-			vTaskDelay(1);
+			SendQueue.Commands.Push(Packet);
 		}
-		esp_vhci_host_send_packet(Data, Length);
+		FlushPackets();
+	}
+
+	static void FlushPackets()
+	{
+		// Hands over as much as the controller has credits for. Never blocks.
+		while (CommandCredits && !SendQueue.Commands.IsEmpty() && Controller::CanSend())
+		{
+			SendPacket(SendQueue.Commands.Pop());
+			CommandCredits--;
+		}
+
+		// One packet per link per pass so they share the controller's buffers fairly
+		uint16_t LinkLimit = (ACLCredits > 1) ? ACLCredits / 2 : 1; // No single link can use every buffer
+		bool bSent = true;
+		while (bSent && AvailableACLCredits)
+		{
+			bSent = false;
+			for (int i = 0; i < TransmitQueue::kMaxLinks && AvailableACLCredits; i++)
+			{
+				TransmitQueue::Link &Link = SendQueue.Links[NextLink];
+				NextLink = (NextLink + 1) % TransmitQueue::kMaxLinks;
+				if (!Link.bUsed || Link.Queue.IsEmpty() || Link.InFlight >= LinkLimit)
+					continue;
+				if (!Controller::CanSend())
+					return;
+				SendPacket(Link.Queue.Pop());
+				Link.InFlight++;
+				AvailableACLCredits--;
+				bSent = true;
+			}
+		}
+	}
+
+	// From Command_Complete/Command_Status. It's how many can be sent now rather than how many finished.
+	static void SetCommandCredits(uint8_t NumPackets)
+	{
+		CommandCredits = NumPackets;
+	}
+
+	// From Read_Buffer_Size
+	static void SetACLBufferCount(uint16_t NumBuffers)
+	{
+		uint16_t InFlight = ACLCredits - AvailableACLCredits;
+		ACLCredits = NumBuffers;
+		AvailableACLCredits = (NumBuffers > InFlight) ? NumBuffers - InFlight : 0;
+	}
+
+	// From Num_Completed_Packets
+	static void CompleteACLPackets(uint16_t Handle, uint16_t NumPackets)
+	{
+		TransmitQueue::Link *Link = SendQueue.FindLink(Handle, false);
+		if (!Link)
+			return;
+		NumPackets = (NumPackets > Link->InFlight) ? Link->InFlight : NumPackets;
+		Link->InFlight -= NumPackets;
+		AvailableACLCredits += NumPackets;
+		SendQueue.ReleaseIfIdle(Link);
+	}
+
+	// The controller drops anything it had for the handle so those buffers are free again
+	static void DisconnectACL(uint16_t Handle)
+	{
+		TransmitQueue::Link *Link = SendQueue.FindLink(Handle, false);
+		if (!Link)
+			return;
+		AvailableACLCredits += Link->InFlight;
+		Link->InFlight = 0;
+		SendQueue.FreeAll(Link->Queue);
+		SendQueue.ReleaseIfIdle(Link);
 	}
 
 	static uint16_t GetEventPacket(uint8_t *Data, uint16_t MaxLength)
@@ -309,151 +769,153 @@ public:
 	}
 
 private:
+	static void SendPacket(TransmitBuffer *Packet)
+	{
+		VERBOSE_PRINT("Sending:");
+		for (uint16_t i = 0; i < Packet->Length; i++)
+		{
+			VERBOSE_PRINT(" %02x", Packet->Data[i]);
+		}
+		VERBOSE_PRINT("\n");
+		Controller::Send(Packet->Data, Packet->Length);
+		SendQueue.Free(Packet);
+	}
+
 	static RingBuffer EventBuffer;
 	static RingBuffer ACLBuffer;
-	static esp_vhci_host_callback_t VHCICallbacks;
+	static void (*WakeCallback)();
+	static TransmitQueue SendQueue;
+	static TransmitBuffer DroppedPacket; // Built into and thrown away when out of buffers
+	static uint32_t NumDropped;
+	static uint8_t CommandCredits;
+	static uint16_t ACLCredits; // Controller's ACL buffers
+	static uint16_t AvailableACLCredits;
+	static int NextLink;
 };
 
-RingBuffer ESPBluetooth::EventBuffer;
-RingBuffer ESPBluetooth::ACLBuffer;
-esp_vhci_host_callback_t ESPBluetooth::VHCICallbacks;
+RingBuffer HCITransport::EventBuffer;
+RingBuffer HCITransport::ACLBuffer;
+void (*HCITransport::WakeCallback)() = nullptr;
+TransmitQueue HCITransport::SendQueue;
+TransmitBuffer HCITransport::DroppedPacket;
+uint32_t HCITransport::NumDropped = 0;
+uint8_t HCITransport::CommandCredits = 1; // Controllers start by accepting one command
+uint16_t HCITransport::ACLCredits = 1; // Until Read_Buffer_Size says otherwise
+uint16_t HCITransport::AvailableACLCredits = 1;
+int HCITransport::NextLink = 0;
 
 /////////////////////////////////////////////////////////////////////////////////////////////
 // Message Builders
 /////////////////////////////////////////////////////////////////////////////////////////////
 
+// Builders are sized at compile time so headers are written up front and the message is
+// serialized straight into a pooled transmit buffer that's queued to the controller on Send()
+
 class HCIMessage : public GenericMessage
 {
 public:
-	HCIMessage(H4Type Type)
+	HCIMessage(H4Type Type, uint16_t InLength)
+		: GenericMessage(HCITransport::AllocatePacket(InLength + 1))
 	{
 		AddByte((uint8_t)Type);
 	}
 
+	~HCIMessage()
+	{
+		if (Packet)
+		{
+			printf("ERROR: Message built but never sent\n");
+			HCITransport::FreePacket(Packet);
+		}
+	}
+
 	void Send()
 	{
-		check((Ptr - Buffer) <= kMaxMessageLength);
-		ESPBluetooth::SendPacket(Buffer, Ptr - Buffer);
+		check(Ptr - Packet->Data == Packet->Length);
+		HCITransport::QueuePacket(Packet);
+		Packet = nullptr;
 	}
 };
 
+template<uint16_t PayloadSize>
 class HCICommand : public HCIMessage
 {
+	static_assert(PayloadSize <= 255, "HCI command too long");
+
 public:
 	HCICommand(uint16_t Cmd)
-		: HCIMessage(H4_TYPE_COMMAND)
+		: HCIMessage(H4_TYPE_COMMAND, 3 + PayloadSize)
 	{
 		AddWord(Cmd);
-		CMDLength = AddByte(0);
-		CMDStart = Ptr;
+		AddByte(PayloadSize);
 	}
-
-	void Send()
-	{
-		*CMDLength = (uint8_t)(Ptr - CMDStart);
-		HCIMessage::Send();
-	}
-
-private:
-	uint8_t *CMDStart;
-	uint8_t *CMDLength;
 };
 
+template<uint16_t PayloadSize>
 class ACLMessage : public HCIMessage
 {
+	static_assert(PayloadSize + 5 <= kMaxMessageLength, "ACL message too long");
+
 public:
 	ACLMessage(uint16_t Handle)
-		: HCIMessage(H4_TYPE_ACL)
+		: HCIMessage(H4_TYPE_ACL, 4 + PayloadSize)
 	{
 		Handle |= (2 << 12); // Packet_Boundary_Flag: Automatically flushable
 		Handle |= (0 << 14); // Broadcast_Flag: Point to point
 		AddWord(Handle);
-		ACLLength = AddWord(0);
-		ACLStart = Ptr;
-	}
-
-	void Send()
-	{
-		SetWord(ACLLength, Ptr - ACLStart);
-		HCIMessage::Send();
+		AddWord(PayloadSize);
 	}
-
-private:
-	uint8_t *ACLStart;
-	uint8_t *ACLLength;
 };
 
-class L2CAPMessage : public ACLMessage
+template<uint16_t PayloadSize>
+class L2CAPMessage : public ACLMessage<4 + PayloadSize>
 {
 public:
 	L2CAPMessage(uint16_t DestChannelID, uint16_t ACLHandle)
-		: ACLMessage(ACLHandle)
+		: ACLMessage<4 + PayloadSize>(ACLHandle)
 	{
-		L2CAPLength = AddWord(0);
-		AddWord(DestChannelID);
-		L2CAPStart = Ptr;
+		this->AddWord(PayloadSize);
+		this->AddWord(DestChannelID);
 	}
-
-	void Send()
-	{
-		SetWord(L2CAPLength, Ptr - L2CAPStart);
-		ACLMessage::Send();
-	}
-
-private:
-	uint8_t *L2CAPLength;
-	uint8_t *L2CAPStart;
 };
 
-class L2CAPRequest : public L2CAPMessage
+static uint8_t L2CAPMsgId = 0;
+
+template<uint16_t PayloadSize>
+class L2CAPRequest : public L2CAPMessage<4 + PayloadSize>
 {
 public:
 	L2CAPRequest(uint8_t Code, uint16_t ACLHandle)
-		: L2CAPMessage(L2CAP_SIGNALING_CHANNEL, ACLHandle)
+		: L2CAPMessage<4 + PayloadSize>(L2CAP_SIGNALING_CHANNEL, ACLHandle)
 	{
-		AddByte(Code);
-		AddByte(MsgId++);
-		ReqLength = AddWord(0);
-		ReqStart = Ptr;
+		this->AddByte(Code);
+		this->AddByte(L2CAPMsgId++);
+		this->AddWord(PayloadSize);
 	}
 
 	L2CAPRequest(uint8_t Code, uint16_t ACLHandle, uint16_t OverrideMsgId)
-		: L2CAPMessage(L2CAP_SIGNALING_CHANNEL, ACLHandle)
-	{
-		AddByte(Code);
-		AddByte(OverrideMsgId);
-		ReqLength = AddWord(0);
-		ReqStart = Ptr;
-		if (OverrideMsgId == MsgId)
-			MsgId++;
-	}
-
-	void Send()
+		: L2CAPMessage<4 + PayloadSize>(L2CAP_SIGNALING_CHANNEL, ACLHandle)
 	{
-		SetWord(ReqLength, Ptr - ReqStart);
-		L2CAPMessage::Send();
+		this->AddByte(Code);
+		this->AddByte(OverrideMsgId);
+		this->AddWord(PayloadSize);
+		if (OverrideMsgId == L2CAPMsgId)
+			L2CAPMsgId++;
 	}
-
-private:
-	uint8_t *ReqStart;
-	uint8_t *ReqLength;
-	static uint8_t MsgId;
 };
 
-class WiimoteMessage : public L2CAPMessage
+template<uint16_t PayloadSize>
+class WiimoteMessage : public L2CAPMessage<2 + PayloadSize>
 {
 public:
 	WiimoteMessage(uint8_t ReportNum, uint16_t DCID, uint16_t ACLHandle)
-		: L2CAPMessage(DCID, ACLHandle)
+		: L2CAPMessage<2 + PayloadSize>(DCID, ACLHandle)
 	{
-		AddByte(0xA2);
-		AddByte(ReportNum);
+		this->AddByte(0xA2);
+		this->AddByte(ReportNum);
 	}
-
 };
 
-uint8_t L2CAPRequest::MsgId = 0;
-
 /////////////////////////////////////////////////////////////////////////////////////////////
 // Message Readers
 /////////////////////////////////////////////////////////////////////////////////////////////
@@ -584,7 +1046,12 @@ public:
 		bConnected = false;
 		bAllocated = false;
 		bWantsConnection = false;
+		bHasAddress = false;
+		bHasPreferredAddress = false;
+		bPaging = false;
+		bIncoming = false;
 		Handle = 0;
+		ClearChannels();
 	}
 
 	bool IsAllocated()
@@ -612,7 +1079,12 @@ public:
 		bConnected = false;
 		bAllocated = true;
 		bWantsConnection = true;
+		bHasAddress = false;
+		bHasPreferredAddress = false;
+		bPaging = false;
+		bIncoming = false;
 		Handle = 0;
+		ClearChannels();
 	}
 
 	void Free()
@@ -620,12 +1092,148 @@ public:
 		bConnected = false;
 		bAllocated = false;
 		bWantsConnection = false;
+		bHasAddress = false;
+		bHasPreferredAddress = false;
+		bPaging = false;
+		bIncoming = false;
 		Handle = 0;
+		ClearChannels();
+	}
+
+	// L2CAP channels open on this link so incoming packets are matched to a channel without searching every one
+	bool AddChannel(L2CAPConnection *Channel)
+	{
+		for (int i = 0; i < kMaxChannels; i++)
+		{
+			if (!Channels[i])
+			{
+				Channels[i] = Channel;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void RemoveChannel(L2CAPConnection *Channel)
+	{
+		for (int i = 0; i < kMaxChannels; i++)
+		{
+			if (Channels[i] == Channel)
+				Channels[i] = nullptr;
+		}
+	}
+
+	L2CAPConnection* GetChannel(int Index)
+	{
+		return Channels[Index];
+	}
+
+	bool HasFreeChannel()
+	{
+		for (int i = 0; i < kMaxChannels; i++)
+		{
+			if (!Channels[i])
+				return true;
+		}
+		return false;
+	}
+
+	// Remembers a device found by inquiry so it can be paged. Bit 15 of the clock offset marks it as valid.
+	void SetAddress(const uint8_t *InAddress, uint8_t InPageScanRepetitionMode, uint16_t InClockOffset)
+	{
+		memcpy(Address, InAddress, sizeof(Address));
+		PageScanRepetitionMode = InPageScanRepetitionMode;
+		ClockOffset = InClockOffset;
+		bHasAddress = true;
+		bIncoming = false;
+	}
+
+	// Device this slot was connected to last time. Paged straight away without an inquiry and
+	// given this slot back if an inquiry finds it instead.
+	void SetPreferredAddress(const uint8_t *InAddress)
+	{
+		memcpy(PreferredAddress, InAddress, sizeof(PreferredAddress));
+		bHasPreferredAddress = true;
+		SetAddress(InAddress, 1, 0); // R1 is what a discoverable Wiimote uses, clock offset unknown
+	}
+
+	bool HasPreferredAddress()
+	{
+		return bHasPreferredAddress;
+	}
+
+	bool IsPreferredAddress(const uint8_t *InAddress)
+	{
+		return bHasPreferredAddress && memcmp(PreferredAddress, InAddress, sizeof(PreferredAddress)) == 0;
+	}
+
+	void ClearAddress()
+	{
+		bHasAddress = false;
+		bPaging = false;
+		bIncoming = false;
+	}
+
+	bool HasAddress(const uint8_t *InAddress)
+	{
+		return bAllocated && bHasAddress && memcmp(Address, InAddress, sizeof(Address)) == 0;
+	}
+
+	bool NeedsPaging()
+	{
+		return WantsConnection() && bHasAddress && !bPaging;
+	}
+
+	bool NeedsAddress()
+	{
+		return WantsConnection() && !bHasAddress;
+	}
+
+	void SetPaging()
+	{
+		bPaging = true;
+	}
+
+	// The Wiimote paged us so it's already connecting and will open the L2CAP channels itself
+	void SetIncoming()
+	{
+		bPaging = true;
+		bIncoming = true;
+	}
+
+	bool IsIncoming()
+	{
+		return bIncoming;
+	}
+
+	// Whichever device this slot is after, so it can be found again after the link drops
+	bool GetKnownAddress(uint8_t *OutAddress)
+	{
+		if (!bHasAddress && !bHasPreferredAddress)
+			return false;
+		memcpy(OutAddress, bHasAddress ? Address : PreferredAddress, sizeof(Address));
+		return true;
+	}
+
+	const uint8_t* GetAddress()
+	{
+		return Address;
+	}
+
+	uint8_t GetPageScanRepetitionMode()
+	{
+		return PageScanRepetitionMode;
+	}
+
+	uint16_t GetClockOffset()
+	{
+		return ClockOffset;
 	}
 
 	void RegisterConnection(uint16_t ACLHandle)
 	{
 		bWantsConnection = false;
+		bPaging = false;
 		bConnected = true;
 		Handle = ACLHandle;
 	}
@@ -641,11 +1249,31 @@ public:
 		return Handle;
 	}
 
+	enum
+	{
+		kMaxChannels = 4 // Wiimotes only use control and data
+	};
+
 private:
+	void ClearChannels()
+	{
+		for (int i = 0; i < kMaxChannels; i++)
+			Channels[i] = nullptr;
+	}
+
 	bool bConnected;
 	bool bAllocated;
 	bool bWantsConnection;
+	bool bHasAddress;
+	bool bHasPreferredAddress;
+	bool bPaging;
+	bool bIncoming;
 	uint16_t Handle;
+	uint8_t Address[6];
+	uint8_t PreferredAddress[6];
+	uint8_t PageScanRepetitionMode;
+	uint16_t ClockOffset;
+	L2CAPConnection *Channels[kMaxChannels];
 };
 
 class HCI
@@ -655,26 +1283,54 @@ private:
 	{
 		HCI_Inquiry = 1,
 		HCI_Create_Connection = 5,
+		HCI_Disconnect = 6,
+		HCI_Accept_Connection_Request = 9,
+		HCI_Reject_Connection_Request = 10,
+		HCI_Link_Key_Request_Negative_Reply = 12,
+		HCI_PIN_Code_Request_Reply = 13,
 		HCI_Link_Control = (1 << 10), // FIXME: Check this
 	};
 
+	enum LinkPolicy
+	{
+		HCI_QoS_Setup = 7,
+		HCI_Write_Link_Policy_Settings = 13,
+		HCI_Link_Policy = (2 << 10),
+	};
+
 	enum BasebandControl
 	{
 		HCI_Reset = 3,
 		HCI_Set_Event_Filter = 5,
+		HCI_Write_Page_Timeout = 24,
+		HCI_Write_Scan_Enable = 26,
+		HCI_Write_Link_Supervision_Timeout = 55,
 		HCI_Baseband_Control = (3 << 10), // FIXME: Check this
 	};
 
+	enum Informational
+	{
+		HCI_Read_Buffer_Size = 5,
+		HCI_Read_BD_ADDR = 9,
+		HCI_Informational = (4 << 10),
+	};
+
 	enum Events
 	{
 		HCI_Inquiry_Complete = 1,
 		HCI_Inquiry_Result = 2,
 		HCI_Connection_Complete = 3,
+		HCI_Connection_Request = 4,
 		HCI_Disconnection_Complete = 5,
 		HCI_QoS_Setup_Complete = 13,
 		HCI_Command_Complete = 14,
 		HCI_Command_Status = 15,
+		HCI_Role_Change = 18,
 		HCI_Num_Completed_Packets = 19,
+		HCI_Mode_Change = 20,
+		HCI_PIN_Code_Request = 22,
+		HCI_Link_Key_Request = 23,
+		HCI_Link_Key_Notification = 24,
 		HCI_Data_Buffer_Overflow = 26
 	};
 
@@ -683,12 +1339,14 @@ private:
 		STATE_STARTUP,
 		STATE_READY,
 		STATE_INQUIRYING,
-		STATE_CONNECTING
+		STATE_PAGING
 	};
 
 	enum
 	{
-		kMaxACLConnections = 16
+		kMaxACLConnections = 16,
+		kMaxInquiryResponses = 8,
+		kHandleTableSize = 32 // Must be power of two
 	};
 
 private:
@@ -698,60 +1356,224 @@ private:
 		State = InState;
 	}
 
-	ACLConnection* FindConnection(uint16_t Handle)
+	// Every ACL packet is looked up by handle so connected handles are kept in a small table indexed by their low bits
+	ACLConnection* FindConnection(uint16_t Handle, bool bMustExist = true)
 	{
-		for (int i = 0; i < kMaxACLConnections; i++)
+		ACLConnection *Connection = HandleTable[Handle & (kHandleTableSize - 1)];
+		if (Connection && Connection->IsConnected() && Handle == Connection->GetHandle())
+			return Connection;
+		for (int i = 0; i < kMaxACLConnections; i++) // Only when two handles share a slot
 		{
 			if (Connections[i].IsConnected() && Handle == Connections[i].GetHandle())
 			{
 				return &Connections[i];
 			}
 		}
-		printf("ERROR: HCIManager Can't find allocated connection with handle %x", Handle);
+		if (bMustExist)
+			UnknownHandles.Add(Handle);
 		return nullptr;
 	}
 
+	void RegisterConnection(ACLConnection *Connection, uint16_t Handle)
+	{
+		Connection->RegisterConnection(Handle);
+		ACLConnection *&Entry = HandleTable[Handle & (kHandleTableSize - 1)];
+		if (!Entry || !Entry->IsConnected())
+			Entry = Connection;
+	}
+
+	void UnregisterConnection(ACLConnection *Connection)
+	{
+		ACLConnection *&Entry = HandleTable[Connection->GetHandle() & (kHandleTableSize - 1)];
+		if (Entry == Connection)
+			Entry = nullptr;
+	}
+
 	void Reset()
 	{
-		HCICommand Cmd(HCI_Reset | HCI_Baseband_Control);
+		HCICommand<0> Cmd(HCI_Reset | HCI_Baseband_Control);
 		Cmd.Send();
 	}
 
 	void SetFilter()
 	{
-		HCICommand Cmd(HCI_Set_Event_Filter | HCI_Baseband_Control);
+		HCICommand<8> Cmd(HCI_Set_Event_Filter | HCI_Baseband_Control);
 		Cmd.AddByte(1); // Filter inquiry results
 		Cmd.AddByte(1); // Search for only this of class
-		Cmd.AddTri(0x000500); // Class we want to look for
-		Cmd.AddTri(~0x00200C); // Mask out bits which differ for Wiimote + Wiimote Plus
+		Cmd.AddTri(WIIMOTE_CLASS_OF_DEVICE); // Class we want to look for
+		Cmd.AddTri(WIIMOTE_CLASS_OF_DEVICE_MASK);
 		Cmd.Send();
 	}
 
-	void Inquire()
+	void ReadBufferSize()
 	{
-		HCICommand Cmd(HCI_Inquiry | HCI_Link_Control);
-		Cmd.AddTri(0x9E8B33); // General Inquiry Access Code (GIAC) LAP
-		Cmd.AddByte(8); // Time to search: N*1.28s
-		Cmd.AddByte(1); // Num_Responses before halt
+		HCICommand<0> Cmd(HCI_Read_Buffer_Size | HCI_Informational);
+		Cmd.Send();
+	}
+
+	void ReadLocalAddress()
+	{
+		HCICommand<0> Cmd(HCI_Read_BD_ADDR | HCI_Informational);
 		Cmd.Send();
 	}
 
-	void Connect(uint8_t *BluetoothAddress)
+	void EnablePageScan()
 	{
-		HCICommand Cmd(HCI_Create_Connection | HCI_Link_Control);
+		// Lets a sleeping Wiimote that's been woken with a button connect to us
+		HCICommand<1> Cmd(HCI_Write_Scan_Enable | HCI_Baseband_Control);
+		Cmd.AddByte(2); // Page scan only, we don't want to be discovered
+		Cmd.Send();
+	}
+
+	void AcceptConnection(const uint8_t *BluetoothAddress)
+	{
+		HCICommand<7> Cmd(HCI_Accept_Connection_Request | HCI_Link_Control);
+		Cmd.AppendData(BluetoothAddress, 6);
+		Cmd.AddByte(0); // Role: Become master like when we page
+		Cmd.Send();
+	}
+
+	void RejectConnection(const uint8_t *BluetoothAddress)
+	{
+		HCICommand<7> Cmd(HCI_Reject_Connection_Request | HCI_Link_Control);
 		Cmd.AppendData(BluetoothAddress, 6);
+		Cmd.AddByte(0x0F); // Reason: Unacceptable BD_ADDR
+		Cmd.Send();
+	}
+
+	void SetPageTimeout()
+	{
+		// Default is 5.12s which is a long wait for each remembered Wiimote that isn't switched on.
+		// A discoverable Wiimote scans every 1.28s so this still gives it two chances.
+		HCICommand<2> Cmd(HCI_Write_Page_Timeout | HCI_Baseband_Control);
+		Cmd.AddWord(0x1000); // N*0.625ms = 2.56s
+		Cmd.Send();
+	}
+
+	void Inquire(uint8_t NumResponses)
+	{
+		HCICommand<5> Cmd(HCI_Inquiry | HCI_Link_Control);
+		Cmd.AddTri(0x9E8B33); // General Inquiry Access Code (GIAC) LAP
+		Cmd.AddByte(3); // Time to search: N*1.28s (short so anything found isn't kept waiting long)
+		Cmd.AddByte(NumResponses); // Num_Responses before halt (stops as soon as every slot has a Wiimote)
+		Cmd.Send();
+	}
+
+	void Connect(ACLConnection *Connection)
+	{
+		HCICommand<13> Cmd(HCI_Create_Connection | HCI_Link_Control);
+		Cmd.AppendData(Connection->GetAddress(), 6);
 		Cmd.AddWord(0xCC18); // Packet_Type: Allow all DH+DM
-		Cmd.AddByte(1); // Page_Scan_Repetition_Mode: Optional Page Scan Mode I
+		Cmd.AddByte(Connection->GetPageScanRepetitionMode()); // Page_Scan_Repetition_Mode: From inquiry
 		Cmd.AddByte(0); // Reserved
-		Cmd.AddWord(0); // Clock_Offset: Invalid
+		Cmd.AddWord(Connection->GetClockOffset()); // Clock_Offset: From inquiry so paging starts at the right frequency
 		Cmd.AddByte(0); // Allow_Role_Switch: No
 		Cmd.Send();
+		Connection->SetPaging();
+		memcpy(PagingAddress, Connection->GetAddress(), sizeof(PagingAddress));
+	}
+
+	ACLConnection* FindConnectionByAddress(const uint8_t *BluetoothAddress)
+	{
+		for (int i = 0; i < kMaxACLConnections; i++)
+		{
+			if (Connections[i].HasAddress(BluetoothAddress))
+			{
+				return &Connections[i];
+			}
+		}
+		return nullptr;
+	}
+
+	// Picks the slot for a device found by inquiry. Its own slot if it was remembered, otherwise
+	// one without a remembered Wiimote so that still has a chance of turning up.
+	ACLConnection* FindConnectionForAddress(const uint8_t *BluetoothAddress)
+	{
+		ACLConnection *Fallback = nullptr;
+		for (int i = 0; i < kMaxACLConnections; i++)
+		{
+			if (!Connections[i].NeedsAddress())
+				continue;
+			if (Connections[i].IsPreferredAddress(BluetoothAddress))
+				return &Connections[i];
+			if (!Fallback || (Fallback->HasPreferredAddress() && !Connections[i].HasPreferredAddress()))
+				Fallback = &Connections[i];
+		}
+		return Fallback;
+	}
+
+	// Pages the next Wiimote found by inquiry, one at a time as most controllers can only page one device
+	void PageNext()
+	{
+		for (int i = 0; i < kMaxACLConnections; i++)
+		{
+			if (Connections[i].NeedsPaging())
+			{
+				Connect(&Connections[i]);
+				SetState(STATE_PAGING);
+				return;
+			}
+		}
+		SetState(STATE_READY);
+	}
+
+	void SetLinkPolicy(uint16_t Handle)
+	{
+		HCICommand<4> Cmd(HCI_Write_Link_Policy_Settings | HCI_Link_Policy);
+		Cmd.AddWord(Handle);
+		Cmd.AddWord(0); // Disable role switch, hold, sniff and park so the link stays active
+		Cmd.Send();
+	}
+
+	void SetSupervisionTimeout(uint16_t Handle)
+	{
+		// Default is 20s of silence before the link is declared dead. Wiimotes report every 10ms so
+		// anything over a second means it's gone and it's better to start reconnecting.
+		HCICommand<4> Cmd(HCI_Write_Link_Supervision_Timeout | HCI_Baseband_Control);
+		Cmd.AddWord(Handle);
+		Cmd.AddWord(0x0640); // N*0.625ms = 1s
+		Cmd.Send();
+	}
+
+	void SetupQoS(uint16_t Handle)
+	{
+		// The controller picks the poll interval from the latency so ask for the minimum.
+		// Token rate covers a report every 10ms with room to spare.
+		HCICommand<20> Cmd(HCI_QoS_Setup | HCI_Link_Policy);
+		Cmd.AddWord(Handle);
+		Cmd.AddByte(0); // Flags: Reserved
+		Cmd.AddByte(2); // Service_Type: Guaranteed
+		Cmd.AddQuad(4000); // Token_Rate: Bytes per second
+		Cmd.AddQuad(0); // Peak_Bandwidth: Unknown
+		Cmd.AddQuad(1250); // Latency: Microseconds (2 slots)
+		Cmd.AddQuad(0xFFFFFFFF); // Delay_Variation: Don't care
+		Cmd.Send();
+	}
+
+	// Wiimotes synced with the SYNC button authenticate when they reconnect. There's no stored
+	// link key so they're paired again using our address as the PIN, which is what the Wii does.
+	void ReplyToLinkKeyRequest(const uint8_t *BluetoothAddress)
+	{
+		HCICommand<6> Cmd(HCI_Link_Key_Request_Negative_Reply | HCI_Link_Control);
+		Cmd.AppendData(BluetoothAddress, 6);
+		Cmd.Send();
+	}
+
+	void ReplyToPINCodeRequest(const uint8_t *BluetoothAddress)
+	{
+		HCICommand<23> Cmd(HCI_PIN_Code_Request_Reply | HCI_Link_Control);
+		Cmd.AppendData(BluetoothAddress, 6);
+		Cmd.AddByte(6); // PIN_Code_Length
+		Cmd.AppendData(LocalAddress, 6);
+		for (int i = 6; i < 16; i++)
+			Cmd.AddByte(0); // Padding
+		Cmd.Send();
 	}
 
 	bool PumpMessages()
 	{
 		uint8_t Message[128];
-		uint16_t Length = ESPBluetooth::GetEventPacket(Message, sizeof(Message));
+		uint16_t Length = HCITransport::GetEventPacket(Message, sizeof(Message));
 		if (Length == 0)
 			return false;
 		MessageParser Parser(Message, Length); // Supplies debugging helpers
@@ -762,54 +1584,131 @@ private:
 		{
 		case HCI_Inquiry_Complete:
 		{
-			check(State == STATE_INQUIRYING || State == STATE_CONNECTING);
+			check(State == STATE_INQUIRYING);
 			Parser.ReadByte("Status");
-			if (State == STATE_INQUIRYING) // If we didn't find anything then just go around again
-				SetState(STATE_READY);
+			PageNext(); // If we didn't find anything then this just goes around again
 			break;
 		}
 
 		case HCI_Inquiry_Result:
 		{
 			check(State == STATE_INQUIRYING);
-			uint8_t BluetoothAddress[6];
+			// Responses are sent as an array per field rather than per device
+			uint8_t BluetoothAddress[kMaxInquiryResponses][6];
+			uint8_t RepetitionMode[kMaxInquiryResponses];
 			uint8_t NumResponses = Parser.ReadByte("Num_Responses");
-			if (NumResponses > 0)
-			{
-				check(NumResponses == 1); // We requested only a maximum of 1
-				Parser.ReadData("BD_ADDR", BluetoothAddress, sizeof(BluetoothAddress));
-				Parser.ReadByte("RepetitionMode");
-				Parser.ReadByte("Reserved");
+			check(NumResponses <= kMaxInquiryResponses);
+			NumResponses = (NumResponses > kMaxInquiryResponses) ? kMaxInquiryResponses : NumResponses;
+			for (uint8_t i = 0; i < NumResponses; i++)
+				Parser.ReadData("BD_ADDR", BluetoothAddress[i], 6);
+			for (uint8_t i = 0; i < NumResponses; i++)
+				RepetitionMode[i] = Parser.ReadByte("RepetitionMode");
+			for (uint8_t i = 0; i < NumResponses * 2; i++)
 				Parser.ReadByte("Reserved");
+			for (uint8_t i = 0; i < NumResponses; i++)
 				Parser.ReadTri("Class");
-				Parser.ReadWord("ClockOffset");
-				Connect(BluetoothAddress);
-				SetState(STATE_CONNECTING);
+			for (uint8_t i = 0; i < NumResponses; i++)
+			{
+				uint16_t ClockOffset = Parser.ReadWord("ClockOffset");
+				if (FindConnectionByAddress(BluetoothAddress[i]))
+					continue; // Already connected or queued to be paged
+				ACLConnection *Connection = FindConnectionForAddress(BluetoothAddress[i]);
+				if (Connection)
+					Connection->SetAddress(BluetoothAddress[i], RepetitionMode[i], ClockOffset | 0x8000);
 			}
 			break;
 		}
 
 		case HCI_Connection_Complete:
 		{
-			check(State == STATE_CONNECTING);
 			uint8_t BluetoothAddress[6];
 			uint8_t Result = Parser.ReadByte("ErrorCode");
 			uint16_t Handle = Parser.ReadWord("Handle");
 			Parser.ReadData("BD_ADDR", BluetoothAddress, sizeof(BluetoothAddress));
 			Parser.ReadByte("LinkType");
 			Parser.ReadByte("Encryption");
-			if (Result == 0)
+			ACLConnection *Connection = FindConnectionByAddress(BluetoothAddress);
+			if (Connection && Result == 0)
 			{
-				for (int i = 0; i < kMaxACLConnections; i++)
-				{
-					if (Connections[i].WantsConnection())
-					{
-						Connections[i].RegisterConnection(Handle);
-						break;
-					}
-				}
+				RegisterConnection(Connection, Handle);
+				SetSupervisionTimeout(Handle);
+#if WIIMOTE_LOW_LATENCY_LINK
+				SetLinkPolicy(Handle);
+				SetupQoS(Handle);
+#endif
 			}
-			SetState(STATE_READY);
+			else if (Connection && Connection->IsIncoming() && State == STATE_PAGING && memcmp(BluetoothAddress, PagingAddress, sizeof(PagingAddress)) == 0)
+			{
+				// Our page lost out to the Wiimote connecting to us, its own Connection_Complete is still to come
+			}
+			else if (Connection && !Connection->IsConnected())
+			{
+				printf("ERROR: Failed to connect to Wiimote (Error=%x)\n", Result);
+				Connection->ClearAddress(); // Find it again with the next inquiry (also the fallback for remembered Wiimotes)
+			}
+			if (State == STATE_PAGING && memcmp(BluetoothAddress, PagingAddress, sizeof(PagingAddress)) == 0)
+			{
+				PageNext();
+			}
+			break;
+		}
+
+		case HCI_Connection_Request:
+		{
+			uint8_t BluetoothAddress[6];
+			Parser.ReadData("BD_ADDR", BluetoothAddress, sizeof(BluetoothAddress));
+			uint32_t Class = Parser.ReadTri("Class");
+			uint8_t LinkType = Parser.ReadByte("LinkType");
+			ACLConnection *Connection = nullptr;
+			if (LinkType == 1 && (Class & WIIMOTE_CLASS_OF_DEVICE_MASK) == WIIMOTE_CLASS_OF_DEVICE)
+			{
+				Connection = FindConnectionByAddress(BluetoothAddress); // Found by inquiry or being paged already
+				if (!Connection)
+					Connection = FindConnectionForAddress(BluetoothAddress);
+				else if (Connection->IsConnected())
+					Connection = nullptr;
+			}
+			if (Connection)
+			{
+				Connection->SetAddress(BluetoothAddress, 1, 0);
+				Connection->SetIncoming();
+				AcceptConnection(BluetoothAddress);
+			}
+			else
+			{
+				RejectConnection(BluetoothAddress);
+			}
+			break;
+		}
+
+		case HCI_Link_Key_Request:
+		{
+			uint8_t BluetoothAddress[6];
+			Parser.ReadData("BD_ADDR", BluetoothAddress, sizeof(BluetoothAddress));
+			ReplyToLinkKeyRequest(BluetoothAddress);
+			break;
+		}
+
+		case HCI_PIN_Code_Request:
+		{
+			uint8_t BluetoothAddress[6];
+			Parser.ReadData("BD_ADDR", BluetoothAddress, sizeof(BluetoothAddress));
+			ReplyToPINCodeRequest(BluetoothAddress);
+			break;
+		}
+
+		case HCI_Link_Key_Notification:
+		{
+			Parser.DumpRemaining("LinkKey"); // Not kept, the Wiimote is paired again next time
+			break;
+		}
+
+		case HCI_Role_Change:
+		{
+			uint8_t Result = Parser.ReadByte("Status");
+			Parser.DumpRemaining("RoleChange");
+			if (Result != 0)
+				printf("ERROR: Role change failed (Error=%x)\n", Result);
 			break;
 		}
 
@@ -817,12 +1716,16 @@ private:
 		{
 			uint8_t Result = Parser.ReadByte("ErrorCode");
 			uint16_t Handle = Parser.ReadWord("Handle");
-			Parser.ReadByte("Reason");
+			uint8_t Reason = Parser.ReadByte("Reason");
 			if (Result == 0)
 			{
-				ACLConnection *Connection = FindConnection(Handle);
+				HCITransport::DisconnectACL(Handle);
+				if (Reason != 0x16) // Not us hanging up. 0x08 is supervision timeout, 0x13 the Wiimote switching off.
+					printf("Handle %x disconnected (Reason=%x)\n", Handle, Reason);
+				ACLConnection *Connection = FindConnection(Handle, false); // Already freed if we asked for it
 				if (Connection) // Set handle as disconnected
 				{
+					UnregisterConnection(Connection);
 					Connection->RegisterDisconnection();
 				}
 			}
@@ -831,30 +1734,64 @@ private:
 
 		case HCI_QoS_Setup_Complete:
 		{
-			Parser.ReadByte("Status");
-			Parser.ReadWord("Handle");
+			uint8_t Result = Parser.ReadByte("Status");
+			uint16_t Handle = Parser.ReadWord("Handle");
 			Parser.ReadByte("Flags");
 			Parser.ReadByte("Service_Type");
 			Parser.ReadQuad("Token_Rate");
 			Parser.ReadQuad("Peak_Bandwidth");
-			Parser.ReadQuad("Latency");
+			uint32_t Latency = Parser.ReadQuad("Latency");
 			Parser.ReadQuad("Delay_Variation");
+			if (Result == 0)
+				printf("QoS on handle %x: latency %dus\n", Handle, Latency);
+			else
+				printf("ERROR: QoS setup failed on handle %x (Error=%x)\n", Handle, Result);
+			break;
+		}
+
+		case HCI_Mode_Change:
+		{
+			uint8_t Result = Parser.ReadByte("Status");
+			uint16_t Handle = Parser.ReadWord("Handle");
+			uint8_t Mode = Parser.ReadByte("Current_Mode");
+			uint16_t Interval = Parser.ReadWord("Interval");
+			if (Result == 0 && Mode != 0) // Not active so reports will be delayed
+				printf("ERROR: Handle %x left active mode (Mode=%d Interval=%d slots)\n", Handle, Mode, Interval);
 			break;
 		}
 
 		case HCI_Command_Complete:
 		{
-			Parser.ReadByte("NumPackets"); // Technically if zero we shouldn't send any more packets
-			Parser.ReadWord("CommandOpCode");
+			HCITransport::SetCommandCredits(Parser.ReadByte("NumPackets"));
+			uint16_t OpCode = Parser.ReadWord("CommandOpCode");
+			if (OpCode == (HCI_Read_BD_ADDR | HCI_Informational) && Parser.ReadByte("Status") == 0)
+			{
+				Parser.ReadData("BD_ADDR", LocalAddress, sizeof(LocalAddress));
+			}
+			else if (OpCode == (HCI_Read_Buffer_Size | HCI_Informational) && Parser.ReadByte("Status") == 0)
+			{
+				Parser.ReadWord("ACL_Data_Packet_Length");
+				Parser.ReadByte("SCO_Data_Packet_Length");
+				HCITransport::SetACLBufferCount(Parser.ReadWord("Total_Num_ACL_Data_Packets"));
+			}
 			Parser.DumpRemaining("Return");
 			break;
 		}
 
 		case HCI_Command_Status:
 		{
-			Parser.ReadByte("Status");
-			Parser.ReadByte("NumPackets");
-			Parser.ReadWord("CommandOpCode");
+			uint8_t Result = Parser.ReadByte("Status");
+			HCITransport::SetCommandCredits(Parser.ReadByte("NumPackets"));
+			uint16_t OpCode = Parser.ReadWord("CommandOpCode");
+			if (Result != 0 && OpCode == (HCI_Create_Connection | HCI_Link_Control) && State == STATE_PAGING)
+			{
+				// Page never started so there won't be a Connection_Complete
+				printf("ERROR: Controller refused to page Wiimote (Error=%x)\n", Result);
+				ACLConnection *Connection = FindConnectionByAddress(PagingAddress);
+				if (Connection)
+					Connection->ClearAddress();
+				PageNext();
+			}
 			break;
 		}
 
@@ -863,8 +1800,8 @@ private:
 			uint8_t NumHandles = Parser.ReadByte("NumHandles");
 			for (uint8_t i = 0; i < NumHandles; i++)
 			{
-				Parser.ReadWord("Handle");
-				Parser.ReadWord("NumPackets");
+				uint16_t Handle = Parser.ReadWord("Handle");
+				HCITransport::CompleteACLPackets(Handle, Parser.ReadWord("NumPackets"));
 			}
 			break;
 		}
@@ -876,7 +1813,7 @@ private:
 		}
 
 		default:
-			printf("ERROR: Unknown Event: %x\n", Code);
+			UnknownEvents.Add(Code);
 			break;
 		}
 		return true;
@@ -884,7 +1821,12 @@ private:
 
 public:
 	HCI()
+		: UnknownHandles("HCIManager Can't find connection with handle")
+		, UnknownEvents("Unknown Event")
 	{
+		memset(HandleTable, 0, sizeof(HandleTable));
+		memset(PagingAddress, 0, sizeof(PagingAddress));
+		memset(LocalAddress, 0, sizeof(LocalAddress));
 		SetState(STATE_STARTUP);
 	}
 
@@ -895,23 +1837,36 @@ public:
 			Reset();
 			SetState(STATE_READY);
 			SetFilter();
+			SetPageTimeout();
+			ReadBufferSize();
+			ReadLocalAddress();
+			EnablePageScan();
+		}
+		else if (State == STATE_READY) // Page remembered Wiimotes then just keep inquirying and trying to find new ones
+		{
+			PageNext();
 		}
-		else if (State == STATE_READY) // Just keep inquirying and trying to find new Wiimotes
+		if (State == STATE_READY)
 		{
-			bool bAnyWantsConnecting = false;
+			uint8_t NumWantAddress = 0;
 			for (int i = 0; i < kMaxACLConnections; i++)
 			{
-				bAnyWantsConnecting |= Connections[i].WantsConnection();
+				NumWantAddress += Connections[i].NeedsAddress() ? 1 : 0;
 			}
-			if (bAnyWantsConnecting)
+			if (NumWantAddress)
 			{
-				Inquire();
+				Inquire(NumWantAddress);
 				SetState(STATE_INQUIRYING);
 			}
 		}
 		while (PumpMessages());
 	}
 
+	ACLConnection* GetConnection(uint16_t Handle, bool bMustExist = true)
+	{
+		return FindConnection(Handle, bMustExist);
+	}
+
 	ACLConnection* AllocateConnection()
 	{
 		for (int i = 0; i < kMaxACLConnections; i++)
@@ -925,11 +1880,20 @@ public:
 		return nullptr;
 	}
 
+	void Disconnect(ACLConnection *Connection)
+	{
+		HCICommand<3> Cmd(HCI_Disconnect | HCI_Link_Control);
+		Cmd.AddWord(Connection->GetHandle());
+		Cmd.AddByte(0x13); // Reason: Remote user terminated connection
+		Cmd.Send();
+	}
+
 	void FreeConnection(ACLConnection *Connection)
 	{
 		if (Connection->IsConnected())
 		{
-			// TODO: Request disconnection
+			Disconnect(Connection);
+			UnregisterConnection(Connection);
 		}
 		Connection->Free();
 	}
@@ -938,6 +1902,11 @@ private:
 	StateEnum State;
 
 	ACLConnection Connections[kMaxACLConnections];
+	ACLConnection *HandleTable[kHandleTableSize];
+	ErrorCounter UnknownHandles;
+	ErrorCounter UnknownEvents;
+	uint8_t PagingAddress[6]; // Waiting on Connection_Complete for this device when STATE_PAGING
+	uint8_t LocalAddress[6]; // Used as the PIN when pairing
 };
 
 HCI HCIManager;
@@ -966,47 +1935,51 @@ protected:
 
 	void SendConnectRequest(uint16_t PSM)
 	{
-		L2CAPRequest Req(L2CAP_CONNECTION_REQUEST, ACL->GetHandle());
+		L2CAPRequest<4> Req(L2CAP_CONNECTION_REQUEST, ACL->GetHandle());
 		Req.AddWord(PSM);
 		Req.AddWord(SCID);
 		Req.Send();
 		SetState(STATE_WAIT_CONNECT);
 	}
 
-	void SendConfigurationRequest(bool bChangeMTU)
+	void SendConfigurationRequest()
 	{
-		L2CAPRequest Req(L2CAP_CONFIGURATION_REQUEST, ACL->GetHandle());
+		L2CAPRequest<8> Req(L2CAP_CONFIGURATION_REQUEST, ACL->GetHandle());
 		Req.AddWord(DCID);
 		Req.AddWord(0); // Flags
-		if (bChangeMTU)
-		{
-			Req.AddByte(1); // Configure MTU (Seems to be what the Wii does from captures)
-			Req.AddByte(2); // Length 2
-			Req.AddWord(185); // 185 bytes
-		}
+		Req.AddByte(1); // Configure MTU (Seems to be what the Wii does from captures)
+		Req.AddByte(2); // Length 2
+		Req.AddWord(185); // 185 bytes
 		Req.Send();
+		bLocalConfigured = false;
 		SetState(STATE_CONFIG);
 	}
 
-	void SendConfigurationResponse(bool bChangeMTU, uint16_t MsgId)
+	void SendConfigurationResponse(uint16_t MsgId)
 	{
-		L2CAPRequest Req(L2CAP_CONFIGURATION_RESPONSE, ACL->GetHandle(), MsgId);
+		L2CAPRequest<6> Req(L2CAP_CONFIGURATION_RESPONSE, ACL->GetHandle(), MsgId);
 		Req.AddWord(DCID);
 		Req.AddWord(0); // Flags
 		Req.AddWord(0); // Result: Success
-		if (bChangeMTU)
-		{
-			Req.AddByte(1); // Configure MTU (Seems to be what the Wii does from captures)
-			Req.AddByte(2); // Length 2
-			Req.AddWord(185); // 185 bytes
-		}
 		Req.Send();
-		SetState(STATE_OPEN);
+		bRemoteConfigured = true;
+		if (bLocalConfigured) // Either side can finish configuring first
+			SetState(STATE_OPEN);
+	}
+
+	void SendConnectionResponse(uint16_t MsgId, uint16_t Result)
+	{
+		L2CAPRequest<8> Req(L2CAP_CONNECTION_RESPONSE, ACL->GetHandle(), MsgId);
+		Req.AddWord(SCID); // Destination CID: Our end
+		Req.AddWord(DCID); // Source CID: Their end
+		Req.AddWord(Result);
+		Req.AddWord(0); // Status: No further information
+		Req.Send();
 	}
 
 	void SendDisconnectRequest()
 	{
-		L2CAPRequest Req(L2CAP_DISCONNECTION_REQUEST, ACL->GetHandle());
+		L2CAPRequest<4> Req(L2CAP_DISCONNECTION_REQUEST, ACL->GetHandle());
 		Req.AddWord(DCID);
 		Req.AddWord(SCID);
 		Req.Send();
@@ -1015,7 +1988,7 @@ protected:
 
 	void SendDisconnectResponse(uint16_t MsgId)
 	{
-		L2CAPRequest Req(L2CAP_DISCONNECTION_RESPONSE, ACL->GetHandle(), MsgId);
+		L2CAPRequest<4> Req(L2CAP_DISCONNECTION_RESPONSE, ACL->GetHandle(), MsgId);
 		Req.AddWord(DCID);
 		Req.AddWord(SCID);
 		Req.Send();
@@ -1049,7 +2022,7 @@ protected:
 		CheckState(STATE_WAIT_CONNECT);
 		DCID = InDCID;
 		if (Result == 0) // Success
-			SendConfigurationRequest(true);
+			SendConfigurationRequest();
 		else if (Result != 1) // !Pending
 			SetState(STATE_CLOSED);
 	}
@@ -1057,14 +2030,20 @@ protected:
 	void ReceiveConfigurationRequest(uint8_t MsgId)
 	{
 		CheckState(STATE_CONFIG, STATE_OPEN);
-		SendConfigurationResponse(false, MsgId); // Just accept whatever is proposed
+		SendConfigurationResponse(MsgId); // Just accept whatever is proposed
 	}
 
 	void ReceiveConfigurationResponse(uint16_t Result)
 	{
 		CheckState(STATE_CONFIG);
 		if (Result != 0) // Our config change was rejected so just disconnect
+		{
 			SendDisconnectRequest();
+			return;
+		}
+		bLocalConfigured = true;
+		if (bRemoteConfigured)
+			SetState(STATE_OPEN);
 	}
 
 	void ReceiveDisconnectionRequest(uint8_t MsgId)
@@ -1098,8 +2077,13 @@ public:
 	L2CAPConnection()
 	{
 		bAllocated = false;
+		bIncoming = false;
+		bClaimed = false;
+		bLocalConfigured = false;
+		bRemoteConfigured = false;
 		DCID = 0;
 		SCID = 0;
+		PSM = 0;
 		ACL = nullptr;
 		Listener = nullptr;
 		State = STATE_CLOSED;
@@ -1120,15 +2104,45 @@ public:
 		return bAllocated && State != STATE_CLOSED && ACL->IsAlive();
 	}
 
-	void Allocate(ACLConnection* InACL, uint16_t PSM, uint16_t InSCID)
+	// Refused or torn down by the other end
+	bool IsClosed()
+	{
+		return State == STATE_CLOSED;
+	}
+
+	void Allocate(ACLConnection* InACL, uint16_t InPSM, uint16_t InSCID)
 	{
 		bAllocated = true;
+		bIncoming = false;
+		bClaimed = true;
+		bLocalConfigured = false;
+		bRemoteConfigured = false;
 		SCID = InSCID;
+		PSM = InPSM;
 		ACL = InACL;
+		ACL->AddChannel(this);
 		CheckState(STATE_CLOSED);
 		SendConnectRequest(PSM);
 	}
 
+	// Channel opened by the other end. Sits unclaimed until whoever owns the ACL picks it up.
+	void Accept(ACLConnection* InACL, uint16_t InPSM, uint16_t InSCID, uint16_t InDCID, uint8_t MsgId)
+	{
+		bAllocated = true;
+		bIncoming = true;
+		bClaimed = false;
+		bLocalConfigured = false;
+		bRemoteConfigured = false;
+		SCID = InSCID;
+		DCID = InDCID;
+		PSM = InPSM;
+		ACL = InACL;
+		ACL->AddChannel(this);
+		CheckState(STATE_CLOSED);
+		SendConnectionResponse(MsgId, L2CAP_RESULT_SUCCESS);
+		SendConfigurationRequest();
+	}
+
 	void SetListener(IL2CAPMessageListener *MessageListener)
 	{
 		Listener = MessageListener;
@@ -1136,12 +2150,16 @@ public:
 
 	void Free()
 	{
-		if (State != STATE_CLOSED)
+		if (State != STATE_CLOSED && ACL->IsConnected())
 		{
 			SendDisconnectRequest();
 		}
+		SetState(STATE_CLOSED); // Not waiting for the response so it can be reused straight away
+		if (bAllocated)
+			ACL->RemoveChannel(this);
 		Listener = nullptr;
 		bAllocated = false;
+		bClaimed = false;
 	}
 
 	uint16_t GetDCID()
@@ -1151,9 +2169,14 @@ public:
 
 protected:
 	bool bAllocated;
+	bool bIncoming;
+	bool bClaimed;
+	bool bLocalConfigured; // They've accepted our configuration
+	bool bRemoteConfigured; // We've accepted theirs
 	StateEnum State;
 	uint16_t DCID;
 	uint16_t SCID;
+	uint16_t PSM;
 	ACLConnection *ACL;
 	IL2CAPMessageListener *Listener;
 
@@ -1165,25 +2188,67 @@ class L2CAP
 private:
 	enum
 	{
-		kMaxNumConnections = 32
+		kMaxNumConnections = 32,
+		kMaxListenPSMs = 4,
+		kFirstIncomingCID = 0x60 // Clear of the CIDs used for outgoing channels
 	};
 
-	L2CAPConnection* FindConnection(uint16_t Handle, uint16_t SCID)
+	// Looks in the handful of channels on the ACL rather than every channel
+	L2CAPConnection* FindConnection(uint16_t Handle, uint16_t SCID, bool bMustExist = true)
 	{
-		for (int i = 0; i < kMaxNumConnections; i++)
+		ACLConnection *ACL = HCIManager.GetConnection(Handle, bMustExist);
+		if (ACL)
 		{
-			if (Connections[i].bAllocated && Connections[i].ACL->GetHandle() == Handle && Connections[i].SCID == SCID)
+			for (int i = 0; i < ACLConnection::kMaxChannels; i++)
 			{
-				return &Connections[i];
+				L2CAPConnection *Connection = ACL->GetChannel(i);
+				if (Connection && Connection->SCID == SCID)
+					return Connection;
 			}
+			if (bMustExist)
+				UnknownChannels.Add((Handle << 16) | SCID);
 		}
-		printf("ERROR: Failed to find SCID: 0x%x with handle 0x%x", SCID, Handle);
 		return nullptr;
 	}
 
+	bool IsListening(uint16_t PSM)
+	{
+		for (int i = 0; i < NumListenPSMs; i++)
+		{
+			if (ListenPSMs[i] == PSM)
+				return true;
+		}
+		return false;
+	}
+
+	void ReceiveConnectionRequest(uint16_t ACLHandle, uint8_t MsgId, uint16_t PSM, uint16_t DCID)
+	{
+		uint16_t Result = L2CAP_RESULT_PSM_NOT_SUPPORTED;
+		ACLConnection *ACL = HCIManager.GetConnection(ACLHandle);
+		if (ACL && IsListening(PSM))
+		{
+			for (int i = 0; i < kMaxNumConnections && ACL->HasFreeChannel(); i++)
+			{
+				if (!Connections[i].bAllocated)
+				{
+					Connections[i].Accept(ACL, PSM, kFirstIncomingCID + i, DCID, MsgId);
+					return;
+				}
+			}
+			printf("ERROR: L2CAPManager No free channels left\n");
+			Result = L2CAP_RESULT_NO_RESOURCES;
+		}
+		L2CAPRequest<8> Req(L2CAP_CONNECTION_RESPONSE, ACLHandle, MsgId);
+		Req.AddWord(0); // Destination CID: None
+		Req.AddWord(DCID);
+		Req.AddWord(Result);
+		Req.AddWord(0); // Status: No further information
+		Req.Send();
+	}
+
 	void SendInformationResponse(uint16_t InfoType, uint16_t MsgId, uint16_t ACLHandle)
 	{
-		L2CAPRequest Req(L2CAP_INFORMATION_RESPONSE, ACLHandle, MsgId);
+		L2CAPRequest<4> Req(L2CAP_INFORMATION_RESPONSE, ACLHandle, MsgId);
 		Req.AddWord(InfoType);
 		Req.AddWord(1); // Not supported (Wii returns it supports bi-directional QoS)
 		Req.Send();
@@ -1192,7 +2257,7 @@ private:
 	bool PumpMessages()
 	{
 		uint8_t Message[128];
-		uint16_t Length = ESPBluetooth::GetACLPacket(Message, sizeof(Message));
+		uint16_t Length = HCITransport::GetACLPacket(Message, sizeof(Message));
 		if (Length == 0)
 			return false;
 		MessageParser Parser(Message, Length); // Supplies debugging helpers
@@ -1209,6 +2274,14 @@ private:
 				break;
 			}
 
+			case L2CAP_CONNECTION_REQUEST:
+			{
+				uint16_t PSM = Parser.ReadWord("PSM");
+				uint16_t DCID = Parser.ReadWord("SourceCID");
+				ReceiveConnectionRequest(Parser.ACLHandle, Parser.L2CAPMsgId, PSM, DCID);
+				break;
+			}
+
 			case L2CAP_CONNECTION_RESPONSE:
 			{
 				uint16_t DCID = Parser.ReadWord("DestCID");
@@ -1260,7 +2333,7 @@ private:
 			{
 				Parser.ReadWord("DestCID");
 				uint16_t SCID = Parser.ReadWord("SrcCID");
-				L2CAPConnection *Connection = FindConnection(Parser.ACLHandle, SCID);
+				L2CAPConnection *Connection = FindConnection(Parser.ACLHandle, SCID, false); // Freed channels don't wait for this
 				if (Connection)
 					Connection->ReceiveDisconnectionResponse();
 				break;
@@ -1274,7 +2347,7 @@ private:
 			}
 
 			default:
-				printf("ERROR: Unknown Packet: %x\n", Parser.L2CAPCode);
+				UnknownPackets.Add(Parser.L2CAPCode);
 				break;
 			}
 		}
@@ -1290,7 +2363,38 @@ private:
 public:
 
 	L2CAP()
+		: UnknownChannels("L2CAPManager Can't find handle/SCID")
+		, UnknownPackets("Unknown Packet")
+	{
+		NumListenPSMs = 0;
+	}
+
+	// Accept channels the other end opens to this PSM
+	void Listen(uint16_t PSM)
+	{
+		if (IsListening(PSM))
+			return;
+		if (NumListenPSMs == kMaxListenPSMs)
+		{
+			printf("ERROR: L2CAPManager Can't listen to any more PSMs\n");
+			return;
+		}
+		ListenPSMs[NumListenPSMs++] = PSM;
+	}
+
+	// Hands over a channel the other end opened on this ACL
+	L2CAPConnection* ClaimIncomingChannel(ACLConnection* ACL, uint16_t PSM)
 	{
+		for (int i = 0; i < kMaxNumConnections; i++)
+		{
+			L2CAPConnection &Connection = Connections[i];
+			if (Connection.bAllocated && Connection.bIncoming && !Connection.bClaimed && Connection.ACL == ACL && Connection.PSM == PSM)
+			{
+				Connection.bClaimed = true;
+				return &Connection;
+			}
+		}
+		return nullptr;
 	}
 
 	void Tick()
@@ -1301,7 +2405,7 @@ public:
 	L2CAPConnection* AllocateChannel(ACLConnection* ACL, uint16_t PSM, uint16_t SCID)
 	{
 		check(ACL->IsConnected());
-		for (int i = 0; i < kMaxNumConnections; i++)
+		for (int i = 0; i < kMaxNumConnections && ACL->HasFreeChannel(); i++)
 		{
 			if (!Connections[i].bAllocated)
 			{
@@ -1320,6 +2424,10 @@ public:
 
 private:
 	L2CAPConnection Connections[kMaxNumConnections];
+	uint16_t ListenPSMs[kMaxListenPSMs];
+	int NumListenPSMs;
+	ErrorCounter UnknownChannels;
+	ErrorCounter UnknownPackets;
 };
 
 L2CAP L2CAPManager;
@@ -1331,6 +2439,21 @@ L2CAP L2CAPManager;
 class WiimoteBluetoothConnection : public IL2CAPMessageListener, public IWiimote
 {
 private:
+	enum
+	{
+		kMaxPendingWrites = 8,
+		kMaxWriteRetries = 3
+	};
+
+	// A register write waiting to be acknowledged. The Wiimote acks writes in order.
+	struct PendingWrite
+	{
+		uint32_t RegisterNum;
+		uint8_t Data[16];
+		uint8_t DataSize;
+		uint8_t Retries;
+	};
+
 	enum
 	{
 		CONTROL_PSM = 0x11,
@@ -1344,24 +2467,38 @@ private:
 		STATE_CLOSED,
 		STATE_WAITING_FOR_ACL,
 		STATE_WAITING_FOR_L2CAP,
-		STATE_SET_SENSITIVITY_1,
-		STATE_SET_SENSITIVITY_2,
-		STATE_SET_IR_MODE,
-		STATE_CAMERA_ENABLE,
-		STATE_SET_REPORT_MODE,
-		STATE_OPEN
+		STATE_CONFIGURING, // Register writes in flight
+		STATE_OPEN,
+		STATE_DISCONNECTING
+	};
+
+	enum MotionPlusStateEnum
+	{
+		MOTIONPLUS_UNKNOWN,
+		MOTIONPLUS_PROBING, // Reading its ID
+		MOTIONPLUS_NONE,
+		MOTIONPLUS_ACTIVE // Told to act as the extension
 	};
 
 public:
 	WiimoteBluetoothConnection()
+		: UnhandledReports("Unhandled report")
 	{
+		IRMode = kWiimoteIRMode_Extended;
+		bWantMotionPlus = false;
+		LostTime = 0;
+		bReconnecting = false;
 		Reset();
 	}
 
-	void Open(uint8_t LEDs)
+	void Open(uint8_t LEDs, const uint8_t *KnownAddress)
 	{
 		check(State == STATE_CLOSED);
 		ACL = HCIManager.AllocateConnection();
+		if (KnownAddress)
+			ACL->SetPreferredAddress(KnownAddress);
+		L2CAPManager.Listen(CONTROL_PSM); // For when the Wiimote connects to us
+		L2CAPManager.Listen(DATA_PSM);
 		StartingLEDs = LEDs;
 		SetState(STATE_WAITING_FOR_ACL);
 	}
@@ -1374,12 +2511,39 @@ public:
 
 	void Tick()
 	{
+		if (State > STATE_WAITING_FOR_ACL && State != STATE_DISCONNECTING && HasLostLink())
+		{
+			BeginReconnect();
+		}
+		else if (State == STATE_WAITING_FOR_ACL && ACL->IsAlive()) // Connected and dropped before the channels came up
+		{
+			BeginReconnect();
+		}
+		else if ((State == STATE_CONFIGURING || State == STATE_OPEN) && NumPendingWrites && Controller::GetTime() - WriteTime > WIIMOTE_WRITE_TIMEOUT)
+		{
+			if (!ResendWrite())
+				BeginReconnect();
+		}
+
 		switch (State)
 		{
 		case STATE_CLOSED:
 			break;
 		case STATE_WAITING_FOR_ACL:
-			if (ACL->IsConnected())
+			if (ACL->IsConnected() && ACL->IsIncoming())
+			{
+				// Wiimote opens control then data itself when it connects to us
+				if (!ControlPipe)
+					ControlPipe = L2CAPManager.ClaimIncomingChannel(ACL, CONTROL_PSM);
+				if (!DataPipe)
+					DataPipe = L2CAPManager.ClaimIncomingChannel(ACL, DATA_PSM);
+				if (ControlPipe && DataPipe)
+				{
+					DataPipe->SetListener(this);
+					SetState(STATE_WAITING_FOR_L2CAP);
+				}
+			}
+			else if (ACL->IsConnected())
 			{
 				ControlPipe = L2CAPManager.AllocateChannel(ACL, CONTROL_PSM, SRC_CONTROL_CID);
 				DataPipe = L2CAPManager.AllocateChannel(ACL, DATA_PSM, SRC_DATA_CID);
@@ -1390,58 +2554,115 @@ public:
 		case STATE_WAITING_FOR_L2CAP:
 			if (ControlPipe->IsConnected() && DataPipe->IsConnected())
 			{
+				// Everything goes out in one go rather than a round trip per write
 				uint8_t CameraEnable = 0x08;
+				uint8_t SensitivityBlock1[] = { 0x02, 0x00, 0x00, 0x71, 0x01, 0x00, 0xAA, 0x00, 0x64 };
+				uint8_t SensitivityBlock2[] = { 0x63, 0x03 };
 				SetPlayerLEDs(StartingLEDs);
+				WriteSingleByteReport(WIIMOTE_REPORT_STATUS_REQUEST, 0x00); // Find out if there's an extension
 				WriteSingleByteReport(WIIMOTE_REPORT_IR_ENABLE_1, 0x04);
 				WriteSingleByteReport(WIIMOTE_REPORT_IR_ENABLE_2, 0x04);
-				WriteToRegister(0xB00030, &CameraEnable, 1);
-				SetState(STATE_SET_SENSITIVITY_1);
-			}
-			break;
-		case STATE_SET_SENSITIVITY_1:
-			if (WriteAck == WriteReq)
-			{
-				uint8_t SensitivityBlock1[] = { 0x02, 0x00, 0x00, 0x71, 0x01, 0x00, 0xAA, 0x00, 0x64 };
-				WriteToRegister(0xB00000, SensitivityBlock1, sizeof(SensitivityBlock1));
-				SetState(STATE_SET_SENSITIVITY_2);
+				QueueWrite(0xB00030, &CameraEnable, 1);
+				QueueWrite(0xB00000, SensitivityBlock1, sizeof(SensitivityBlock1));
+				QueueWrite(0xB0001A, SensitivityBlock2, sizeof(SensitivityBlock2));
+				QueueCameraMode();
+				OpenTime = Controller::GetTime();
+				bAwaitingFirstReport = true;
+				SetState(STATE_CONFIGURING);
 			}
 			break;
-		case STATE_SET_SENSITIVITY_2:
-			if (WriteAck == WriteReq)
+		case STATE_CONFIGURING:
+			if (NumPendingWrites == 0)
 			{
-				uint8_t SensitivityBlock2[] = { 0x63, 0x03 };
-				WriteToRegister(0xB0001A, SensitivityBlock2, sizeof(SensitivityBlock2));
-				SetState(STATE_SET_IR_MODE);
-			}
-			break;
-		case STATE_SET_IR_MODE:
-			if (WriteAck == WriteReq)
-			{
-				uint8_t ExtendedMode = 0x03;
-				WriteToRegister(0xB00033, &ExtendedMode, 1);
-				SetState(STATE_CAMERA_ENABLE);
+				if (bWantMotionPlus && MotionPlusState == MOTIONPLUS_UNKNOWN)
+				{
+					ReadFromRegister(WIIMOTE_MOTIONPLUS_ID, 6);
+					ProbeTime = Controller::GetTime();
+					MotionPlusState = MOTIONPLUS_PROBING;
+				}
+				if (MotionPlusState == MOTIONPLUS_PROBING)
+				{
+					if (Controller::GetTime() - ProbeTime < WIIMOTE_MOTIONPLUS_PROBE_TIMEOUT)
+						break;
+					printf("ERROR: No reply looking for a MotionPlus\n");
+					MotionPlusState = MOTIONPLUS_NONE;
+				}
+				// The status reply beats the write acks so the extension is known by now.
+				// An active MotionPlus is set up already (this init would switch it off).
+				if (Data.bExtension && !bExtensionInitialised && !Data.bMotionPlus)
+				{
+					// Disables the extension's encryption
+					uint8_t InitExtension1 = 0x55;
+					uint8_t InitExtension2 = 0x00;
+					QueueWrite(0xA400F0, &InitExtension1, 1);
+					QueueWrite(0xA400FB, &InitExtension2, 1);
+					bExtensionInitialised = true;
+				}
+				if (CameraIRMode != GetWantedCameraIRMode()) // Extension changed or new mode requested during setup
+				{
+					QueueCameraMode();
+				}
+				if (NumPendingWrites)
+					break;
+				switch (CameraIRMode)
+				{
+				case WIIMOTE_IR_MODE_BASIC: RequestReportMode(WIIMOTE_REPORT_CORE_BUTTONS_ACC_IR10_EXT6); break;
+				case WIIMOTE_IR_MODE_FULL: RequestReportMode(WIIMOTE_REPORT_INTERLEAVED_1); break;
+				default: RequestReportMode(WIIMOTE_REPORT_CORE_BUTTONS_ACC_IR12); break;
+				}
+				SetState(STATE_OPEN);
+				if (bReconnecting)
+				{
+					printf("Wiimote with LEDs %x reconnected after %dms\n", StartingLEDs, (Controller::GetTime() - LostTime) / 1000);
+					bReconnecting = false;
+				}
 			}
 			break;
-		case STATE_CAMERA_ENABLE:
-			if (WriteAck == WriteReq)
-			{
-				uint8_t CameraEnable = 0x08;
-				WriteToRegister(0xB00030, &CameraEnable, 1);
-				SetState(STATE_SET_REPORT_MODE);
-			}
+		case STATE_OPEN:
 			break;
-		case STATE_SET_REPORT_MODE:
-			if (WriteAck == WriteReq)
+		case STATE_DISCONNECTING:
+			if (!ACL->IsConnected())
 			{
-				RequestReportMode(WIIMOTE_REPORT_CORE_BUTTONS_ACC_IR12);
-				SetState(STATE_OPEN);
+				Reopen();
 			}
 			break;
-		case STATE_OPEN:
-			break;
 		}
 	}
 
+	// ACL dropped (supervision timeout, Wiimote switched off) or the Wiimote closed or refused a channel
+	bool HasLostLink()
+	{
+		if (!ACL->IsConnected())
+			return true;
+		return (ControlPipe && ControlPipe->IsClosed()) || (DataPipe && DataPipe->IsClosed());
+	}
+
+	void BeginReconnect()
+	{
+		printf("ERROR: Lost Wiimote with LEDs %x, reconnecting\n", StartingLEDs);
+		LostTime = Controller::GetTime();
+		bReconnecting = true;
+		if (ACL->IsConnected())
+		{
+			// Only the channels went so hang up first, paging a device that's still connected fails
+			HCIManager.Disconnect(ACL);
+			SetState(STATE_DISCONNECTING);
+		}
+		else
+		{
+			Reopen();
+		}
+	}
+
+	// Goes back through the connect path in the same slot so the player keeps their Wiimote
+	void Reopen()
+	{
+		uint8_t Address[6];
+		bool bKnownAddress = ACL->GetKnownAddress(Address);
+		Close();
+		Open(StartingLEDs, bKnownAddress ? Address : nullptr);
+	}
+
 	void Close()
 	{
 		if (ControlPipe)
@@ -1453,7 +2674,7 @@ public:
 		Reset();
 	}
 
-	bool IsConnected()
+	virtual bool IsConnected()
 	{
 		if (ControlPipe && DataPipe)
 		{
@@ -1482,6 +2703,31 @@ public:
 		return &Data;
 	}
 
+	virtual const WiimoteReportStats* GetReportStats()
+	{
+		return ReportMonitor.GetStats();
+	}
+
+	virtual bool GetAddress(uint8_t *Address)
+	{
+		if (!ACL || !ACL->IsConnected())
+			return false;
+		memcpy(Address, ACL->GetAddress(), 6);
+		return true;
+	}
+
+	virtual void SetIRMode(EWiimoteIRMode Mode)
+	{
+		IRMode = Mode;
+		if (State == STATE_OPEN && CameraIRMode != GetWantedCameraIRMode())
+			SetState(STATE_CONFIGURING);
+	}
+
+	virtual void SetMotionPlus(bool bEnable)
+	{
+		bWantMotionPlus = bEnable;
+	}
+
 	virtual void SetPlayerLEDs(uint8_t LEDs)
 	{
 		WriteSingleByteReport(WIIMOTE_REPORT_SET_LEDS, (uint8_t)(LEDs << 4));
@@ -1505,8 +2751,12 @@ public:
 			Data.Buttons = Buttons & ~0x6060; // Remove acceleration lower bits
 			Data.BatteryLevel = BatteryLevel;
 			Data.LEDs = LEDAndFlags >> 4;
-			if (State == STATE_OPEN)
-				State = STATE_SET_REPORT_MODE;
+			Data.bExtension = (LEDAndFlags & WIIMOTE_STATUS_EXTENSION) != 0;
+			Data.bMotionPlus = Data.bExtension && MotionPlusState == MOTIONPLUS_ACTIVE;
+			if (!Data.bExtension)
+				bExtensionInitialised = false;
+			if (State == STATE_OPEN) // Status reports stop the reporting so set it up again (with a new IR mode if the extension changed)
+				SetState(STATE_CONFIGURING);
 			break;
 		}
 		case WIIMOTE_REPORT_READ_MEMORY:
@@ -1514,9 +2764,12 @@ public:
 			uint16_t Buttons = Parser.ReadWord("Buttons");
 			uint8_t SizeAndErrorFlags = Parser.ReadByte("SizeAndErrorFlags");
 			uint8_t MemoryData[16];
-			Parser.ReadWord("MemoryOffset");
+			uint16_t Offset = Parser.ReadByte("MemoryOffsetHigh") << 8;
+			Offset |= Parser.ReadByte("MemoryOffsetLow");
 			Parser.ReadData("MemoryData", MemoryData, (SizeAndErrorFlags >> 4) + 1);
 			Data.Buttons = Buttons & ~0x6060; // Remove acceleration lower bits
+			if (MotionPlusState == MOTIONPLUS_PROBING && Offset == (WIIMOTE_MOTIONPLUS_ID & 0xFFFF))
+				ReceiveMotionPlusID(MemoryData, SizeAndErrorFlags & 0xF);
 			break;
 		}
 		case WIIMOTE_REPORT_ACKNOWLEDGE:
@@ -1526,8 +2779,8 @@ public:
 			uint8_t ErrorCode = Parser.ReadByte("ErrorCode");
 			Data.Buttons = Buttons & ~0x6060; // Remove acceleration lower bits
 			if (ReportAck == WIIMOTE_REPORT_WRITE_MEMORY)
-				WriteAck++;
-			if (ErrorCode != 0)
+				AcknowledgeWrite(ErrorCode);
+			else if (ErrorCode != 0)
 				printf("ERROR: From sent report: %x (Error=%x)\n", ReportAck, ErrorCode);
 			break;
 		}
@@ -1540,31 +2793,77 @@ public:
 		case WIIMOTE_REPORT_CORE_BUTTONS_ACC_IR12:
 		{
 			uint16_t Buttons = Parser.ReadWord("Buttons");
-			uint8_t AccelX = Parser.ReadByte("AccelX");
-			uint8_t AccelY = Parser.ReadByte("AccelY");
-			uint8_t AccelZ = Parser.ReadByte("AccelZ");
-			uint32_t Spot[4];
-			Spot[0] = Parser.ReadTri("Spot0");
-			Spot[1] = Parser.ReadTri("Spot1");
-			Spot[2] = Parser.ReadTri("Spot2");
-			Spot[3] = Parser.ReadTri("Spot3");
-			Data.Buttons = Buttons & ~0x6060; // Remove acceleration lower bits
-			Data.AccelX = (AccelX << 2) + ((Buttons >> 5) & 3);
-			Data.AccelY = (AccelY << 2) + ((Buttons >> 12) & 2);
-			Data.AccelZ = (AccelZ << 2) + ((Buttons >> 13) & 2);
+			ReadAccelerometer(Parser, Buttons);
 			for (int i = 0; i < 4; i++)
 			{
-				Data.IRSpot[0].X = ((Spot[0] >> 0) & 0xFF) + ((Spot[0] >> 12) & 0x300);
-				Data.IRSpot[0].Y = ((Spot[0] >> 8) & 0xFF) + ((Spot[0] >> 14) & 0x300);
-				Data.IRSpot[0].Size = ((Spot[0] >> 16) & 0xF);
-				Data.IRSpot[0].Size |= (Data.IRSpot[0].Size << 4); // Extend to 8-bit
+				ReadExtendedSpot(Data.IRSpot[i], Parser.ReadTri("Spot"));
+			}
+			Data.FrameNumber++;
+			ReportReceived();
+			break;
+		}
+		case WIIMOTE_REPORT_CORE_BUTTONS_ACC_IR10_EXT6:
+		{
+			uint16_t Buttons = Parser.ReadWord("Buttons");
+			ReadAccelerometer(Parser, Buttons);
+			for (int i = 0; i < 4; i += 2)
+			{
+				// Basic mode packs two spots into 5 bytes without sizes
+				uint8_t Pair[5];
+				Parser.ReadData("SpotPair", Pair, sizeof(Pair));
+				memset(&Data.IRSpot[i], 0, sizeof(Data.IRSpot[i]) * 2);
+				Data.IRSpot[i].X = Pair[0] + ((Pair[2] << 4) & 0x300);
+				Data.IRSpot[i].Y = Pair[1] + ((Pair[2] << 2) & 0x300);
+				Data.IRSpot[i + 1].X = Pair[3] + ((Pair[2] << 8) & 0x300);
+				Data.IRSpot[i + 1].Y = Pair[4] + ((Pair[2] << 6) & 0x300);
 			}
+			Parser.ReadData("ExtensionData", Data.ExtensionData, sizeof(Data.ExtensionData));
+			if (Data.bMotionPlus && (Data.ExtensionData[5] & 0x02)) // Bit 1 marks MotionPlus data (rather than passthrough)
+				ReadMotionPlus(Data.ExtensionData);
 			Data.FrameNumber++;
+			ReportReceived();
+			break;
+		}
+		case WIIMOTE_REPORT_INTERLEAVED_1:
+		case WIIMOTE_REPORT_INTERLEAVED_2:
+		{
+			// Accelerometer is split between the pair with Z spread over the unused button bits
+			bool bSecond = (ReportCode == WIIMOTE_REPORT_INTERLEAVED_2);
+			uint16_t Buttons = Parser.ReadWord("Buttons");
+			uint8_t Accel = Parser.ReadByte(bSecond ? "AccelY" : "AccelX");
+			uint8_t ZBits = ((Buttons >> 5) & 3) | ((Buttons >> 11) & 0xC);
+			Data.Buttons = Buttons & ~0x6060; // Remove acceleration bits
+			if (bSecond)
+			{
+				Data.AccelY = Accel << 2;
+				Data.AccelZ = (InterleavedAccelZ | ZBits) << 2;
+			}
+			else
+			{
+				Data.AccelX = Accel << 2;
+				InterleavedAccelZ = ZBits << 4;
+			}
+			for (int i = 0; i < 2; i++)
+			{
+				WiimoteData::Spot &Spot = Data.IRSpot[bSecond ? i + 2 : i];
+				ReadExtendedSpot(Spot, Parser.ReadTri("Spot"));
+				Spot.MinX = Parser.ReadByte("MinX") & 0x7F;
+				Spot.MinY = Parser.ReadByte("MinY") & 0x7F;
+				Spot.MaxX = Parser.ReadByte("MaxX") & 0x7F;
+				Spot.MaxY = Parser.ReadByte("MaxY") & 0x7F;
+				Parser.ReadByte("Reserved");
+				Spot.Intensity = Parser.ReadByte("Intensity");
+			}
+			if (bSecond) // All four spots are in now so count the pair as one report like the other modes
+			{
+				Data.FrameNumber++;
+				ReportReceived();
+			}
 			break;
 		}
 		default:
 		{
-			printf("ERROR: Unhandled report: %x\n", ReportCode);
+			UnhandledReports.Add(ReportCode);
 			Parser.DumpRemaining("UnkownReportCode");
 			break;
 		}
@@ -1578,34 +2877,188 @@ protected:
 		ControlPipe = nullptr;
 		DataPipe = nullptr;
 		memset(&Data, 0, sizeof(Data));
-		WriteReq = 0;
-		WriteAck = 0;
+		ReportMonitor.Reset();
+		InterleavedAccelZ = 0;
+		CameraIRMode = 0;
+		bExtensionInitialised = false;
+		MotionPlusState = MOTIONPLUS_UNKNOWN;
+		ProbeTime = 0;
+		NumPendingWrites = 0;
+		FirstPendingWrite = 0;
+		WriteTime = 0;
+		OpenTime = 0;
+		bAwaitingFirstReport = false;
 		State = STATE_CLOSED;
 	}
 
+	void ReportReceived()
+	{
+		uint32_t Time = Controller::GetTime();
+		Data.ReportTime = Time;
+		ReportMonitor.Report(Time);
+		if (bAwaitingFirstReport)
+		{
+			printf("Wiimote with LEDs %x: first IR report %dms after L2CAP open\n", StartingLEDs, (Time - OpenTime) / 1000);
+			bAwaitingFirstReport = false;
+		}
+	}
+
+	void QueueCameraMode()
+	{
+		uint8_t CameraEnable = 0x08;
+		CameraIRMode = GetWantedCameraIRMode();
+		QueueWrite(0xB00033, &CameraIRMode, 1);
+		QueueWrite(0xB00030, &CameraEnable, 1);
+	}
+
+	// Sends straight away and keeps a copy until it's acknowledged
+	void QueueWrite(uint32_t RegisterNum, const uint8_t *WriteData, uint8_t DataSize)
+	{
+		if (NumPendingWrites == kMaxPendingWrites || DataSize > sizeof(PendingWrites[0].Data))
+		{
+			printf("ERROR: Can't queue write to %x\n", RegisterNum);
+			return;
+		}
+		PendingWrite &Write = PendingWrites[(FirstPendingWrite + NumPendingWrites) % kMaxPendingWrites];
+		Write.RegisterNum = RegisterNum;
+		memcpy(Write.Data, WriteData, DataSize);
+		Write.DataSize = DataSize;
+		Write.Retries = 0;
+		if (NumPendingWrites == 0)
+			WriteTime = Controller::GetTime();
+		NumPendingWrites++;
+		WriteToRegister(RegisterNum, Write.Data, DataSize);
+	}
+
+	// The oldest write was never acknowledged (lost, or never sent when the controller was out of buffers).
+	// Returns false once it's used up its retries.
+	bool ResendWrite()
+	{
+		PendingWrite &Write = PendingWrites[FirstPendingWrite];
+		if (Write.Retries == kMaxWriteRetries)
+		{
+			printf("ERROR: Gave up writing to %x (no acknowledge)\n", Write.RegisterNum);
+			return false;
+		}
+		printf("ERROR: Write to %x not acknowledged, retrying\n", Write.RegisterNum);
+		Write.Retries++;
+		WriteTime = Controller::GetTime();
+		WriteToRegister(Write.RegisterNum, Write.Data, Write.DataSize);
+		return true;
+	}
+
+	void AcknowledgeWrite(uint8_t ErrorCode)
+	{
+		if (NumPendingWrites == 0)
+		{
+			printf("ERROR: Unexpected write acknowledge (Error=%x)\n", ErrorCode);
+			return;
+		}
+		PendingWrite Write = PendingWrites[FirstPendingWrite];
+		FirstPendingWrite = (FirstPendingWrite + 1) % kMaxPendingWrites;
+		NumPendingWrites--;
+		WriteTime = Controller::GetTime(); // Next one's acknowledge should follow on shortly
+		if (ErrorCode == 0)
+			return;
+		if (Write.Retries == kMaxWriteRetries)
+		{
+			printf("ERROR: Gave up writing to %x (Error=%x)\n", Write.RegisterNum, ErrorCode);
+			return;
+		}
+		// Goes to the back as the rest of the batch is already on its way
+		printf("ERROR: Write to %x failed, retrying (Error=%x)\n", Write.RegisterNum, ErrorCode);
+		uint8_t Retries = Write.Retries + 1;
+		QueueWrite(Write.RegisterNum, Write.Data, Write.DataSize);
+		PendingWrites[(FirstPendingWrite + NumPendingWrites - 1) % kMaxPendingWrites].Retries = Retries;
+	}
+
+	void ReceiveMotionPlusID(const uint8_t *ID, uint8_t ErrorCode)
+	{
+		// Error 7 is the usual answer from a Wiimote without one
+		if (ErrorCode != 0 || ID[2] != 0xA6 || ID[3] != 0x20 || ID[5] != 0x05)
+		{
+			MotionPlusState = MOTIONPLUS_NONE;
+			return;
+		}
+		// It then reports itself as an extension plugged in which sets everything else up
+		uint8_t Init = 0x55;
+		uint8_t Mode = 0x04;
+		QueueWrite(WIIMOTE_MOTIONPLUS_INIT, &Init, 1);
+		QueueWrite(WIIMOTE_MOTIONPLUS_MODE, &Mode, 1);
+		MotionPlusState = MOTIONPLUS_ACTIVE;
+		printf("Wiimote with LEDs %x: MotionPlus found\n", StartingLEDs);
+	}
+
+	// Rates are 14 bits around 8192. Fast mode (slow bit clear) covers about 4.5x the range.
+	void ReadMotionPlus(const uint8_t *Ext)
+	{
+		int32_t Yaw = (Ext[0] | ((Ext[3] & 0xFC) << 6)) - WIIMOTE_MOTIONPLUS_ZERO;
+		int32_t Roll = (Ext[1] | ((Ext[4] & 0xFC) << 6)) - WIIMOTE_MOTIONPLUS_ZERO;
+		int32_t Pitch = (Ext[2] | ((Ext[5] & 0xFC) << 6)) - WIIMOTE_MOTIONPLUS_ZERO;
+		Data.GyroYaw = (Ext[3] & 0x02) ? Yaw : Yaw * 50 / 11;
+		Data.GyroRoll = (Ext[4] & 0x02) ? Roll : Roll * 50 / 11;
+		Data.GyroPitch = (Ext[3] & 0x01) ? Pitch : Pitch * 50 / 11;
+	}
+
+	void ReadAccelerometer(MessageParser &Parser, uint16_t Buttons)
+	{
+		uint8_t AccelX = Parser.ReadByte("AccelX");
+		uint8_t AccelY = Parser.ReadByte("AccelY");
+		uint8_t AccelZ = Parser.ReadByte("AccelZ");
+		Data.Buttons = Buttons & ~0x6060; // Remove acceleration lower bits
+		Data.AccelX = (AccelX << 2) + ((Buttons >> 5) & 3);
+		Data.AccelY = (AccelY << 2) + ((Buttons >> 12) & 2);
+		Data.AccelZ = (AccelZ << 2) + ((Buttons >> 13) & 2);
+	}
+
+	void ReadExtendedSpot(WiimoteData::Spot &Spot, uint32_t Packed)
+	{
+		memset(&Spot, 0, sizeof(Spot));
+		Spot.X = ((Packed >> 0) & 0xFF) + ((Packed >> 12) & 0x300);
+		Spot.Y = ((Packed >> 8) & 0xFF) + ((Packed >> 14) & 0x300);
+		Spot.Size = ((Packed >> 16) & 0xF);
+		Spot.Size |= (Spot.Size << 4); // Extend to 8-bit
+	}
+
+	uint8_t GetWantedCameraIRMode()
+	{
+		if (Data.bExtension) // Only basic IR leaves room for extension data
+			return WIIMOTE_IR_MODE_BASIC;
+		return (IRMode == kWiimoteIRMode_Full) ? WIIMOTE_IR_MODE_FULL : WIIMOTE_IR_MODE_EXTENDED;
+	}
+
 	void WriteSingleByteReport(uint8_t ReportNum, uint8_t Data)
 	{
-		WiimoteMessage Msg(ReportNum, DataPipe->GetDCID(), ACL->GetHandle());
+		WiimoteMessage<1> Msg(ReportNum, DataPipe->GetDCID(), ACL->GetHandle());
 		Msg.AddByte(Data);
 		Msg.Send();
 	}
 
 	void RequestReportMode(uint8_t ReportMode)
 	{
-		WiimoteMessage Msg(WIIMOTE_REPORT_REQUEST_REPORT, DataPipe->GetDCID(), ACL->GetHandle());
-		Msg.AddByte(0x00); // Non-continuous
+		WiimoteMessage<2> Msg(WIIMOTE_REPORT_REQUEST_REPORT, DataPipe->GetDCID(), ACL->GetHandle());
+		Msg.AddByte(WIIMOTE_REPORTING_CONTINUOUS); // Report even if nothing has changed
 		Msg.AddByte(ReportMode);
 		Msg.Send();
 	}
 
-	void WriteToRegister(uint32_t RegisterNum, uint8_t *Data, uint8_t DataSize)
+	void ReadFromRegister(uint32_t RegisterNum, uint16_t Size)
+	{
+		WiimoteMessage<6> Msg(WIIMOTE_REPORT_READ_MEMORY_REQUEST, DataPipe->GetDCID(), ACL->GetHandle());
+		Msg.AddByte(0x04); // Control registers
+		Msg.AddTriBigEndian(RegisterNum); // Offset
+		Msg.AddWordBigEndian(Size);
+		Msg.Send();
+	}
+
+	void WriteToRegister(uint32_t RegisterNum, const uint8_t *Data, uint8_t DataSize)
 	{
 		if (DataSize > 16)
 		{
 			printf("ERROR: Incorrect size for write %d\n", DataSize);
 			return;
 		}
-		WiimoteMessage Msg(WIIMOTE_REPORT_WRITE_MEMORY, DataPipe->GetDCID(), ACL->GetHandle());
+		WiimoteMessage<21> Msg(WIIMOTE_REPORT_WRITE_MEMORY, DataPipe->GetDCID(), ACL->GetHandle());
 		Msg.AddByte(0x04); // Control registers
 		Msg.AddTriBigEndian(RegisterNum); // Offset
 		Msg.AddByte(DataSize); // Size
@@ -1615,18 +3068,32 @@ protected:
 			Msg.AddByte(0x00); // Padding
 		}
 		Msg.Send();
-		WriteReq++;
 	}
 
 protected:
 	StateEnum State;
 	WiimoteData Data;
+	ReportIntervalMonitor ReportMonitor;
 	ACLConnection* ACL;
 	L2CAPConnection* ControlPipe;
 	L2CAPConnection* DataPipe;
-	uint32_t WriteReq;
-	uint32_t WriteAck;
+	PendingWrite PendingWrites[kMaxPendingWrites];
+	int FirstPendingWrite;
+	int NumPendingWrites;
+	uint32_t WriteTime; // When the oldest pending write went out or the last acknowledge came in
+	uint32_t OpenTime; // When L2CAP opened, for timing how long until the first IR report
+	bool bAwaitingFirstReport;
 	uint8_t StartingLEDs;
+	EWiimoteIRMode IRMode;
+	uint8_t CameraIRMode; // What the camera was last set to
+	uint8_t InterleavedAccelZ; // Top half of Z from the first interleaved report
+	bool bExtensionInitialised;
+	bool bWantMotionPlus;
+	MotionPlusStateEnum MotionPlusState;
+	uint32_t ProbeTime; // When the MotionPlus ID read went out
+	uint32_t LostTime; // When the link dropped, for timing reconnects
+	bool bReconnecting;
+	ErrorCounter UnhandledReports;
 };
 
 /////////////////////////////////////////////////////////////////////////////////////////////
@@ -1637,24 +3104,24 @@ WiimoteManager::WiimoteManager()
 {
 }
 
-void WiimoteManager::Init()
+void WiimoteManager::Init(void (*WakeCallback)())
 {
-	ESPBluetooth::InitBluetooth();
+	HCITransport::InitBluetooth(WakeCallback);
 }
 
 void WiimoteManager::DeInit()
 {
-	ESPBluetooth::DeInitBluetooth();
+	HCITransport::DeInitBluetooth();
 }
 
-IWiimote* WiimoteManager::CreateNewWiimote()
+IWiimote* WiimoteManager::CreateNewWiimote(const uint8_t *KnownAddress)
 {
 	for (int i = 0; i < kMaxWiimotes; i++)
 	{
 		if (!Wiimotes[i])
 		{
 			Wiimotes[i] = new WiimoteBluetoothConnection();
-			Wiimotes[i]->Open(1<<i);
+			Wiimotes[i]->Open(1<<i, KnownAddress);
 			return Wiimotes[i];
 		}
 	}
@@ -1663,7 +3130,9 @@ IWiimote* WiimoteManager::CreateNewWiimote()
 
 void WiimoteManager::Tick()
 {
+	HCITransport::FlushPackets(); // Anything the controller couldn't take last time
 	HCIManager.Tick();
+	HCITransport::FlushPackets(); // Credits returned by events
 	L2CAPManager.Tick();
 
 	for (int i = 0; i < kMaxWiimotes; i++)
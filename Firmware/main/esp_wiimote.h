@@ -18,6 +18,12 @@
 
 class WiimoteBluetoothConnection;
 
+enum EWiimoteIRMode
+{
+	kWiimoteIRMode_Extended, // Position and size of each spot in one report (0x33)
+	kWiimoteIRMode_Full // Adds bounding box and intensity but split over two reports (0x3E/0x3F)
+};
+
 struct WiimoteData
 {
 	enum
@@ -39,7 +45,12 @@ struct WiimoteData
 	{
 		uint16_t X;
 		uint16_t Y;
-		uint8_t Size;
+		uint8_t Size; // 0 if not reported (basic IR mode)
+		uint8_t Intensity; // Only reported in full IR mode, 0 otherwise
+		uint8_t MinX; // Bounding box in 7 bits, only reported in full IR mode
+		uint8_t MinY;
+		uint8_t MaxX;
+		uint8_t MaxY;
 	};
 
 	uint16_t Buttons;
@@ -50,6 +61,23 @@ struct WiimoteData
 	int32_t AccelZ : 10;
 	int32_t FrameNumber;
 	Spot IRSpot[4];
+	bool bExtension; // Extension plugged in so using basic IR mode (0x37)
+	bool bMotionPlus; // The extension is an active MotionPlus so the gyro rates are valid
+	uint8_t ExtensionData[6];
+	int32_t GyroYaw; // MotionPlus rates in 1/20ths of a degree per second, bias not removed
+	int32_t GyroRoll;
+	int32_t GyroPitch;
+	uint32_t ReportTime; // When the last IR report arrived (microseconds)
+};
+
+struct WiimoteReportStats
+{
+	uint32_t NumReports; // Since connecting
+	uint32_t NumDropped; // Estimated from gaps between continuous reports
+	uint32_t MeanInterval; // Over the last second in microseconds
+	uint32_t Jitter; // Standard deviation of the interval over the last second in microseconds
+	uint32_t MaxInterval; // Longest gap over the last second in microseconds
+	uint32_t NumWindows; // Incremented each time the interval figures update
 };
 
 class IWiimote
@@ -57,6 +85,11 @@ class IWiimote
 public:
 	virtual void SetPlayerLEDs(uint8_t LEDs) = 0;
 	virtual WiimoteData *GetData() = 0;
+	virtual bool IsConnected() = 0;
+	virtual const WiimoteReportStats* GetReportStats() = 0;
+	virtual void SetIRMode(EWiimoteIRMode Mode) = 0; // Ignored while an extension is plugged in
+	virtual bool GetAddress(uint8_t *Address) = 0; // BD_ADDR (6 bytes, as sent over HCI) once connected
+	virtual void SetMotionPlus(bool bEnable) = 0; // Looks for a MotionPlus when connecting and uses it in place of any other extension
 };
 
 class WiimoteManager
@@ -70,11 +103,14 @@ private:
 public:
 	WiimoteManager();
 
-	void Init();
+	// WakeCallback (optional) is called from the Bluetooth controller's task whenever a packet arrives or it can
+	// take more data, so whoever calls Tick() can sleep until then rather than polling
+	void Init(void (*WakeCallback)() = nullptr);
 	void DeInit();
 	void Tick();
 
-	IWiimote* CreateNewWiimote();
+	// KnownAddress (optional) is paged straight away rather than waiting for an inquiry to find a Wiimote
+	IWiimote* CreateNewWiimote(const uint8_t *KnownAddress = nullptr);
 
 private:
 	WiimoteBluetoothConnection* Wiimotes[kMaxWiimotes];
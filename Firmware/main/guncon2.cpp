@@ -0,0 +1,80 @@
+// (c) Charlie Cole 2017
+//
+// This is licensed under
+// - Creative Commons Attribution-NonCommercial 3.0 Unported
+// - https://creativecommons.org/licenses/by-nc/3.0/
+// - Or see LICENSE.txt
+//
+// The short of it is...
+//   You are free to:
+//     Share — copy and redistribute the material in any medium or format
+//     Adapt — remix, transform, and build upon the material
+//   Under the following terms:
+//     NonCommercial — You may not use the material for commercial purposes.
+//     Attribution — You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+
+#ifdef ESP_PLATFORM
+#include "esp_attr.h"
+#else
+#define IRAM_ATTR
+#endif
+#include "video_timing.h"
+#include "guncon2.h"
+
+// All called by the spot generator so have to run from IRAM
+
+void IRAM_ATTR GunCon2MeasureSync(GunCon2LineTiming &Timing, uint32_t SyncWidth, uint32_t Interval, bool bFieldStart)
+{
+	if (bFieldStart)
+	{
+		if (Timing.NumLineIntervals != 0)
+			Timing.LinePeriod = Timing.LineIntervalSum / Timing.NumLineIntervals;
+		// Interlaced fields alternate between ending half way along a line and starting half way along one
+		Timing.bLowerField = (Timing.LastLineInterval < (Timing.LinePeriod * 3) / 4);
+		Timing.LineIntervalSum = 0;
+		Timing.NumLineIntervals = 0;
+	}
+
+	if (SyncWidth > TIMING_NORMAL_SYNC_THRESHOLD && SyncWidth < TIMING_VSYNC_THRESHOLD) // Time from a normal sync to this one
+	{
+		Timing.LastLineInterval = Interval;
+		if (Interval > TIMING_MIN_LINE_PERIOD && Interval < TIMING_MAX_LINE_PERIOD)
+		{
+			Timing.LineIntervalSum += Interval;
+			Timing.NumLineIntervals++;
+		}
+	}
+}
+
+void IRAM_ATTR GunCon2Position(int AimLine, int AimTime, bool bLowerField, int XOffset, int YOffset, uint16_t &X, uint16_t &Y)
+{
+	if (AimLine == GUNCON2_NO_AIM)
+	{
+		X = Y = 0xFFFF;
+		return;
+	}
+
+	// Nearest line to the aim (the earlier one when it's half way as the beam gets there first), with the lower
+	// field's lines half way between the upper field's
+	int Line = AimLine + GUNCON2_LINE_SCALE / 2 - 1;
+	if (bLowerField)
+		Line -= GUNCON2_LINE_SCALE / 2;
+	Line = Line / GUNCON2_LINE_SCALE + YOffset;
+
+	// The gun's counter is what it's got to when the beam gets there
+	int Count = ((AimTime + XOffset) * 12) / 80;
+	X = (uint16_t)(Count < 0 ? 0 : Count);
+	Y = (uint16_t)(Line < 0 ? 0 : Line);
+}
+
+void IRAM_ATTR EncodeGunCon2Frame(uint8_t *Frame, uint16_t X, uint16_t Y, uint16_t Buttons)
+{
+	Frame[0] = 0x80;
+	Frame[1] = 0xCC; // GunCon 2 identifier
+	Frame[2] = (X >> 7) & 0x7F;
+	Frame[3] = (X & 0x7F);
+	Frame[4] = (Y >> 7) & 0x7F;
+	Frame[5] = (Y & 0x7F);
+	Frame[6] = (Buttons >> 7) & 0x7F;
+	Frame[7] = (Buttons & 0x7F);
+}
@@ -0,0 +1,60 @@
+// (c) Charlie Cole 2017
+//
+// This is licensed under
+// - Creative Commons Attribution-NonCommercial 3.0 Unported
+// - https://creativecommons.org/licenses/by-nc/3.0/
+// - Or see LICENSE.txt
+//
+// The short of it is...
+//   You are free to:
+//     Share — copy and redistribute the material in any medium or format
+//     Adapt — remix, transform, and build upon the material
+//   Under the following terms:
+//     NonCommercial — You may not use the material for commercial purposes.
+//     Attribution — You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+
+#ifndef __GUNCON2_H__
+#define __GUNCON2_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Works out what a GunCon 2 watching the same video would report and packs it into the 8 byte frames the
+// GunCon 2 cable expects. The gun counts a 12MHz clock from the start of horizontal sync and the lines since
+// vertical sync until the beam reaches where it's pointing.
+//
+// The aim comes from where the spot generator would draw it: AimLine is field lines after vertical sync in
+// 256ths (GUNCON2_LINE_SCALE) and AimTime is 80ths of a microsecond after the start of horizontal sync.
+// In 480i every other field is drawn half a line lower, so which line the beam crosses the aim on depends on
+// the field (bLowerField, as measured by the spot generator). 240p never sets it.
+// XOffset (80ths of a microsecond) and YOffset (lines) make up the difference between where the spot
+// generator counts from and where the gun does. GUNCON2_X_OFFSET and GUNCON2_Y_OFFSET get close and the
+// cable's DELAY and LINE DELAY settings add to them.
+
+#define GUNCON2_LINE_SCALE 256
+#define GUNCON2_FRAME_SIZE 8
+#define GUNCON2_NO_AIM -1		// AimLine when there's nothing to point at (X and Y come back as 0xFFFF)
+#define GUNCON2_X_OFFSET (40*8)	// Spot generator's sync to the GunCon 2's (80ths of a microsecond)
+#define GUNCON2_Y_OFFSET (-8)	// Lines
+
+// Line period and field parity as the spot generator measures them from the syncs
+struct GunCon2LineTiming
+{
+	uint32_t LinePeriod;		// Average over the last field (80ths of a microsecond)
+	bool bLowerField;			// Interlaced video and the field that's just started is drawn half a line lower
+	uint32_t LineIntervalSum;	// Whole lines so far this field
+	uint32_t NumLineIntervals;
+	uint32_t LastLineInterval;	// After the last normal sync, half a line if the field ended half way along one
+};
+
+// Call at the start of every sync with the width of the previous one and the time since it started (both 80ths
+// of a microsecond). bFieldStart when it's the vertical sync that starts a new field, which is when LinePeriod
+// and bLowerField are updated.
+void GunCon2MeasureSync(GunCon2LineTiming &Timing, uint32_t SyncWidth, uint32_t Interval, bool bFieldStart);
+
+void GunCon2Position(int AimLine, int AimTime, bool bLowerField, int XOffset, int YOffset, uint16_t &X, uint16_t &Y);
+
+// Fills Frame (GUNCON2_FRAME_SIZE bytes)
+void EncodeGunCon2Frame(uint8_t *Frame, uint16_t X, uint16_t Y, uint16_t Buttons);
+
+#endif // __GUNCON2_H__
@@ -0,0 +1,230 @@
+// (c) Charlie Cole 2017
+//
+// This is licensed under
+// - Creative Commons Attribution-NonCommercial 3.0 Unported
+// - https://creativecommons.org/licenses/by-nc/3.0/
+// - Or see LICENSE.txt
+//
+// The short of it is...
+//   You are free to:
+//     Share — copy and redistribute the material in any medium or format
+//     Adapt — remix, transform, and build upon the material
+//   Under the following terms:
+//     NonCommercial — You may not use the material for commercial purposes.
+//     Attribution — You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+
+
+#include <math.h>
+#include "homography.h"
+
+#define FIXED_INPUT_SHIFT 4			// Camera positions in 1/16ths of a pixel
+#define FIXED_OUTPUT_SHIFT 16		// Screen positions in 1/65536ths
+#define FIXED_MAX_COEFFICIENT (1 << 26) // Leaves room for 16 bit inputs, three terms and the output shift in 64 bits
+#define FIT_CENTRE_X 512.0				// Camera positions are centred and scaled to about -1 to 1 before fitting
+#define FIT_CENTRE_Y 384.0
+#define FIT_SCALE (1.0 / 512.0)
+
+// Inverse of a 3x3 (adjugate, scaled so the bottom right is 1). False if there isn't one that can be scaled that way.
+static bool Invert(const float *M, float *Result)
+{
+	float Inverse[9] =
+	{
+		M[4]*M[8] - M[5]*M[7], M[2]*M[7] - M[1]*M[8], M[1]*M[5] - M[2]*M[4],
+		M[5]*M[6] - M[3]*M[8], M[0]*M[8] - M[2]*M[6], M[2]*M[3] - M[0]*M[5],
+		M[3]*M[7] - M[4]*M[6], M[1]*M[6] - M[0]*M[7], M[0]*M[4] - M[1]*M[3]
+	};
+	if (fabsf(Inverse[8]) < 1e-6f) // Corners in a line or the camera origin is on the horizon
+		return false;
+	for (int i = 0; i < 9; i++)
+		Result[i] = Inverse[i] / Inverse[8];
+	return true;
+}
+
+// Gaussian elimination with partial pivoting. Matrix is row major and gets destroyed.
+static bool Solve(double *Matrix, double *Vector, int Size)
+{
+	for (int Column = 0; Column < Size; Column++)
+	{
+		int Pivot = Column;
+		for (int Row = Column + 1; Row < Size; Row++)
+		{
+			if (fabs(Matrix[Row*Size + Column]) > fabs(Matrix[Pivot*Size + Column]))
+				Pivot = Row;
+		}
+		if (fabs(Matrix[Pivot*Size + Column]) < 1e-12)
+			return false;
+		if (Pivot != Column)
+		{
+			for (int i = 0; i < Size; i++)
+			{
+				double Swap = Matrix[Column*Size + i];
+				Matrix[Column*Size + i] = Matrix[Pivot*Size + i];
+				Matrix[Pivot*Size + i] = Swap;
+			}
+			double Swap = Vector[Column];
+			Vector[Column] = Vector[Pivot];
+			Vector[Pivot] = Swap;
+		}
+		for (int Row = Column + 1; Row < Size; Row++)
+		{
+			double Factor = Matrix[Row*Size + Column] / Matrix[Column*Size + Column];
+			for (int i = Column; i < Size; i++)
+				Matrix[Row*Size + i] -= Factor * Matrix[Column*Size + i];
+			Vector[Row] -= Factor * Vector[Column];
+		}
+	}
+	for (int Row = Size - 1; Row >= 0; Row--)
+	{
+		double Sum = Vector[Row];
+		for (int i = Row + 1; i < Size; i++)
+			Sum -= Matrix[Row*Size + i] * Vector[i];
+		Vector[Row] = Sum / Matrix[Row*Size + Row];
+	}
+	return true;
+}
+
+Homography::Homography()
+{
+	for (int i = 0; i < 9; i++)
+	{
+		ToScreen[i] = ToCamera[i] = (i % 4 == 0) ? 1.0f : 0.0f;
+		ToScreenFixed[i] = 0;
+	}
+	bValid = false;
+}
+
+bool Homography::Calibrate(const float *CornerX, const float *CornerY)
+{
+	bValid = false;
+
+	// Unit square to the quad (Heckbert's closed form) going round the corners in order
+	float X0 = CornerX[0], Y0 = CornerY[0];
+	float X1 = CornerX[1], Y1 = CornerY[1];
+	float X2 = CornerX[3], Y2 = CornerY[3];
+	float X3 = CornerX[2], Y3 = CornerY[2];
+	float DX1 = X1 - X2, DY1 = Y1 - Y2;
+	float DX2 = X3 - X2, DY2 = Y3 - Y2;
+	float DX3 = X0 - X1 + X2 - X3, DY3 = Y0 - Y1 + Y2 - Y3;
+	float G = 0.0f, H = 0.0f;
+	if (DX3 != 0.0f || DY3 != 0.0f)
+	{
+		float Det = DX1*DY2 - DX2*DY1;
+		if (Det == 0.0f)
+			return false;
+		G = (DX3*DY2 - DX2*DY3) / Det;
+		H = (DX1*DY3 - DX3*DY1) / Det;
+	}
+	float M[9] =
+	{
+		X1 - X0 + G*X1, X3 - X0 + H*X3, X0,
+		Y1 - Y0 + G*Y1, Y3 - Y0 + H*Y3, Y0,
+		G, H, 1.0f
+	};
+
+	// Camera to screen is the inverse
+	float Inverse[9];
+	if (!Invert(M, Inverse))
+		return false;
+	for (int i = 0; i < 9; i++)
+		ToCamera[i] = M[i];
+	SetToScreen(Inverse);
+	return true;
+}
+
+bool Homography::Fit(const float *CameraX, const float *CameraY, const float *ScreenU, const float *ScreenV, int NumPoints)
+{
+	bValid = false;
+	if (NumPoints < 4)
+		return false;
+
+	// Each point gives two equations linear in the first eight terms once multiplied through by the divisor:
+	// U = H0*X + H1*Y + H2 - H6*X*U - H7*Y*U and likewise for V. Summed up as the normal equations.
+	double Normal[8*8] = {};
+	double Right[8] = {};
+	for (int i = 0; i < NumPoints; i++)
+	{
+		double X = ((double)CameraX[i] - FIT_CENTRE_X) * FIT_SCALE;
+		double Y = ((double)CameraY[i] - FIT_CENTRE_Y) * FIT_SCALE;
+		double U = ScreenU[i];
+		double V = ScreenV[i];
+		double RowU[8] = { X, Y, 1.0, 0.0, 0.0, 0.0, -X*U, -Y*U };
+		double RowV[8] = { 0.0, 0.0, 0.0, X, Y, 1.0, -X*V, -Y*V };
+		for (int Row = 0; Row < 8; Row++)
+		{
+			for (int Column = 0; Column < 8; Column++)
+				Normal[Row*8 + Column] += RowU[Row]*RowU[Column] + RowV[Row]*RowV[Column];
+			Right[Row] += RowU[Row]*U + RowV[Row]*V;
+		}
+	}
+	if (!Solve(Normal, Right, 8))
+		return false;
+
+	// Fold the centring and scaling back in so it takes raw camera positions
+	double Scaled[9] =
+	{
+		Right[0]*FIT_SCALE, Right[1]*FIT_SCALE, Right[2] - (Right[0]*FIT_CENTRE_X + Right[1]*FIT_CENTRE_Y)*FIT_SCALE,
+		Right[3]*FIT_SCALE, Right[4]*FIT_SCALE, Right[5] - (Right[3]*FIT_CENTRE_X + Right[4]*FIT_CENTRE_Y)*FIT_SCALE,
+		Right[6]*FIT_SCALE, Right[7]*FIT_SCALE, 1.0 - (Right[6]*FIT_CENTRE_X + Right[7]*FIT_CENTRE_Y)*FIT_SCALE
+	};
+	if (fabs(Scaled[8]) < 1e-9)
+		return false;
+	float Matrix[9];
+	for (int i = 0; i < 9; i++)
+		Matrix[i] = (float)(Scaled[i] / Scaled[8]);
+	if (!Invert(Matrix, ToCamera))
+		return false;
+	SetToScreen(Matrix);
+	return true;
+}
+
+// Takes a camera to screen matrix with 1 in the bottom right. ToCamera must already be set.
+void Homography::SetToScreen(const float *Matrix)
+{
+	float Largest = 0.0f;
+	for (int i = 0; i < 9; i++)
+	{
+		ToScreen[i] = Matrix[i];
+		float Magnitude = fabsf(ToScreen[i]) * ((i % 3 == 2) ? (float)(1 << FIXED_INPUT_SHIFT) : 1.0f);
+		Largest = (Magnitude > Largest) ? Magnitude : Largest;
+	}
+
+	// Scaling every term the same leaves the ratios alone so use as many bits as fit
+	float Scale = (float)FIXED_MAX_COEFFICIENT / Largest;
+	for (int i = 0; i < 9; i++)
+	{
+		float Term = ToScreen[i] * Scale * ((i % 3 == 2) ? (float)(1 << FIXED_INPUT_SHIFT) : 1.0f);
+		ToScreenFixed[i] = (int32_t)lrintf(Term);
+	}
+	bValid = true;
+}
+
+bool Homography::Map(float X, float Y, float &U, float &V) const
+{
+	float W = ToScreen[6]*X + ToScreen[7]*Y + 1.0f;
+	if (W == 0.0f)
+		return false;
+	float InvW = 1.0f / W;
+	U = (ToScreen[0]*X + ToScreen[1]*Y + ToScreen[2]) * InvW;
+	V = (ToScreen[3]*X + ToScreen[4]*Y + ToScreen[5]) * InvW;
+	return U >= 0.0f && U <= 1.0f && V >= 0.0f && V <= 1.0f;
+}
+
+void Homography::Unmap(float U, float V, float &X, float &Y) const
+{
+	float InvW = 1.0f / (ToCamera[6]*U + ToCamera[7]*V + 1.0f);
+	X = (ToCamera[0]*U + ToCamera[1]*V + ToCamera[2]) * InvW;
+	Y = (ToCamera[3]*U + ToCamera[4]*V + ToCamera[5]) * InvW;
+}
+
+bool Homography::MapFixed(int32_t X, int32_t Y, int32_t &U, int32_t &V) const
+{
+	const int32_t *F = ToScreenFixed;
+	int64_t W = (int64_t)F[6]*X + (int64_t)F[7]*Y + F[8];
+	if (W == 0)
+		return false;
+	int64_t NumU = (int64_t)F[0]*X + (int64_t)F[1]*Y + F[2];
+	int64_t NumV = (int64_t)F[3]*X + (int64_t)F[4]*Y + F[5];
+	U = (int32_t)((NumU << FIXED_OUTPUT_SHIFT) / W);
+	V = (int32_t)((NumV << FIXED_OUTPUT_SHIFT) / W);
+	return U >= 0 && U <= (1 << FIXED_OUTPUT_SHIFT) && V >= 0 && V <= (1 << FIXED_OUTPUT_SHIFT);
+}
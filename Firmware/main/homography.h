@@ -0,0 +1,58 @@
+// (c) Charlie Cole 2017
+//
+// This is licensed under
+// - Creative Commons Attribution-NonCommercial 3.0 Unported
+// - https://creativecommons.org/licenses/by-nc/3.0/
+// - Or see LICENSE.txt
+//
+// The short of it is...
+//   You are free to:
+//     Share — copy and redistribute the material in any medium or format
+//     Adapt — remix, transform, and build upon the material
+//   Under the following terms:
+//     NonCommercial — You may not use the material for commercial purposes.
+//     Attribution — You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+
+
+#ifndef __HOMOGRAPHY_H__
+#define __HOMOGRAPHY_H__
+
+#include <stdint.h>
+
+// Projective transform from camera space to the screen (0-1 across and down) worked out once from the four
+// calibration corners, so mapping a sample is a handful of multiply-adds and a divide. Anything that maps
+// outside 0-1 is off the screen, which replaces testing the point against each edge of the calibration quad.
+// There's a fixed-point version of the mapping too (see Tools/MappingBench for how they compare).
+class Homography
+{
+public:
+	Homography();
+
+	// Corners are camera positions of the screen's top left, top right, bottom left and bottom right.
+	// Returns false (and maps nothing) if they don't make a usable quad.
+	bool Calibrate(const float *CornerX, const float *CornerY);
+
+	// Least squares fit to any number (4 or more) of camera positions and where they are on the screen
+	bool Fit(const float *CameraX, const float *CameraY, const float *ScreenU, const float *ScreenV, int NumPoints);
+
+	bool IsValid() const { return bValid; }
+
+	// Camera to screen. Returns true if the point is on the screen.
+	bool Map(float X, float Y, float &U, float &V) const;
+
+	// Screen to camera
+	void Unmap(float U, float V, float &X, float &Y) const;
+
+	// Camera position in 1/16ths of a pixel to the screen in 1/65536ths. Returns true if on the screen.
+	bool MapFixed(int32_t X, int32_t Y, int32_t &U, int32_t &V) const;
+
+private:
+	void SetToScreen(const float *Matrix);
+
+	float ToScreen[9]; // Row major 3x3, bottom right is 1
+	float ToCamera[9];
+	int32_t ToScreenFixed[9]; // ToScreen scaled to fit with the constant column taking 1/16th pixel inputs
+	bool bValid;
+};
+
+#endif // __HOMOGRAPHY_H__
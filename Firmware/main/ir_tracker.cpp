@@ -0,0 +1,460 @@
+// (c) Charlie Cole 2017
+//
+// This is licensed under
+// - Creative Commons Attribution-NonCommercial 3.0 Unported
+// - https://creativecommons.org/licenses/by-nc/3.0/
+// - Or see LICENSE.txt
+//
+// The short of it is...
+//   You are free to:
+//     Share — copy and redistribute the material in any medium or format
+//     Adapt — remix, transform, and build upon the material
+//   Under the following terms:
+//     NonCommercial — You may not use the material for commercial purposes.
+//     Attribution — You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+
+#include <math.h>
+#include "ir_tracker.h"
+
+#define CAMERA_CENTRE_X 511.5f
+#define CAMERA_CENTRE_Y 383.5f
+#define MAX_SPOT_JUMP 120.0f		// Furthest an LED can move between reports and still be the same one (camera pixels)
+#define MIN_SEPARATION 16.0f		// Closer than this and they're probably one blob split in two
+#define SEPARATION_TOLERANCE 0.25f	// Whole bar can jump if it keeps its size within this fraction
+#define MAX_LOST_FRAMES 20			// Hold the last position for this many reports before giving up
+#define SIZE_MISMATCH_COST 12.0f	// Cost of each step of size difference (in camera pixels)
+#define INTENSITY_MISMATCH_COST 0.5f // Cost of each step of intensity difference (in camera pixels)
+#define ACCEL_ZERO 512.0f			// Accelerometer reading with no force on that axis
+#define ACCEL_ONE_G 104.0f			// Counts per g (roughly, they vary between Wiimotes)
+#define GRAVITY_TOLERANCE 0.3f		// Readings further than this from 1g are mostly the player moving (in g)
+#define SEPARATION_SMOOTHING 0.1f	// Fraction of each new separation taken in
+#define MIN_DISTANCE_SCALE 0.5f		// Limits on the distance compensation
+#define MAX_DISTANCE_SCALE 2.0f
+#define GYRO_UNITS_PER_DEGREE 20.0f	// MotionPlus rate units per degree per second
+#define CAMERA_PIXELS_PER_DEGREE 25.0f // About 41 degrees across 1024 pixels
+#define MAX_BRIDGE_TIME 0.5f		// Longest the gyro carries the aim on its own (seconds)
+#define MAX_GYRO_STEP 0.05f			// Longest gap between reports that's integrated (seconds)
+#define STILL_THRESHOLD 1.5f		// Camera moving less than this between reports means the Wiimote is still (camera pixels)
+#define BIAS_LEARN_RATE 0.02f		// Fraction of the gyro reading taken into the bias per still report
+#define SPEED_CUTOFF 5.0f			// Low pass on the speed estimate (Hz)
+#define MAX_FILTER_STEP 0.1f		// Longer than this between updates and the filter starts again (seconds)
+#define MAX_PREDICTION 0.05f		// Furthest ahead the position is extrapolated (seconds)
+#define PREDICTION_SPEED 60.0f		// Prediction fades in around this speed so camera noise isn't extrapolated (camera pixels per second)
+
+struct FilterStrength
+{
+	float MinCutoff;
+	float Beta;
+};
+
+static const FilterStrength FilterStrengths[PointerFilter::kNumStrengths] =
+{
+	{ 0.0f, 0.0f },		// Off
+	{ 3.0f, 0.05f },	// Light
+	{ 1.5f, 0.02f },	// Medium
+	{ 0.7f, 0.01f },	// Heavy
+};
+
+static inline float DistanceSquared(float X0, float Y0, float X1, float Y1)
+{
+	return (X1 - X0)*(X1 - X0) + (Y1 - Y0)*(Y1 - Y0);
+}
+
+// Fields are signed 10 bits but hold the unsigned reading
+static inline float AccelReading(int32_t Field)
+{
+	return (float)(Field & 0x3FF) - ACCEL_ZERO;
+}
+
+SensorBarTracker::SensorBarTracker()
+{
+	ReferenceSeparation = 0.0f;
+	Reset();
+}
+
+void SensorBarTracker::Reset()
+{
+	Left.X = Left.Y = 0.0f;
+	Right.X = Right.Y = 0.0f;
+	Left.Size = Right.Size = -1;
+	Left.Intensity = Right.Intensity = -1;
+	PointerX = PointerY = 0.0f;
+	Roll = 0.0f;
+	GravityRoll = 0.0f;
+	SmoothedSeparation = 0.0f;
+	NumVisible = 0;
+	LostFrames = MAX_LOST_FRAMES;
+	bTracking = false;
+	bSingleSpot = false;
+	bGravityValid = false;
+}
+
+float SensorBarTracker::GetSeparation() const
+{
+	return bTracking ? sqrtf(DistanceSquared(Left.X, Left.Y, Right.X, Right.Y)) : 0.0f;
+}
+
+// How different two spots look. Only compares what both have reported.
+float SensorBarTracker::Mismatch(const Point &A, const Point &B)
+{
+	float Cost = 0.0f;
+	if (A.Size >= 0 && B.Size >= 0)
+		Cost += SIZE_MISMATCH_COST * fabsf((float)(A.Size - B.Size));
+	if (A.Intensity >= 0 && B.Intensity >= 0)
+		Cost += INTENSITY_MISMATCH_COST * fabsf((float)(A.Intensity - B.Intensity));
+	return Cost;
+}
+
+// Rolling the Wiimote right (clockwise from behind) gives positive X and turns the bar anticlockwise in the
+// camera image (X right, Y up) which is also a positive Roll
+void SensorBarTracker::UpdateGravity(const WiimoteData &Data)
+{
+	float X = AccelReading(Data.AccelX) * (1.0f / ACCEL_ONE_G);
+	float Y = AccelReading(Data.AccelY) * (1.0f / ACCEL_ONE_G);
+	float Z = AccelReading(Data.AccelZ) * (1.0f / ACCEL_ONE_G);
+	float Magnitude = sqrtf(X*X + Y*Y + Z*Z);
+	bGravityValid = fabsf(Magnitude - 1.0f) < GRAVITY_TOLERANCE && (X*X + Z*Z) > 0.25f; // Not pointing at the floor/ceiling either
+	if (bGravityValid)
+		GravityRoll = atan2f(X, Z);
+}
+
+bool SensorBarTracker::Update(const WiimoteData &Data)
+{
+	const WiimoteData::Spot *Spots = Data.IRSpot;
+	UpdateGravity(Data);
+
+	Point Valid[4];
+	int NumSpots = 0;
+	for (int i = 0; i < 4; i++)
+	{
+		if (Spots[i].X != 0x3FF || Spots[i].Y != 0x3FF)
+		{
+			Valid[NumSpots].X = (float)Spots[i].X;
+			Valid[NumSpots].Y = (float)Spots[i].Y;
+			Valid[NumSpots].Size = Spots[i].Size ? (Spots[i].Size & 0xF) : -1;
+			Valid[NumSpots].Intensity = Spots[i].Intensity ? Spots[i].Intensity : -1;
+			NumSpots++;
+		}
+	}
+
+	if (MatchPair(Valid, NumSpots) || MatchSingle(Valid, NumSpots))
+	{
+		LostFrames = 0;
+		UpdatePointer();
+		return true;
+	}
+
+	NumVisible = 0;
+	if (LostFrames < MAX_LOST_FRAMES)
+	{
+		LostFrames++;
+		return true; // Keep pointing where we were through short dropouts
+	}
+	bTracking = false;
+	bSingleSpot = false;
+	return false;
+}
+
+bool SensorBarTracker::MatchPair(const Point *Spots, int NumSpots)
+{
+	float Separation = GetSeparation();
+	float BestCost = 0.0f;
+	int BestLeft = -1;
+	int BestRight = -1;
+	for (int i = 0; i < NumSpots; i++)
+	{
+		for (int j = 0; j < NumSpots; j++)
+		{
+			if (i == j)
+				continue;
+			const Point &A = Spots[i];
+			const Point &B = Spots[j];
+			float PairSeparation = sqrtf(DistanceSquared(A.X, A.Y, B.X, B.Y));
+			if (PairSeparation < MIN_SEPARATION)
+				continue;
+			float Cost;
+			if (bTracking)
+			{
+				float LeftMove = DistanceSquared(A.X, A.Y, Left.X, Left.Y);
+				float RightMove = DistanceSquared(B.X, B.Y, Right.X, Right.Y);
+				bool bNearby = LeftMove < MAX_SPOT_JUMP*MAX_SPOT_JUMP && RightMove < MAX_SPOT_JUMP*MAX_SPOT_JUMP;
+				bool bSameShape = fabsf(PairSeparation - Separation) < Separation*SEPARATION_TOLERANCE;
+				if (!bNearby && !bSameShape)
+					continue;
+				Cost = sqrtf(LeftMove) + sqrtf(RightMove) + 2.0f*fabsf(PairSeparation - Separation);
+				Cost += Mismatch(A, Left) + Mismatch(B, Right);
+			}
+			else
+			{
+				// Fresh start so expect the bar at the accelerometer's roll (or level) and prefer wide pairs of matching LEDs
+				float ExpectedRoll = bGravityValid ? GravityRoll : 0.0f;
+				float Along = (B.X - A.X)*cosf(ExpectedRoll) + (B.Y - A.Y)*sinf(ExpectedRoll);
+				float Across = (B.Y - A.Y)*cosf(ExpectedRoll) - (B.X - A.X)*sinf(ExpectedRoll);
+				if (Along < 0.0f)
+					continue;
+				Cost = 4.0f*fabsf(Across) - PairSeparation + Mismatch(A, B);
+			}
+			if (BestLeft < 0 || Cost < BestCost)
+			{
+				BestCost = Cost;
+				BestLeft = i;
+				BestRight = j;
+			}
+		}
+	}
+	if (BestLeft < 0)
+		return false;
+	Left = Spots[BestLeft];
+	Right = Spots[BestRight];
+	float PairSeparation = sqrtf(DistanceSquared(Left.X, Left.Y, Right.X, Right.Y));
+	SmoothedSeparation = bTracking ? SmoothedSeparation + (PairSeparation - SmoothedSeparation)*SEPARATION_SMOOTHING : PairSeparation;
+	NumVisible = 2;
+	bTracking = true;
+	bSingleSpot = false;
+	return true;
+}
+
+bool SensorBarTracker::MatchSingle(const Point *Spots, int NumSpots)
+{
+	if (NumSpots == 0)
+		return false;
+
+	if (!bTracking)
+	{
+		// Only one spot has ever been seen so just follow that on its own
+		if (bSingleSpot && LostFrames < MAX_LOST_FRAMES)
+		{
+			int Closest = 0;
+			for (int i = 1; i < NumSpots; i++)
+			{
+				if (DistanceSquared(Spots[i].X, Spots[i].Y, Left.X, Left.Y) < DistanceSquared(Spots[Closest].X, Spots[Closest].Y, Left.X, Left.Y))
+					Closest = i;
+			}
+			Left = Right = Spots[Closest];
+		}
+		else
+		{
+			Left = Right = Spots[0];
+		}
+		NumVisible = 1;
+		bSingleSpot = true;
+		return true;
+	}
+
+	// Find the spot that best continues one of the LEDs and move the other with it
+	float BestDistance = MAX_SPOT_JUMP*MAX_SPOT_JUMP;
+	int BestSpot = -1;
+	bool bIsLeft = false;
+	for (int i = 0; i < NumSpots; i++)
+	{
+		float LeftMismatch = Mismatch(Spots[i], Left);
+		float RightMismatch = Mismatch(Spots[i], Right);
+		float LeftDistance = DistanceSquared(Spots[i].X, Spots[i].Y, Left.X, Left.Y) + LeftMismatch*LeftMismatch;
+		float RightDistance = DistanceSquared(Spots[i].X, Spots[i].Y, Right.X, Right.Y) + RightMismatch*RightMismatch;
+		if (LeftDistance < BestDistance)
+		{
+			BestDistance = LeftDistance;
+			BestSpot = i;
+			bIsLeft = true;
+		}
+		if (RightDistance < BestDistance)
+		{
+			BestDistance = RightDistance;
+			BestSpot = i;
+			bIsLeft = false;
+		}
+	}
+	if (BestSpot < 0)
+		return false;
+
+	Point &Seen = bIsLeft ? Left : Right;
+	Point &Unseen = bIsLeft ? Right : Left;
+	Unseen.X += Spots[BestSpot].X - Seen.X;
+	Unseen.Y += Spots[BestSpot].Y - Seen.Y;
+	Seen = Spots[BestSpot];
+	NumVisible = 1;
+	return true;
+}
+
+void SensorBarTracker::UpdatePointer()
+{
+	float MidX = (Left.X + Right.X) * 0.5f;
+	float MidY = (Left.Y + Right.Y) * 0.5f;
+	if (bTracking)
+	{
+		Roll = atan2f(Right.Y - Left.Y, Right.X - Left.X);
+	}
+	else if (bGravityValid)
+	{
+		Roll = GravityRoll; // Only got one LED so the accelerometer is all there is
+	}
+	else
+	{
+		PointerX = MidX;
+		PointerY = MidY;
+		return;
+	}
+
+	// Closer means the same aim point is further from the middle of the camera (and the LEDs further apart)
+	float Scale = 1.0f;
+	if (bTracking && ReferenceSeparation > 0.0f && SmoothedSeparation > 0.0f)
+	{
+		Scale = ReferenceSeparation / SmoothedSeparation;
+		Scale = (Scale < MIN_DISTANCE_SCALE) ? MIN_DISTANCE_SCALE : ((Scale > MAX_DISTANCE_SCALE) ? MAX_DISTANCE_SCALE : Scale);
+	}
+
+	// Rotate the midpoint about the centre of the camera to undo the roll
+	float Cos = cosf(Roll) * Scale;
+	float Sin = sinf(Roll) * Scale;
+	float OffsetX = MidX - CAMERA_CENTRE_X;
+	float OffsetY = MidY - CAMERA_CENTRE_Y;
+	PointerX = CAMERA_CENTRE_X + OffsetX*Cos + OffsetY*Sin;
+	PointerY = CAMERA_CENTRE_Y - OffsetX*Sin + OffsetY*Cos;
+}
+
+GyroBridge::GyroBridge()
+{
+	Reset();
+}
+
+void GyroBridge::Reset()
+{
+	PointerX = PointerY = 0.0f;
+	CameraX = CameraY = 0.0f;
+	Roll = 0.0f;
+	BiasYaw = BiasPitch = 0.0f;
+	BridgeTime = 0.0f;
+	LastTime = 0;
+	bAnchored = false;
+	bBridging = false;
+}
+
+bool GyroBridge::Update(const SensorBarTracker &Tracker, bool bTracked, const WiimoteData &Data)
+{
+	float DeltaTime = (float)(Data.ReportTime - LastTime) * 0.000001f;
+	LastTime = Data.ReportTime;
+	if (DeltaTime > MAX_GYRO_STEP)
+		DeltaTime = MAX_GYRO_STEP;
+	bBridging = false;
+
+	if (Tracker.GetNumVisible() > 0 || !Data.bMotionPlus)
+	{
+		float X = Tracker.GetX();
+		float Y = Tracker.GetY();
+		if (Data.bMotionPlus && bAnchored && fabsf(X - CameraX) < STILL_THRESHOLD && fabsf(Y - CameraY) < STILL_THRESHOLD)
+		{
+			// Not turning so whatever the gyro says is bias
+			BiasYaw += ((float)Data.GyroYaw - BiasYaw) * BIAS_LEARN_RATE;
+			BiasPitch += ((float)Data.GyroPitch - BiasPitch) * BIAS_LEARN_RATE;
+		}
+		PointerX = CameraX = X;
+		PointerY = CameraY = Y;
+		Roll = Tracker.GetRoll();
+		bAnchored = (Tracker.GetNumVisible() > 0);
+		BridgeTime = 0.0f;
+		return bTracked;
+	}
+
+	BridgeTime += DeltaTime;
+	if (!bAnchored || BridgeTime > MAX_BRIDGE_TIME)
+	{
+		bAnchored = false;
+		return false;
+	}
+
+	// Turning left moves the sensor bar right in the camera and tilting up moves it up (lower Y).
+	// Rotated by the roll the same way as the tracker so it stays in the same space.
+	float Scale = DeltaTime * CAMERA_PIXELS_PER_DEGREE / GYRO_UNITS_PER_DEGREE;
+	float MoveX = ((float)Data.GyroYaw - BiasYaw) * Scale;
+	float MoveY = -((float)Data.GyroPitch - BiasPitch) * Scale;
+	float Cos = cosf(Roll);
+	float Sin = sinf(Roll);
+	PointerX += MoveX*Cos + MoveY*Sin;
+	PointerY += -MoveX*Sin + MoveY*Cos;
+	bBridging = true;
+	return true;
+}
+
+// Fraction of the way a low pass with the given cutoff moves towards its input over a step
+static inline float Smoothing(float Cutoff, float DeltaTime)
+{
+	float TimeConstant = 1.0f / (2.0f * (float)M_PI * Cutoff);
+	return 1.0f / (1.0f + TimeConstant / DeltaTime);
+}
+
+PointerFilter::PointerFilter()
+{
+	Configure(kStrength_Off, false);
+	Reset();
+}
+
+void PointerFilter::Reset()
+{
+	FilteredX = FilteredY = 0.0f;
+	RawX = RawY = 0.0f;
+	SpeedX = SpeedY = 0.0f;
+	Lag = 0.0f;
+	LastTime = 0;
+	bPrimed = false;
+}
+
+void PointerFilter::Configure(int Strength, bool bEnablePrediction)
+{
+	if (Strength < 0 || Strength >= kNumStrengths)
+		Strength = kStrength_Off;
+	MinCutoff = FilterStrengths[Strength].MinCutoff;
+	Beta = FilterStrengths[Strength].Beta;
+	bSmooth = (Strength != kStrength_Off);
+	bPredict = bEnablePrediction;
+}
+
+void PointerFilter::Update(float X, float Y, uint32_t Time)
+{
+	float DeltaTime = (float)(Time - LastTime) * 0.000001f;
+	if (!bPrimed || DeltaTime <= 0.0f || DeltaTime > MAX_FILTER_STEP)
+	{
+		FilteredX = RawX = X;
+		FilteredY = RawY = Y;
+		SpeedX = SpeedY = 0.0f;
+		Lag = 0.0f;
+		LastTime = Time;
+		bPrimed = true;
+		return;
+	}
+	LastTime = Time;
+
+	// Speed comes from the raw positions so it isn't held back by the smoothing it controls
+	float SpeedSmoothing = Smoothing(SPEED_CUTOFF, DeltaTime);
+	SpeedX += ((X - RawX) / DeltaTime - SpeedX) * SpeedSmoothing;
+	SpeedY += ((Y - RawY) / DeltaTime - SpeedY) * SpeedSmoothing;
+	RawX = X;
+	RawY = Y;
+	if (!bSmooth)
+	{
+		FilteredX = X;
+		FilteredY = Y;
+		Lag = 0.0f;
+		return;
+	}
+
+	// Same cutoff for both axes so diagonal moves don't bend
+	float Cutoff = MinCutoff + Beta * sqrtf(SpeedX*SpeedX + SpeedY*SpeedY);
+	float PositionSmoothing = Smoothing(Cutoff, DeltaTime);
+	FilteredX += (X - FilteredX) * PositionSmoothing;
+	FilteredY += (Y - FilteredY) * PositionSmoothing;
+	Lag = DeltaTime * (1.0f - PositionSmoothing) / PositionSmoothing; // How far a steady move trails (the time constant)
+}
+
+void PointerFilter::Predict(uint32_t Time, float &X, float &Y) const
+{
+	X = FilteredX;
+	Y = FilteredY;
+	if (!bPredict || !bPrimed)
+		return;
+	float Ahead = (float)(int32_t)(Time - LastTime) * 0.000001f + Lag;
+	Ahead = (Ahead < 0.0f) ? 0.0f : ((Ahead > MAX_PREDICTION) ? MAX_PREDICTION : Ahead);
+	float SpeedSquared = SpeedX*SpeedX + SpeedY*SpeedY;
+	Ahead *= SpeedSquared / (SpeedSquared + PREDICTION_SPEED*PREDICTION_SPEED);
+	X += SpeedX * Ahead;
+	Y += SpeedY * Ahead;
+}
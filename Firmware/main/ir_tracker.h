@@ -0,0 +1,173 @@
+// (c) Charlie Cole 2017
+//
+// This is licensed under
+// - Creative Commons Attribution-NonCommercial 3.0 Unported
+// - https://creativecommons.org/licenses/by-nc/3.0/
+// - Or see LICENSE.txt
+//
+// The short of it is...
+//   You are free to:
+//     Share — copy and redistribute the material in any medium or format
+//     Adapt — remix, transform, and build upon the material
+//   Under the following terms:
+//     NonCommercial — You may not use the material for commercial purposes.
+//     Attribution — You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+
+#ifndef __IR_TRACKER_H__
+#define __IR_TRACKER_H__
+
+#include <stdint.h>
+#include "esp_wiimote.h"
+
+// Follows the two sensor bar LEDs across IR camera frames and turns them into a single pointing position.
+// Uses the midpoint of the pair rotated back by the roll of the bar, so twisting the Wiimote doesn't move the aim.
+// When one LED drops out the other carries on with the last known separation and stray spots (lamps, reflections)
+// are ignored unless they fit the pair being tracked. Spot size and intensity (when the IR mode reports them) are
+// used to tell the LEDs apart from other light sources. The accelerometer supplies the roll when there's no pair
+// to measure it from and says which way up the pair is when tracking starts.
+// Given the separation at calibration, offsets from the middle of the camera are scaled by how much closer or
+// further away the player is now, so the aim lands in the same place on the screen after stepping back.
+class SensorBarTracker
+{
+public:
+	SensorBarTracker();
+
+	void Reset();
+
+	// Returns true if there's something to point with
+	bool Update(const WiimoteData &Data);
+
+	// LED separation (camera pixels) the calibration was done at, 0 to not compensate for distance
+	void SetReferenceSeparation(float Separation) { ReferenceSeparation = Separation; }
+	float GetReferenceSeparation() const { return ReferenceSeparation; }
+
+	// Pointing position in camera space (0-1023, 0-767). Can go outside that range when rolled.
+	float GetX() const { return PointerX; }
+	float GetY() const { return PointerY; }
+
+	// Angle of the sensor bar in the camera image in radians
+	float GetRoll() const { return Roll; }
+
+	// Distance between the LEDs in camera pixels (0 if only ever seen one)
+	float GetSeparation() const;
+
+	// Separation smoothed over the last few reports with both LEDs in view (0 if not tracking a pair)
+	float GetSmoothedSeparation() const { return bTracking ? SmoothedSeparation : 0.0f; }
+
+	// Number of sensor bar LEDs seen in the last frame
+	int GetNumVisible() const { return NumVisible; }
+
+private:
+	struct Point
+	{
+		float X;
+		float Y;
+		int Size; // 0-15, -1 if not reported
+		int Intensity; // 0-255, -1 if not reported
+	};
+
+	static float Mismatch(const Point &A, const Point &B);
+
+	void UpdateGravity(const WiimoteData &Data);
+	bool MatchPair(const Point *Spots, int NumSpots);
+	bool MatchSingle(const Point *Spots, int NumSpots);
+	void UpdatePointer();
+
+	Point Left;
+	Point Right;
+	float PointerX;
+	float PointerY;
+	float Roll;
+	float GravityRoll; // From the accelerometer, same sense as Roll
+	float SmoothedSeparation;
+	float ReferenceSeparation;
+	int NumVisible;
+	int LostFrames;
+	bool bTracking; // Have seen both LEDs and know which is which
+	bool bSingleSpot; // Only ever seen one spot so using it directly
+	bool bGravityValid; // Wiimote isn't being shaken too hard to trust GravityRoll
+};
+
+// Carries the pointing position on MotionPlus rates while the camera can't see the sensor bar (fast flicks,
+// edge of the screen) and snaps back to the camera as soon as it returns. Gyro bias is learnt whenever the
+// camera shows the Wiimote being held still. Without a MotionPlus it just passes the tracker through.
+class GyroBridge
+{
+public:
+	GyroBridge();
+
+	void Reset();
+
+	// Call once per report after the tracker. Returns true if there's something to point with.
+	bool Update(const SensorBarTracker &Tracker, bool bTracked, const WiimoteData &Data);
+
+	// Same space as SensorBarTracker::GetX()/GetY()
+	float GetX() const { return PointerX; }
+	float GetY() const { return PointerY; }
+
+	// Position is coming from the gyro rather than the camera
+	bool IsBridging() const { return bBridging; }
+
+private:
+	float PointerX;
+	float PointerY;
+	float CameraX; // Last position the camera saw
+	float CameraY;
+	float Roll;
+	float BiasYaw; // MotionPlus units (1/20ths of a degree per second)
+	float BiasPitch;
+	float BridgeTime; // Seconds since the camera last saw the sensor bar
+	uint32_t LastTime;
+	bool bAnchored; // Have a camera position to carry on from
+	bool bBridging;
+};
+
+// Smooths the pointing position with a One Euro filter (a low pass whose cutoff rises with speed, so holding
+// still doesn't jitter but moving doesn't lag) and can extrapolate it on to when the reticule is actually drawn
+// to hide the time between the camera seeing the sensor bar and the beam reaching that part of the screen.
+class PointerFilter
+{
+public:
+	enum
+	{
+		kStrength_Off,
+		kStrength_Light,
+		kStrength_Medium,
+		kStrength_Heavy,
+		kNumStrengths
+	};
+
+	PointerFilter();
+
+	void Reset();
+
+	// Can be changed at any time without upsetting the current position
+	void Configure(int Strength, bool bPredict);
+
+	// Camera position and when it was seen (microseconds, same clock as WiimoteData::ReportTime)
+	void Update(float X, float Y, uint32_t Time);
+
+	// Smoothed position as of the last update
+	float GetX() const { return FilteredX; }
+	float GetY() const { return FilteredY; }
+
+	// Smoothed position moved on to the given time if prediction is enabled (otherwise the same as GetX()/GetY())
+	void Predict(uint32_t Time, float &X, float &Y) const;
+
+private:
+	float MinCutoff; // Hz when still
+	float Beta; // Extra Hz per camera pixel per second
+	bool bSmooth;
+	bool bPredict;
+	bool bPrimed;
+	float FilteredX;
+	float FilteredY;
+	float RawX; // Last position passed in
+	float RawY;
+	float SpeedX; // Camera pixels per second
+	float SpeedY;
+	float Lag; // Seconds the smoothed position is behind at the current speed
+	uint32_t LastTime;
+};
+
+#endif // __IR_TRACKER_H__
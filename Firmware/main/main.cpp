@@ -22,6 +22,7 @@ extern "C"
 {
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/timers.h"
 #include "driver/uart.h"
 #include "driver/gpio.h"
 #include "driver/rtc_io.h"
@@ -38,11 +39,18 @@ extern "C"
 #include "lwip/netdb.h"
 #include "lwip/dns.h"
 #include "esp_ota_ops.h"
+#include "esp_timer.h"
 #include "rom/rtc.h"
 #include "rom/cache.h"
 #include "soc/cpu.h"
 };
 #include "esp_wiimote.h"
+#include "ir_tracker.h"
+#include "homography.h"
+#include "calibration_grid.h"
+#include "serial_protocol.h"
+#include "video_timing.h"
+#include "guncon2.h"
 #include "images.h"
 
 #define OUT_SCREEN_DIM  (GPIO_NUM_23) // Controls drawing spot on screen
@@ -82,18 +90,8 @@ extern "C"
 #define LEDC_WHITE_LEVEL_CHANNEL    LEDC_CHANNEL_0
 #define WHITE_LEVEL_STEP			248				  // About 0.1V steps
 
-#define HOME_TIME_UNTIL_FIRMWARE_UPDATE 8000
-
-#define TIMING_RETICULE_WIDTH 75.0f // Generates a circle in PAL but might need adjusting for NTSC (In 80ths of a microsecond)
-#define TIMING_BACK_PORCH 7*80		// In 80ths of a microsecond	(Should be about 6*80)
-#define TIMING_LINE_DURATION  (8*465+100) // In 80ths of a microsecond  (Should be about 52*80 but need to clip when off edge)
-#define TIMING_LINE_DURATION_NTSC  (8*460+100) // Not correct. Backporch should be altered instead
-#define TIMING_BLANKED_LINES 28		// Should be about 16?
-#define TIMING_VISIBLE_LINES 258	// Should be 288
-#define TIMING_VISIBLE_LINES_NTSC 206	// Should be 240
-#define TIMING_VSYNC_THRESHOLD (40*16) // If sync is longer than this then doing a vertical sync
-#define TIMING_SHORT_SYNC_THRESHOLD (40*3) // If sync is shorter than this it's a short sync
-#define TIMING_SYNC_DEBOUNCE (2*80)  // At the end of the sync check to see if it's real (noisy signals can cause errors)
+#define HOME_TIME_UNTIL_FIRMWARE_UPDATE 8000 // In milliseconds
+
 #define TEXT_START_LINE 105
 #define TEXT_END_LINE (TEXT_START_LINE + 80)
 #define LOGO_START_LINE (TIMING_BLANKED_LINES + 24)
@@ -112,6 +110,19 @@ extern "C"
 #define ENABLE_MENU_BORDER	0 		// Disable until issues with glitching (especially bad on NTSC is solved)
 
 #define SAVESTATE_VERSION 2
+#define POINTER_SAVESTATE_VERSION 2
+#define CALIBRATION_SAVE_VERSION 2	// Bump whenever Homography or CalibrationGrid change layout
+
+#define LEGACY_SERIAL_BAUD 9600	// GunCon 2 cable's 8 byte frames
+#define SERIAL_TX_LINE 4		// Line after vertical sync that the spot generator starts each serial frame on
+#define SERIAL_STATS_LOG_PERIOD 10000	// In milliseconds
+
+#define LINK_STATS_LOG_PERIOD 10	// In seconds
+#define LINK_STATUS_REFRESH 500		// In milliseconds
+#define HOUSEKEEPING_PERIOD 10		// Menu, LEDs and timers run this often (in milliseconds)
+
+#define WIIMOTE_TASK_PACKET			(1 << 0)	// Notification bits for the Wiimote task
+#define WIIMOTE_TASK_HOUSEKEEPING	(1 << 1)
 
 #define PERSISTANT_POWER_ON_VALUE		0xCDC00000ull
 #define PERSISTANT_FIRMWARE_UPDATE_MODE	0xCDC10000ull
@@ -131,6 +142,14 @@ enum EUIState
 	kUIState_Syncing
 };
 
+enum EMenuPage
+{
+	kMenuPage_Settings,
+	kMenuPage_Pointer,
+	kMenuPage_LinkStatus,
+	kNumMenuPages
+};
+
 enum MenuControl
 {
 	kMenu_None,
@@ -168,10 +187,34 @@ static int WhiteLevelDecimal = 11;
 static int IOType = 0;
 static int CursorBrightness = 3;
 static int SelectedRow = 2;
+static int PointerSelectedRow = 2;
+static int CalibrationDensity = 0; // Targets per side less 2 (4, 9 or 16 points)
+static int FilterStrength = PointerFilter::kStrength_Medium;
+static int PointerPrediction = 1;
+static volatile uint32_t VSyncTime = 0; // esp_timer time of the last vertical sync (in microseconds)
+static volatile uint32_t FieldPeriod = 0;
+static volatile bool bLowerField = false; // Interlaced video and this field is drawn half a line lower
+// Latest serial output from the Wiimote task for the spot generator to send at SERIAL_TX_LINE. Triple buffered
+// so there's always a whole one that isn't being written to or read from.
+struct SerialOutput
+{
+	SerialPlayerState Players[2];
+	int AimLine[2]; // For GunCon 2, see GunCon2Position()
+};
+static SerialOutput SerialOutputs[3];
+static volatile int SerialPublished = 0; // Index of the newest whole entry
+static volatile int SerialReading = -1; // Index the spot generator is encoding from
+static volatile uint32_t SerialStatesQueued = 0;
+static volatile uint32_t SerialFramesSent = 0;
+static volatile uint32_t SerialOverruns = 0; // Fields skipped as the previous frame was still going out
+static volatile uint32_t SerialStaleFrames = 0; // Fields sent without anything new since the last one
+static uint8_t SerialSequence = 0;
+static int MenuPage = kMenuPage_Settings;
 static bool LogoMode = true;
 static bool TextMode = true;
 static uint32_t *ImageData = &ImagePress12[0][0];
-static int LogoTime = 4000;
+static int LogoTime = 4000; // In milliseconds
+static TaskHandle_t WiimoteTaskHandle = NULL;
 static bool ShowPointer = true;
 static int Coop = 0;
 static int CurrentLine = 0;
@@ -180,6 +223,7 @@ static int CurrentTextSubLine = 0;
 static int PlayerMask = 0; // Set to 1 for two player
 static int ReticuleStartLineNum[2] = { 1000,1000 };
 static int ReticuleXPosition[2] = { 320,320 };
+static int ReticuleAimLine[2] = { 0,0 }; // ReticuleStartLineNum before rounding, in 256ths of a line
 static int ReticuleSizeLookup[2][14];
 static int CalibrationDelay = 0;
 static int LastActivePlayer = 0;
@@ -187,6 +231,7 @@ static int WhiteLevel = 3225;	// Should produce test voltage of 1.3V (good for c
 static int CableType = 1;
 static unsigned char TextBuffer[NUM_TEXT_ROWS][NUM_TEXT_COLUMNS];
 static bool bNTSC = true;
+static EWiimoteIRMode WiimoteIRMode = kWiimoteIRMode_Extended; // Full adds spot intensity but needs two reports per camera frame
 
 static int CustomDelayDecimal = 0;
 static int CustomLineDelay = 0;
@@ -195,11 +240,22 @@ static int CustomIOType = 0;
 static int LoadedCableType = 1;
 
 bool MenuInput(MenuControl Input, class PlayerInput *MenuPlayer);
+bool PointerMenuInput(MenuControl Input);
 void InitializeFirmwareUpdateScreen();
 void InitializeMenu();
+void ChangeMenuPage(int Page);
+void UpdateLinkStatus(class PlayerInput &Player1, class PlayerInput &Player2);
+bool LoadWiimoteAddress(int PlayerIdx, uint8_t *Address);
+void SaveWiimoteAddress(int PlayerIdx, const uint8_t *Address);
+bool LoadCalibration(const uint8_t *Address, int Profile, void *Data, size_t Size);
+void SaveCalibration(const uint8_t *Address, int Profile, const void *Data, size_t Size);
 void SetMenuState();
 void ConvertText(const char *Text, int Row, int Column);
 void SetReticuleSize(bool IsCalibration = false);
+uint32_t NextDrawTime(int Line);
+void QueueSerialOutput(const SerialOutput &Output);
+void WriteSerialOutput(const SerialOutput &Output, uint32_t FieldTime, bool bLower);
+bool SerialOutputBusy();
 
 void SetPersistantStorage(uint64_t PersistantValue)
 {
@@ -257,36 +313,93 @@ private:
 public:
 	PlayerInput(int PlayerNum)
 	{
-		Wiimote = GWiimoteManager.CreateNewWiimote();
+		uint8_t KnownAddress[6]; // Page last session's Wiimote directly rather than waiting for an inquiry
+		Wiimote = GWiimoteManager.CreateNewWiimote(LoadWiimoteAddress(PlayerNum, KnownAddress) ? KnownAddress : nullptr);
+		Wiimote->SetIRMode(WiimoteIRMode);
+		Wiimote->SetMotionPlus(true);
 		FrameNumber = 0;
 		OldButtons = 0;
 		ButtonClick = 0;
 		PlayerIdx = PlayerNum;
 		CalibrationPhase = 4;
+		CalibrationSide = 2;
+		CalibrationSeparation = 0.0f;
+		CalibrationProfile = -1;
 		DoneCalibration = false;
 		SpotX = ~0;
 		SpotY = ~0;
+		DrawnLine = TIMING_BLANKED_LINES + TIMING_VISIBLE_LINES / 2;
+		LoggedStatsWindow = 0;
+		bSavedAddress = false;
 	}
 
 	void Tick()
 	{
+		bool bConnected = Wiimote->IsConnected();
+		if (bConnected && !bSavedAddress)
+		{
+			if (Wiimote->GetAddress(Address))
+			{
+				SaveWiimoteAddress(PlayerIdx, Address);
+				bSavedAddress = true;
+			}
+		}
+		bSavedAddress = bSavedAddress && bConnected;
+		if (!bSavedAddress)
+		{
+			CalibrationProfile = -1; // Whichever Wiimote connects next gets its own calibration
+		}
+		else if (CalibrationProfile != CableType && CalibrationPhase >= NumCalibrationPoints())
+		{
+			CalibrationProfile = CableType;
+			RestoreCalibration();
+		}
+
 		const WiimoteData *Data = Wiimote->GetData();
 		if (Data->FrameNumber != FrameNumber)
 		{
 			FrameNumber = Data->FrameNumber;
+			bool bSeesSensorBar = Tracker.Update(*Data);
+			bSeesSensorBar = Bridge.Update(Tracker, bSeesSensorBar, *Data); // Gyro fills in when the camera loses the sensor bar
+			if (bSeesSensorBar)
+			{
+				Filter.Configure(FilterStrength, PointerPrediction != 0);
+				Filter.Update(Bridge.GetX(), Bridge.GetY(), Data->ReportTime);
+			}
+			else
+			{
+				Filter.Reset();
+			}
+			float PointerX, PointerY;
+			Filter.Predict(NextDrawTime(DrawnLine), PointerX, PointerY); // Where it'll be when the beam gets there
+
+			const WiimoteReportStats *Stats = Wiimote->GetReportStats();
+			if (Stats->NumWindows != LoggedStatsWindow && (Stats->NumWindows % LINK_STATS_LOG_PERIOD) == 0)
+			{
+				printf("Player %d link: %d reports, interval %dus, jitter %dus, max %dus, dropped %d\n", PlayerIdx + 1, Stats->NumReports, Stats->MeanInterval, Stats->Jitter, Stats->MaxInterval, Stats->NumDropped);
+				LoggedStatsWindow = Stats->NumWindows;
+			}
 
-			if (UIState == kUIState_CalibrationMode && CalibrationPhase < 4)
+			if (UIState == kUIState_CalibrationMode && CalibrationPhase < NumCalibrationPoints())
 			{
 				if (ButtonClicked(Data->Buttons, (WiimoteData::kButton_B | WiimoteData::kButton_A)))
 				{
-					if (Data->IRSpot[0].X != 0x3FF || Data->IRSpot[0].Y != 0x3FF)
+					if (bSeesSensorBar)
 					{
-						CalibrationData[CalibrationPhase].X = (float)Data->IRSpot[0].X;
-						CalibrationData[CalibrationPhase].Y = (float)Data->IRSpot[0].Y;
+						CalibrationData[CalibrationPhase].X = Filter.GetX();
+						CalibrationData[CalibrationPhase].Y = Filter.GetY();
+						float Separation = Tracker.GetSmoothedSeparation();
+						CalibrationSeparation = (Separation > 0.0f && CalibrationSeparation >= 0.0f) ? CalibrationSeparation + Separation : -1.0f;
 						CalibrationPhase++;
-						DoneCalibration = (CalibrationPhase == 4);
-						if (DoneCalibration)
+						if (CalibrationPhase == NumCalibrationPoints())
 						{
+							DoneCalibration = Calibrate();
+							if (DoneCalibration)
+							{
+								// Distance compensation needs both LEDs at every target, otherwise leave it off
+								Tracker.SetReferenceSeparation((CalibrationSeparation > 0.0f) ? CalibrationSeparation / NumCalibrationPoints() : 0.0f);
+								StoreCalibration();
+							}
 							UIState = kUIState_Playing;
 							SetReticuleSize();
 						}
@@ -301,42 +414,28 @@ public:
 			int VisibleLines = bNTSC ? TIMING_VISIBLE_LINES_NTSC : TIMING_VISIBLE_LINES;
 			int LineDuration = bNTSC ? TIMING_LINE_DURATION_NTSC : TIMING_LINE_DURATION;
 
-			if (UIState == kUIState_CalibrationMode && CalibrationPhase < 4)
+			if (UIState == kUIState_CalibrationMode && CalibrationPhase < NumCalibrationPoints())
 			{
+				// Targets go left to right then top to bottom over an evenly spaced grid (just the corners for 4 points)
 				ImageData = &ImageAim[0][0];
 				TextMode = true;
-				switch (CalibrationPhase)
-				{
-					case 0:
-						ReticuleXPosition[PlayerIdx] = TIMING_BACK_PORCH;
-						ReticuleStartLineNum[PlayerIdx] = TIMING_BLANKED_LINES;
-						break;
-					case 1:
-						ReticuleXPosition[PlayerIdx] = TIMING_BACK_PORCH + LineDuration;
-						ReticuleStartLineNum[PlayerIdx] = TIMING_BLANKED_LINES;
-						break;
-					case 2:
-						ReticuleXPosition[PlayerIdx] = TIMING_BACK_PORCH;
-						ReticuleStartLineNum[PlayerIdx] = TIMING_BLANKED_LINES + VisibleLines;
-						break;
-					case 3:
-						ReticuleXPosition[PlayerIdx] = TIMING_BACK_PORCH + LineDuration;
-						ReticuleStartLineNum[PlayerIdx] = TIMING_BLANKED_LINES + VisibleLines;
-						break;
-
-				}
+				int Column = CalibrationPhase % CalibrationSide;
+				int Row = CalibrationPhase / CalibrationSide;
+				ReticuleXPosition[PlayerIdx] = TIMING_BACK_PORCH + (LineDuration*Column) / (CalibrationSide - 1);
+				ReticuleStartLineNum[PlayerIdx] = TIMING_BLANKED_LINES + (VisibleLines*Row) / (CalibrationSide - 1);
+				ReticuleAimLine[PlayerIdx] = (TIMING_BLANKED_LINES * GUNCON2_LINE_SCALE) + (VisibleLines*Row*GUNCON2_LINE_SCALE) / (CalibrationSide - 1);
 			}
 			else
 			{
 				if (DoneCalibration)
 				{
-					Vector2D Spot = Vector2D((float)Data->IRSpot[0].X, (float)Data->IRSpot[0].Y);
-					if (Within(Spot))
+					Vector2D Spot;
+					if (bSeesSensorBar && MapToScreen(PointerX, PointerY, Spot.X, Spot.Y))
 					{
-						Spot = RemapVector(Spot);
 						Spot = Spot * 1023.0f;
 						ReticuleXPosition[PlayerIdx] = TIMING_BACK_PORCH + (LineDuration*(int)Spot.X) / 1024;
 						ReticuleStartLineNum[PlayerIdx] = TIMING_BLANKED_LINES + (VisibleLines*(int)Spot.Y) / 1024;
+						ReticuleAimLine[PlayerIdx] = (TIMING_BLANKED_LINES * GUNCON2_LINE_SCALE) + (VisibleLines*(int)(Spot.Y * GUNCON2_LINE_SCALE)) / 1024;
 						SpotX = (uint16_t)Spot.X;
 						SpotY = (uint16_t)((Spot.Y * 3) / 4);
 					}
@@ -349,12 +448,15 @@ public:
 				}
 				else
 				{
-					if (Data->IRSpot[0].X != 0x3FF || Data->IRSpot[0].Y != 0x3FF)
+					if (bSeesSensorBar)
 					{
-						ReticuleXPosition[PlayerIdx] = TIMING_BACK_PORCH + (LineDuration*(1023 - Data->IRSpot[0].X)) / 1024;
-						ReticuleStartLineNum[PlayerIdx] = TIMING_BLANKED_LINES + (VisibleLines*(Data->IRSpot[0].Y + Data->IRSpot[0].Y / 3)) / 1024;
-						SpotX = Data->IRSpot[0].X;
-						SpotY = Data->IRSpot[0].Y;
+						int TrackerX = MIN(MAX((int)PointerX, 0), 1023);
+						int TrackerY = MIN(MAX((int)PointerY, 0), 767);
+						ReticuleXPosition[PlayerIdx] = TIMING_BACK_PORCH + (LineDuration*(1023 - TrackerX)) / 1024;
+						ReticuleStartLineNum[PlayerIdx] = TIMING_BLANKED_LINES + (VisibleLines*(TrackerY + TrackerY / 3)) / 1024;
+						ReticuleAimLine[PlayerIdx] = (TIMING_BLANKED_LINES * GUNCON2_LINE_SCALE) + (VisibleLines*(TrackerY + TrackerY / 3)*GUNCON2_LINE_SCALE) / 1024;
+						SpotX = TrackerX;
+						SpotY = TrackerY;
 					}
 					else
 					{
@@ -364,6 +466,10 @@ public:
 					}
 				}
 			}
+			if (ReticuleStartLineNum[PlayerIdx] < 1000)
+			{
+				DrawnLine = ReticuleStartLineNum[PlayerIdx]; // Kept through dropouts so the report that brings it back is predicted too
+			}
 			
 			if (PlayerIdx == 1)
 			{
@@ -383,13 +489,14 @@ public:
 				}
 			}
 
-			ButtonClick = Data->Buttons & ~OldButtons;
+			ButtonClick |= Data->Buttons & ~OldButtons; // Kept until the menu has had a look
 			OldButtons = Data->Buttons;
 		}
-		else
-		{
-			ButtonClick = 0;
-		}
+	}
+
+	void ClearClicks()
+	{
+		ButtonClick = 0;
 	}
 
 	bool ButtonClicked(int ButtonFlags, int ButtonSelect)
@@ -422,9 +529,14 @@ public:
 		return OldButtons;
 	}
 
+	const WiimoteReportStats* GetReportStats()
+	{
+		return Wiimote->GetReportStats();
+	}
+
 	void ResetCalibration()
 	{
-		CalibrationPhase = 4;
+		CalibrationPhase = NumCalibrationPoints();
 		DoneCalibration = false;
 		UIState = kUIState_Playing;
 		SetReticuleSize();
@@ -432,8 +544,11 @@ public:
 		
 	void StartCalibration()
 	{
+		CalibrationSide = CalibrationDensity + 2;
 		CalibrationPhase = 0;
+		CalibrationSeparation = 0.0f;
 		DoneCalibration = false;
+		Tracker.SetReferenceSeparation(0.0f); // Targets are taken as seen
 		UIState = kUIState_CalibrationMode;
 		SetReticuleSize(true);
 	}
@@ -444,54 +559,95 @@ public:
 	}
 
 private:
-	float Cross(const Vector2D &LHS, const Vector2D &RHS) const
+	int NumCalibrationPoints() const
 	{
-		return LHS.X*RHS.Y - LHS.Y*RHS.X;
+		return CalibrationSide * CalibrationSide;
 	}
 
-	bool Within(const Vector2D &Pos) const
+	// Works out the mapping from the camera to the screen once rather than per report
+	bool Calibrate()
 	{
-		if (Cross(CalibrationData[1] - CalibrationData[0], Pos - CalibrationData[0]) > 0.0f)
-			return false;
-		if (Cross(CalibrationData[3] - CalibrationData[1], Pos - CalibrationData[1]) > 0.0f)
-			return false;
-		if (Cross(CalibrationData[2] - CalibrationData[3], Pos - CalibrationData[3]) > 0.0f)
-			return false;
-		if (Cross(CalibrationData[0] - CalibrationData[2], Pos - CalibrationData[2]) > 0.0f)
+		float CameraX[CalibrationGrid::kMaxPoints];
+		float CameraY[CalibrationGrid::kMaxPoints];
+		float ScreenU[CalibrationGrid::kMaxPoints];
+		float ScreenV[CalibrationGrid::kMaxPoints];
+		int NumPoints = NumCalibrationPoints();
+		for (int i = 0; i < NumPoints; i++)
+		{
+			CameraX[i] = CalibrationData[i].X;
+			CameraY[i] = CalibrationData[i].Y;
+			ScreenU[i] = (float)(i % CalibrationSide) / (float)(CalibrationSide - 1);
+			ScreenV[i] = (float)(i / CalibrationSide) / (float)(CalibrationSide - 1);
+		}
+		LensGrid.Reset();
+		if (NumPoints == 4)
+		{
+			if (!CameraToScreen.Calibrate(CameraX, CameraY))
+			{
+				printf("Player %d calibration corners don't make a usable shape\n", PlayerIdx + 1);
+				return false;
+			}
+			return true;
+		}
+		if (!LensGrid.Fit(CameraX, CameraY, ScreenU, ScreenV, NumPoints))
+		{
+			printf("Player %d calibration points don't fit a usable mapping\n", PlayerIdx + 1);
 			return false;
+		}
+		printf("Player %d calibrated with %d points: radial %.3f, error %.2f%% of the screen\n", PlayerIdx + 1, NumPoints, LensGrid.GetRadial(), LensGrid.GetError() * 100.0f);
 		return true;
 	}
 
-	float Remap(const Vector2D &Pos, int a, int b, int c, int d)
+	// Everything needed to map straight away, so nothing is refitted when it's loaded
+	struct SavedCalibration
 	{
-		Vector2D Cal[4];
-		for (int i = 0; i < 4; i++)
+		int32_t Version;
+		int32_t CalibrationSide;
+		float ReferenceSeparation;
+		Vector2D CalibrationData[CalibrationGrid::kMaxPoints];
+		Homography CameraToScreen;
+		CalibrationGrid LensGrid;
+	};
+
+	void StoreCalibration()
+	{
+		if (!bSavedAddress)
+			return; // Don't know whose it is
+		SavedCalibration Saved;
+		Saved.Version = CALIBRATION_SAVE_VERSION;
+		Saved.CalibrationSide = CalibrationSide;
+		Saved.ReferenceSeparation = Tracker.GetReferenceSeparation();
+		memcpy(Saved.CalibrationData, CalibrationData, sizeof(Saved.CalibrationData));
+		Saved.CameraToScreen = CameraToScreen;
+		Saved.LensGrid = LensGrid;
+		SaveCalibration(Address, CableType, &Saved, sizeof(Saved));
+		CalibrationProfile = CableType;
+	}
+
+	// Keeps the current calibration if there isn't one saved as it's probably the same screen
+	void RestoreCalibration()
+	{
+		SavedCalibration Saved;
+		if (!LoadCalibration(Address, CableType, &Saved, sizeof(Saved)))
+			return;
+		if (Saved.Version != CALIBRATION_SAVE_VERSION || Saved.CalibrationSide < 2 || Saved.CalibrationSide * Saved.CalibrationSide > CalibrationGrid::kMaxPoints)
 		{
-			Cal[i] = CalibrationData[i]-Pos;
+			printf("Player %d saved calibration seems corrupt: Version=%d Side=%d\n", PlayerIdx + 1, Saved.Version, Saved.CalibrationSide);
+			return;
 		}
-		float Qa = Cross(Cal[b]-Cal[d], Cal[c]-Cal[a]);
-		float Qb = 2.0f*Cross(Cal[b], Cal[a]);
-		Qb -= Cross(Cal[b], Cal[c]);
-		Qb -= Cross(Cal[d], Cal[a]);
-		float Qc = Cross(Cal[a], Cal[b]);
-		if (Qa == 0.0f)
-			return -Qc / Qb;
-		float Inner = Qb*Qb - 4.0f*Qa*Qc;
-		if (Inner < 0.0f)
-			return -1.0f;
-		float Root = sqrtf(Inner);
-		float Result = (-Qb + Root) / (2.0f*Qa);
-		if (Result<0.0f || Result>1.0f)
-			Result = (-Qb - Root) / (2.0f*Qa);
-		return Result;
-	}
-
-	Vector2D RemapVector(const Vector2D &Input)
-	{
-		Vector2D Result(Remap(Input,0,2,1,3), Remap(Input,0,1,2,3));
-		Result.X = (Result.X < 0.0f) ? 0.0f : (Result.X > 1.0f) ? 1.0f : Result.X;
-		Result.Y = (Result.Y < 0.0f) ? 0.0f : (Result.Y > 1.0f) ? 1.0f : Result.Y;
-		return Result;
+		CalibrationSide = Saved.CalibrationSide;
+		CalibrationPhase = NumCalibrationPoints();
+		memcpy(CalibrationData, Saved.CalibrationData, sizeof(CalibrationData));
+		CameraToScreen = Saved.CameraToScreen;
+		LensGrid = Saved.LensGrid;
+		Tracker.SetReferenceSeparation(Saved.ReferenceSeparation);
+		DoneCalibration = CameraToScreen.IsValid() || LensGrid.IsValid();
+		printf("Player %d restored %d point calibration\n", PlayerIdx + 1, NumCalibrationPoints());
+	}
+
+	bool MapToScreen(float X, float Y, float &U, float &V) const
+	{
+		return LensGrid.IsValid() ? LensGrid.Map(X, Y, U, V) : CameraToScreen.Map(X, Y, U, V);
 	}
 
 private:
@@ -501,10 +657,22 @@ private:
 	int ButtonClick;
 	int PlayerIdx;
 	int CalibrationPhase;
-	Vector2D CalibrationData[4];
+	int CalibrationSide; // Targets across (and down) the screen
+	float CalibrationSeparation; // Sum of the LED separations at each target so far (-1 if one was missing)
+	int CalibrationProfile; // Cable the current calibration was loaded or saved for (-1 if not yet looked for)
+	uint8_t Address[6]; // Valid while bSavedAddress
+	Vector2D CalibrationData[CalibrationGrid::kMaxPoints];
+	Homography CameraToScreen; // 4 point calibration
+	CalibrationGrid LensGrid; // 9 and 16 point calibration
 	bool DoneCalibration;
+	SensorBarTracker Tracker;
+	GyroBridge Bridge;
+	PointerFilter Filter;
 	uint16_t SpotX;
 	uint16_t SpotY;
+	int DrawnLine; // Last line the reticule was drawn on, which is when the predicted position will be needed
+	uint32_t LoggedStatsWindow;
+	bool bSavedAddress;
 };
 
 void SaveMenuState()
@@ -540,6 +708,132 @@ void SaveMenuState()
 	}
 }
 
+bool LoadWiimoteAddress(int PlayerIdx, uint8_t *Address)
+{
+	char Key[16];
+	snprintf(Key, sizeof(Key), "wiimote%d", PlayerIdx + 1);
+	bool bLoaded = false;
+	nvs_handle NVSHandle;
+	if (nvs_open("lightgunverter", NVS_READONLY, &NVSHandle) == ESP_OK)
+	{
+		size_t Size = 6;
+		bLoaded = (nvs_get_blob(NVSHandle, Key, Address, &Size) == ESP_OK && Size == 6);
+		nvs_close(NVSHandle);
+	}
+	return bLoaded;
+}
+
+void SaveWiimoteAddress(int PlayerIdx, const uint8_t *Address)
+{
+	uint8_t SavedAddress[6];
+	if (LoadWiimoteAddress(PlayerIdx, SavedAddress) && memcmp(SavedAddress, Address, sizeof(SavedAddress)) == 0)
+		return; // Same Wiimote as last time so don't wear the flash
+
+	char Key[16];
+	snprintf(Key, sizeof(Key), "wiimote%d", PlayerIdx + 1);
+	nvs_handle NVSHandle;
+	if (nvs_open("lightgunverter", NVS_READWRITE, &NVSHandle) == ESP_OK)
+	{
+		if (nvs_set_blob(NVSHandle, Key, Address, 6) == ESP_OK)
+		{
+			printf("Saved Wiimote for player %d\n", PlayerIdx + 1);
+			nvs_commit(NVSHandle);
+		}
+		nvs_close(NVSHandle);
+	}
+}
+
+// Pointer page settings have their own key as menu_config has no bits to spare
+void SavePointerState()
+{
+	int32_t CurrentState = POINTER_SAVESTATE_VERSION;
+	CurrentState = (CurrentState << 2) | CalibrationDensity;
+	CurrentState = (CurrentState << 2) | FilterStrength;
+	CurrentState = (CurrentState << 1) | PointerPrediction;
+
+	nvs_handle NVSHandle;
+	if (nvs_open("lightgunverter", NVS_READWRITE, &NVSHandle) == ESP_OK)
+	{
+		int32_t State = 0;
+		if (nvs_get_i32(NVSHandle, "pointer_config", &State) != ESP_OK)
+		{
+			State = 0;
+		}
+		if (CurrentState != State)
+		{
+			if (nvs_set_i32(NVSHandle, "pointer_config", CurrentState) == ESP_OK)
+			{
+				printf("Saved pointer config\n");
+				nvs_commit(NVSHandle);
+			}
+		}
+		nvs_close(NVSHandle);
+	}
+}
+
+void RestorePointerState()
+{
+	nvs_handle NVSHandle;
+	if (nvs_open("lightgunverter", NVS_READONLY, &NVSHandle) == ESP_OK)
+	{
+		int32_t State = 0;
+		if (nvs_get_i32(NVSHandle, "pointer_config", &State) == ESP_OK)
+		{
+			int Prediction = (State & 1); State >>= 1;
+			int Strength = (State & 3); State >>= 2;
+			int Density = (State & 3); State >>= 2;
+			if (State != POINTER_SAVESTATE_VERSION || Density > 2)
+			{
+				printf("Pointer state seems corrupt: Version=%d Data=%d/%d/%d\n", State, Density, Strength, Prediction);
+			}
+			else
+			{
+				CalibrationDensity = Density;
+				FilterStrength = Strength;
+				PointerPrediction = Prediction;
+			}
+		}
+		nvs_close(NVSHandle);
+	}
+}
+
+// One per Wiimote and cable (consoles differ in where they put the picture)
+static void CalibrationKey(char *Key, size_t KeySize, const uint8_t *Address, int Profile)
+{
+	snprintf(Key, KeySize, "c%02x%02x%02x%02x%02x%02x%x", Address[0], Address[1], Address[2], Address[3], Address[4], Address[5], Profile & 0xF);
+}
+
+bool LoadCalibration(const uint8_t *Address, int Profile, void *Data, size_t Size)
+{
+	char Key[16];
+	CalibrationKey(Key, sizeof(Key), Address, Profile);
+	bool bLoaded = false;
+	nvs_handle NVSHandle;
+	if (nvs_open("lightgunverter", NVS_READONLY, &NVSHandle) == ESP_OK)
+	{
+		size_t LoadedSize = Size;
+		bLoaded = (nvs_get_blob(NVSHandle, Key, Data, &LoadedSize) == ESP_OK && LoadedSize == Size);
+		nvs_close(NVSHandle);
+	}
+	return bLoaded;
+}
+
+void SaveCalibration(const uint8_t *Address, int Profile, const void *Data, size_t Size)
+{
+	char Key[16];
+	CalibrationKey(Key, sizeof(Key), Address, Profile);
+	nvs_handle NVSHandle;
+	if (nvs_open("lightgunverter", NVS_READWRITE, &NVSHandle) == ESP_OK)
+	{
+		if (nvs_set_blob(NVSHandle, Key, Data, Size) == ESP_OK)
+		{
+			printf("Saved calibration %s\n", Key);
+			nvs_commit(NVSHandle);
+		}
+		nvs_close(NVSHandle);
+	}
+}
+
 void SetDefaultMenuState()
 {
 	CursorBrightness = 3;
@@ -583,69 +877,42 @@ void RestoreMenuState()
 	}
 }
 
+// Called from the Bluetooth controller's task so reports are handled as soon as they arrive
+static void WakeWiimoteTask()
+{
+	xTaskNotify(WiimoteTaskHandle, WIIMOTE_TASK_PACKET, eSetBits);
+}
+
+static void HousekeepingTimerCallback(TimerHandle_t Timer)
+{
+	xTaskNotify(WiimoteTaskHandle, WIIMOTE_TASK_HOUSEKEEPING, eSetBits);
+}
+
 void WiimoteTask(void *pvParameters)
 {
 	bool WasPlayer1Button = false;
 	bool WasPlayer2Button = false;
 	bool WasHomeButton = false;
 	int HomeButtonTimer = 0;
+	uint32_t LastSerialTime = 0;
+	uint32_t LoggedSerialFrames = 0;
+	int SerialStatsTimer = SERIAL_STATS_LOG_PERIOD;
+	int LinkStatusTimer = 0;
 	printf("WiimoteTask running on core %d\n", xPortGetCoreID());
-	GWiimoteManager.Init();
+	WiimoteTaskHandle = xTaskGetCurrentTaskHandle();
+	GWiimoteManager.Init(WakeWiimoteTask);
 	PlayerInput Player1(0);
 	PlayerInput Player2(1);
+	TimerHandle_t HousekeepingTimer = xTimerCreate("Housekeeping", pdMS_TO_TICKS(HOUSEKEEPING_PERIOD), pdTRUE, NULL, HousekeepingTimerCallback);
+	xTimerStart(HousekeepingTimer, 0);
 	while (true)
 	{
+		uint32_t Events = 0;
+		xTaskNotifyWait(0, ~0u, &Events, portMAX_DELAY); // Never long as the housekeeping timer keeps waking us
+
 		GWiimoteManager.Tick();
 		Player1.Tick();
 		Player2.Tick();
-			
-		bool bHomePressed = Player1.ButtonWasPressed(WiimoteData::kButton_Home) || Player2.ButtonWasPressed(WiimoteData::kButton_Home);
-		if (bHomePressed && !WasHomeButton)
-		{
-			if (UIState == kUIState_InMenu)
-			{
-				SaveMenuState();
-				UIState = kUIState_Playing;
-			}
-			else if (UIState == kUIState_Playing)
-			{
-				UIState = kUIState_InMenu;
-			}
-		}
-		WasHomeButton = bHomePressed;
-
-		if (UIState == kUIState_InMenu)
-		{
-			MenuControl CurrentMenuControl = kMenu_None;
-
-			PlayerInput *MenuPlayerInput = nullptr;
-			for (int Player = 0; Player < 2; Player++)
-			{
-				PlayerInput &Input = (Player == 0) ? Player1 : Player2;
-
-				if (Input.ButtonWasPressed(WiimoteData::kButton_Down))
-					CurrentMenuControl = kMenu_Down;
-				else if (Input.ButtonWasPressed(WiimoteData::kButton_Up))
-					CurrentMenuControl = kMenu_Up;
-				else if (Input.ButtonWasPressed(WiimoteData::kButton_Left))
-					CurrentMenuControl = kMenu_Left;
-				else if (Input.ButtonWasPressed(WiimoteData::kButton_Right))
-					CurrentMenuControl = kMenu_Right;
-				else if (Input.ButtonWasPressed(WiimoteData::kButton_A | WiimoteData::kButton_B))
-					CurrentMenuControl = kMenu_Select;
-
-				if (CurrentMenuControl != kMenu_None)
-				{
-					MenuPlayerInput = &Input;
-					break;
-				}
-			}
-
-			if (MenuInput(CurrentMenuControl, MenuPlayerInput))
-			{
-				SetMenuState();
-			}
-		}
 
 		bool Player1AButton = Player1.ButtonWasPressed(WiimoteData::kButton_A);
 		bool Player1BButton = Player1.ButtonWasPressed(WiimoteData::kButton_B);
@@ -694,76 +961,135 @@ void WiimoteTask(void *pvParameters)
 				gpio_set_level(OUT_PLAYER2_TRIGGER2_PULLED, Player2BButton);
 			}
 		}
-		else if (IOType == 5) // GunCon 2
+		else // Serial and GunCon 2
 		{
-			if (UART1.status.txfifo_cnt == 0 && UART2.status.txfifo_cnt == 0)
+			// The spot generator sends the latest output once per field (see SendSerialOutput). Without video that
+			// doesn't run so send it here as often as a field would be.
+			SerialOutput Output;
+			for (int i = 0; i < 2; i++)
 			{
-				for (int i = 0; i < 2; i++)
-				{
-					uint8_t ToTransmit[8];
-					PlayerInput *Player = i ? &Player2 : &Player1;
-					uint16_t SpotX = (ReticuleXPosition[i] + (40 + DelayDecimal) * 8) * 12 / 80; // GunCon 2 uses 12MHz clock from start of sync
-					uint16_t SpotY = ReticuleStartLineNum[i]; // GunCon 2 uses line numbers
-					uint16_t Buttons = Player->GetButtons();
-					if (SpotY >= 1000)
-					{
-						SpotX = SpotY = ~0;
-					}
-					else
-					{
-						SpotY += LineDelay - 8;
-					}
-					ToTransmit[0] = 0x80;
-					ToTransmit[1] = 0xCC; // GunCon 2 identifier
-					ToTransmit[2] = (SpotX >> 7) & 0x7F;
-					ToTransmit[3] = (SpotX & 0x7F);
-					ToTransmit[4] = (SpotY >> 7) & 0x7F;
-					ToTransmit[5] = (SpotY & 0x7F);
-					ToTransmit[6] = (Buttons >> 7) & 0x7F;
-					ToTransmit[7] = (Buttons & 0x7F);
-				
-					uart_tx_chars((uart_port_t)(UART_NUM_1 + i), (char*)ToTransmit, sizeof(ToTransmit));
-				}
+				PlayerInput *Player = i ? &Player2 : &Player1;
+				SerialPlayerState &State = Output.Players[i];
+				State.X = Player->GetSpotX();
+				State.Y = Player->GetSpotY();
+				State.Buttons = Player->GetButtons();
+				State.Flags = (State.X != 0xFFFF ? SERIAL_PROTOCOL_FLAG_VISIBLE : 0) | (Player->IsConnected() ? SERIAL_PROTOCOL_FLAG_CONNECTED : 0);
+				bool bDrawn = (ReticuleStartLineNum[i] < 1000);
+				State.Line = (bDrawn && State.X != 0xFFFF) ? ReticuleStartLineNum[i] : 0xFFFF; // No optical delays to make up for so no LineDelay/DelayDecimal
+				State.LineTime = ReticuleXPosition[i];
+				Output.AimLine[i] = bDrawn ? ReticuleAimLine[i] : GUNCON2_NO_AIM;
+			}
+			QueueSerialOutput(Output);
+
+			gpio_matrix_out(OUT_PLAYER1_TRIGGER1_PULLED, SIG_GPIO_OUT_IDX, true, false);
+			gpio_matrix_out(OUT_PLAYER1_TRIGGER2_PULLED, U1TXD_OUT_IDX, true, false);
+			gpio_matrix_out(OUT_PLAYER2_TRIGGER1_PULLED, SIG_GPIO_OUT_IDX, true, false);
+			gpio_matrix_out(OUT_PLAYER2_TRIGGER2_PULLED, (IOType == 5) ? U2TXD_OUT_IDX : U1TXD_OUT_IDX, true, false);
+
+			uint32_t Now = (uint32_t)esp_timer_get_time();
+			bool bHaveVideo = (Now - VSyncTime) < TIMING_MAX_FIELD_PERIOD;
+			if (!bHaveVideo && (Now - LastSerialTime) >= TIMING_MAX_FIELD_PERIOD && !SerialOutputBusy())
+			{
+				WriteSerialOutput(Output, 0, false);
+				LastSerialTime = Now;
+			}
+		}
+
+		if (!(Events & WIIMOTE_TASK_HOUSEKEEPING))
+		{
+			continue;
+		}
+
+		// Everything below only needs to keep up with people rather than reports
+		SerialStatsTimer -= HOUSEKEEPING_PERIOD;
+		if (SerialStatsTimer <= 0)
+		{
+			uint32_t FramesSent = SerialFramesSent;
+			if (IOType >= 4 && FramesSent != LoggedSerialFrames)
+			{
+				printf("Serial: %u frames, %u overruns, %u stale\n", FramesSent, SerialOverruns, SerialStaleFrames);
+				LoggedSerialFrames = FramesSent;
+			}
+			SerialStatsTimer = SERIAL_STATS_LOG_PERIOD;
+		}
 
-				gpio_matrix_out(OUT_PLAYER1_TRIGGER1_PULLED, SIG_GPIO_OUT_IDX, true, false);
-				gpio_matrix_out(OUT_PLAYER1_TRIGGER2_PULLED, U1TXD_OUT_IDX, true, false);
-				gpio_matrix_out(OUT_PLAYER2_TRIGGER1_PULLED, SIG_GPIO_OUT_IDX, true, false);
-				gpio_matrix_out(OUT_PLAYER2_TRIGGER2_PULLED, U2TXD_OUT_IDX, true, false);
+		bool bHomePressed = Player1.ButtonWasPressed(WiimoteData::kButton_Home) || Player2.ButtonWasPressed(WiimoteData::kButton_Home);
+		if (bHomePressed && !WasHomeButton)
+		{
+			if (UIState == kUIState_InMenu)
+			{
+				SaveMenuState();
+				SavePointerState();
+				UIState = kUIState_Playing;
+				ChangeMenuPage(kMenuPage_Settings);
+			}
+			else if (UIState == kUIState_Playing)
+			{
+				UIState = kUIState_InMenu;
 			}
 		}
-		else // Serial
+		WasHomeButton = bHomePressed;
+
+		if (UIState == kUIState_InMenu)
 		{
-			if (UART1.status.txfifo_cnt == 0) // UART FIFO is zero
+			if (Player1.ButtonWasClicked(WiimoteData::kButton_Plus) || Player2.ButtonWasClicked(WiimoteData::kButton_Plus))
 			{
-				uint8_t ToTransmit[16];
-				for (int i = 0; i < 2; i++)
+				ChangeMenuPage((MenuPage + 1) % kNumMenuPages);
+				LinkStatusTimer = 0;
+			}
+			else if (Player1.ButtonWasClicked(WiimoteData::kButton_Minus) || Player2.ButtonWasClicked(WiimoteData::kButton_Minus))
+			{
+				ChangeMenuPage((MenuPage + kNumMenuPages - 1) % kNumMenuPages);
+				LinkStatusTimer = 0;
+			}
+		}
+
+		if (UIState == kUIState_InMenu && MenuPage == kMenuPage_LinkStatus)
+		{
+			LinkStatusTimer -= HOUSEKEEPING_PERIOD;
+			if (LinkStatusTimer <= 0)
+			{
+				UpdateLinkStatus(Player1, Player2);
+				LinkStatusTimer = LINK_STATUS_REFRESH;
+			}
+		}
+		else if (UIState == kUIState_InMenu)
+		{
+			MenuControl CurrentMenuControl = kMenu_None;
+
+			PlayerInput *MenuPlayerInput = nullptr;
+			for (int Player = 0; Player < 2; Player++)
+			{
+				PlayerInput &Input = (Player == 0) ? Player1 : Player2;
+
+				if (Input.ButtonWasPressed(WiimoteData::kButton_Down))
+					CurrentMenuControl = kMenu_Down;
+				else if (Input.ButtonWasPressed(WiimoteData::kButton_Up))
+					CurrentMenuControl = kMenu_Up;
+				else if (Input.ButtonWasPressed(WiimoteData::kButton_Left))
+					CurrentMenuControl = kMenu_Left;
+				else if (Input.ButtonWasPressed(WiimoteData::kButton_Right))
+					CurrentMenuControl = kMenu_Right;
+				else if (Input.ButtonWasPressed(WiimoteData::kButton_A | WiimoteData::kButton_B))
+					CurrentMenuControl = kMenu_Select;
+
+				if (CurrentMenuControl != kMenu_None)
 				{
-					PlayerInput *Player = i ? &Player2 : &Player1;
-					uint16_t SpotX = Player->GetSpotX();
-					uint16_t SpotY = Player->GetSpotY();
-					uint16_t Buttons = Player->GetButtons();
-					ToTransmit[8 * i + 0] = 0x80;
-					ToTransmit[8 * i + 1] = i;
-					ToTransmit[8 * i + 2] = (SpotX >> 7) & 0x7F;
-					ToTransmit[8 * i + 3] = (SpotX & 0x7F);
-					ToTransmit[8 * i + 4] = (SpotY >> 7) & 0x7F;
-					ToTransmit[8 * i + 5] = (SpotY & 0x7F);
-					ToTransmit[8 * i + 6] = (Buttons >> 7) & 0x7F;
-					ToTransmit[8 * i + 7] = (Buttons & 0x7F);
+					MenuPlayerInput = &Input;
+					break;
 				}
+			}
 
-				gpio_matrix_out(OUT_PLAYER1_TRIGGER1_PULLED, SIG_GPIO_OUT_IDX, true, false);
-				gpio_matrix_out(OUT_PLAYER1_TRIGGER2_PULLED, U1TXD_OUT_IDX, true, false);
-				gpio_matrix_out(OUT_PLAYER2_TRIGGER1_PULLED, SIG_GPIO_OUT_IDX, true, false);
-				gpio_matrix_out(OUT_PLAYER2_TRIGGER2_PULLED, U1TXD_OUT_IDX, true, false);
-
-				uart_tx_chars(UART_NUM_1, (char*)ToTransmit, sizeof(ToTransmit));
+			bool bChanged = (MenuPage == kMenuPage_Pointer) ? PointerMenuInput(CurrentMenuControl) : MenuInput(CurrentMenuControl, MenuPlayerInput);
+			if (bChanged)
+			{
+				SetMenuState();
 			}
 		}
 
 		if (LogoTime > 0)
 		{
-			LogoTime--;
+			LogoTime -= HOUSEKEEPING_PERIOD;
 		}
 		LogoMode = (LogoTime > 0);
 
@@ -779,7 +1105,7 @@ void WiimoteTask(void *pvParameters)
 		}
 		else
 		{
-			HomeButtonTimer++;
+			HomeButtonTimer += HOUSEKEEPING_PERIOD;
 			if (HomeButtonTimer > HOME_TIME_UNTIL_FIRMWARE_UPDATE)
 			{
 				UIState = kUIState_FirmwareUpdate;
@@ -836,7 +1162,8 @@ void WiimoteTask(void *pvParameters)
 			}
 		}
 
-		vTaskDelay(1);
+		Player1.ClearClicks();
+		Player2.ClearClicks();
 	}
 }
 
@@ -1213,6 +1540,74 @@ void IRAM_ATTR CompositeSyncPositiveEdge(uint32_t &Bank, int &Active)
 	Bank = 1 - Bank;
 }
 
+// Hands the Wiimote task's latest output to the spot generator. Newer output replaces any not yet sent.
+void QueueSerialOutput(const SerialOutput &Output)
+{
+	int Slot = 0;
+	while (Slot == SerialPublished || Slot == SerialReading)
+		Slot++;
+	SerialOutputs[Slot] = Output;
+	SerialPublished = Slot;
+	SerialStatesQueued++;
+}
+
+bool IRAM_ATTR SerialOutputBusy()
+{
+	return (UART1.status.txfifo_cnt != 0) || (IOType == 5 && UART2.status.txfifo_cnt != 0);
+}
+
+// Puts one field's output straight into the UART FIFOs which send it from there on their own
+void IRAM_ATTR WriteSerialOutput(const SerialOutput &Output, uint32_t FieldTime, bool bLower)
+{
+	if (IOType == 5) // GunCon 2, a frame per player on their own UART
+	{
+		for (int i = 0; i < 2; i++)
+		{
+			uint16_t X, Y;
+			GunCon2Position(Output.AimLine[i], Output.Players[i].LineTime, bLower, GUNCON2_X_OFFSET + DelayDecimal * 8, GUNCON2_Y_OFFSET + LineDelay, X, Y);
+			uint8_t ToTransmit[GUNCON2_FRAME_SIZE];
+			EncodeGunCon2Frame(ToTransmit, X, Y, Output.Players[i].Buttons);
+			volatile uart_dev_t &Port = i ? UART2 : UART1;
+			for (int Byte = 0; Byte < GUNCON2_FRAME_SIZE; Byte++)
+				Port.fifo.rw_byte = ToTransmit[Byte];
+		}
+	}
+	else
+	{
+		uint8_t ToTransmit[SERIAL_PROTOCOL_FRAME_SIZE];
+		size_t Size = EncodeSerialFrame(ToTransmit, SerialSequence++, FieldTime, Output.Players);
+		for (size_t i = 0; i < Size; i++)
+			UART1.fifo.rw_byte = ToTransmit[i];
+	}
+}
+
+// Called by the spot generator SERIAL_TX_LINE lines into each field so the cable always gets exactly one frame,
+// at the same point in the field, with the newest output. Only a few microseconds to fill the UART FIFOs.
+void IRAM_ATTR SendSerialOutput()
+{
+	static uint32_t LastStatesQueued = 0;
+	if (SerialOutputBusy())
+	{
+		SerialOverruns++;
+		return;
+	}
+
+	int Slot;
+	do
+	{
+		Slot = SerialPublished;
+		SerialReading = Slot;
+	} while (Slot != SerialPublished); // Make sure it wasn't replaced and picked to write into before we claimed it
+	uint32_t StatesQueued = SerialStatesQueued;
+	if (StatesQueued == LastStatesQueued)
+		SerialStaleFrames++;
+	LastStatesQueued = StatesQueued;
+
+	WriteSerialOutput(SerialOutputs[Slot], VSyncTime, bLowerField);
+	SerialReading = -1;
+	SerialFramesSent++;
+}
+
 void IRAM_ATTR SpotGeneratorInnerLoop()
 {
 	timer_idx_t timer_idx = TIMER_1;
@@ -1220,6 +1615,7 @@ void IRAM_ATTR SpotGeneratorInnerLoop()
 	int Active = 0;
 	int CachedStartingLines[2];
 	bool bNeedSetup = false;
+	GunCon2LineTiming LineTiming = {};
 	TIMERG1.hw_timer[timer_idx].reload = 1;
 	while (true)
 	{
@@ -1243,12 +1639,18 @@ void IRAM_ATTR SpotGeneratorInnerLoop()
 			bNeedSetup = false;
 		}
 		while ((GPIO.in & BIT(IN_COMPOSITE_SYNC)) == 0); // while not sync
+		TIMERG1.hw_timer[timer_idx].update = 1; // Keep the time since the last sync started for reading later
 		TIMERG1.hw_timer[timer_idx].reload = 1;
+		bool bFieldStart = false;
 		if ((Time > TIMING_VSYNC_THRESHOLD) || (CurrentLine == 0 && Time < TIMING_SHORT_SYNC_THRESHOLD)) // TODO: Short syncs cause issues with noisy sync signals but removing it causes strange restart loops
 		{
 			if (CurrentLine > 200 && CurrentLine < 400)
 			{
 				bNTSC = (CurrentLine < 275); // PAL should be something like 300 and NTSC 250
+				uint32_t Now = (uint32_t)esp_timer_get_time();
+				FieldPeriod = Now - VSyncTime;
+				VSyncTime = Now;
+				bFieldStart = true;
 			}
 			
 			if (IOType >= 4) // Serial
@@ -1272,11 +1674,33 @@ void IRAM_ATTR SpotGeneratorInnerLoop()
 			if (IOType >= 4) // Serial
 			{
 				GPIO.out_w1tc = (1 << OUT_PLAYER1_TRIGGER1_PULLED) | (1 << OUT_PLAYER2_TRIGGER1_PULLED);
+				if (CurrentLine == SERIAL_TX_LINE)
+				{
+					SendSerialOutput();
+				}
 			}
 		}
+
+		GunCon2MeasureSync(LineTiming, (uint32_t)Time, 2 * TIMERG1.hw_timer[timer_idx].cnt_low, bFieldStart); // Timer's clk is half APB hence 2x
+		if (bFieldStart)
+			bLowerField = LineTiming.bLowerField;
 	}
 }
 
+// When the spot generator next reaches the given line, from the last vertical sync it saw
+uint32_t NextDrawTime(int Line)
+{
+	uint32_t Now = (uint32_t)esp_timer_get_time();
+	uint32_t Period = FieldPeriod;
+	uint32_t Time = VSyncTime;
+	if (Period == 0 || Period > TIMING_MAX_FIELD_PERIOD || (Now - Time) > TIMING_MAX_FIELD_PERIOD || Line >= 1000)
+		return Now; // No video or the reticule isn't being drawn
+	Time += Line * ((Period * 2) / (bNTSC ? 525 : 625));
+	if ((int32_t)(Time - Now) < 0)
+		Time += Period;
+	return Time;
+}
+
 void SetReticuleSize(bool IsCalibration)
 {
 	float Scale = 1.0f;
@@ -1316,6 +1740,7 @@ void SetMenuState()
 	ShowPointer = (CursorSize != 0);
 	SetReticuleSize();
 	CalibrationDelay = DelayDecimal * 8; // 80th of microsecond
+	uart_set_baudrate(UART_NUM_1, (IOType == 4) ? SERIAL_PROTOCOL_BAUD : LEGACY_SERIAL_BAUD);
 	WhiteLevel = WhiteLevelDecimal * WHITE_LEVEL_STEP;
 	if (WhiteLevel == 0)
 	{
@@ -1446,7 +1871,7 @@ void InitializeMiscGPIO()
 	gpio_config(&UploadButtonGPIOConfig);
 
 	uart_config_t UARTConfig = {
-        .baud_rate = 9600,
+        .baud_rate = LEGACY_SERIAL_BAUD,
         .data_bits = UART_DATA_8_BITS,
         .parity    = UART_PARITY_DISABLE,
         .stop_bits = UART_STOP_BITS_1,
@@ -1555,12 +1980,12 @@ MenuControl AutoRepeat(MenuControl Input)
 	if (Input == kMenu_None || Last != Input)
 	{
 		Last = Input;
-		RepeatTimer = 400;
+		RepeatTimer = 400; // In milliseconds
 		Repeat = RepeatTimer;
 	}
 	else
 	{
-		Repeat--;
+		Repeat -= HOUSEKEEPING_PERIOD;
 		if (Repeat > 0)
 		{
 			Input = kMenu_None;
@@ -1617,7 +2042,7 @@ bool MenuInput(MenuControl Input, PlayerInput *MenuPlayer)
 void InitializeMenu()
 {
 	ConvertText("   CONFIGURE MENU   ", 0, 0);
-	ConvertText("                    ", 1, 0);
+	ConvertText("    PLUS: POINTER   ", 1, 0);
 	ConvertText("+CURSOR SIZE: LARGE ", 2, 0);
 	ConvertText(" CURSOR COLOR:BRIGHT", 3, 0);
 	ConvertText(" 2 PLAYER:    VERSUS", 4, 0);
@@ -1630,6 +2055,116 @@ void InitializeMenu()
 	SetMenuState();
 }
 
+void UpdatePointerMenu()
+{
+	int Tab = 14;
+	switch (CalibrationDensity)
+	{
+		case 0: ConvertText("4 PT  ", 2, Tab); break;
+		case 1: ConvertText("9 PT  ", 2, Tab); break;
+		case 2: ConvertText("16 PT ", 2, Tab); break;
+	}
+	switch (FilterStrength)
+	{
+		case PointerFilter::kStrength_Off: ConvertText("OFF   ", 3, Tab); break;
+		case PointerFilter::kStrength_Light: ConvertText("LIGHT ", 3, Tab); break;
+		case PointerFilter::kStrength_Medium: ConvertText("MEDIUM", 3, Tab); break;
+		case PointerFilter::kStrength_Heavy: ConvertText("HEAVY ", 3, Tab); break;
+	}
+	if (PointerPrediction)
+		ConvertText("ON    ", 4, Tab);
+	else
+		ConvertText("OFF   ", 4, Tab);
+	for (int i=2; i<=4; i++)
+	{
+		TextBuffer[i][0] = FontRemap[(unsigned char)((i == PointerSelectedRow) ? '+' : ' ')];
+	}
+}
+
+bool PointerMenuInput(MenuControl Input)
+{
+	Input = AutoRepeat(Input);
+	if (Input != kMenu_None)
+	{
+		bool bDirty = AdjustRange(Input, kMenu_Up, kMenu_Down, PointerSelectedRow, 2, 4);
+		switch (PointerSelectedRow)
+		{
+			case 2: bDirty |= AdjustRange(Input, kMenu_Left, kMenu_Right, CalibrationDensity, 0, 2); break;
+			case 3: bDirty |= AdjustRange(Input, kMenu_Left, kMenu_Right, FilterStrength, PointerFilter::kStrength_Off, PointerFilter::kStrength_Heavy); break;
+			case 4: bDirty |= AdjustRange(Input, kMenu_Left, kMenu_Right, PointerPrediction, 0, 1); break;
+		}
+		if (bDirty)
+		{
+			UpdatePointerMenu();
+		}
+		return bDirty;
+	}
+	return false;
+}
+
+void InitializePointerMenu()
+{
+	ConvertText("   POINTER SETUP    ", 0, 0);
+	ConvertText("  PLUS: LINK STATUS ", 1, 0);
+	ConvertText("+CALIBRATION: 4 PT  ", 2, 0);
+	ConvertText(" SMOOTHING:   MEDIUM", 3, 0);
+	ConvertText(" PREDICTION:  ON    ", 4, 0);
+	for (int i = 5; i < NUM_TEXT_ROWS; i++)
+	{
+		ConvertText("                    ", i, 0);
+	}
+	UpdatePointerMenu();
+}
+
+void ChangeMenuPage(int Page)
+{
+	if (Page == MenuPage)
+		return;
+	MenuPage = Page;
+	if (MenuPage == kMenuPage_Settings)
+	{
+		InitializeMenu();
+	}
+	else if (MenuPage == kMenuPage_Pointer)
+	{
+		InitializePointerMenu();
+	}
+	else
+	{
+		ConvertText("    LINK STATUS     ", 0, 0);
+		ConvertText("                    ", 1, 0);
+	}
+}
+
+void UpdateLinkStatus(PlayerInput &Player1, PlayerInput &Player2)
+{
+	char Text[NUM_TEXT_COLUMNS + 1];
+	for (int Player = 0; Player < 2; Player++)
+	{
+		PlayerInput &Input = Player ? Player2 : Player1;
+		const WiimoteReportStats *Stats = Input.GetReportStats();
+		int Row = 2 + Player * 4;
+		if (Stats->NumWindows == 0)
+		{
+			snprintf(Text, sizeof(Text), " PLAYER %d:   NONE   ", Player + 1);
+			ConvertText(Text, Row, 0);
+			ConvertText("                    ", Row + 1, 0);
+			ConvertText("                    ", Row + 2, 0);
+			ConvertText("                    ", Row + 3, 0);
+			continue;
+		}
+		int Rate = Stats->MeanInterval ? (1000000 + Stats->MeanInterval / 2) / Stats->MeanInterval : 0;
+		snprintf(Text, sizeof(Text), " PLAYER %d:   %-4dHZ ", Player + 1, MIN(Rate, 9999));
+		ConvertText(Text, Row, 0);
+		snprintf(Text, sizeof(Text), "  JITTER:    %-5dUS", MIN((int)Stats->Jitter, 99999));
+		ConvertText(Text, Row + 1, 0);
+		snprintf(Text, sizeof(Text), "  MAX GAP:   %-5dMS", MIN((int)Stats->MaxInterval / 1000, 99999));
+		ConvertText(Text, Row + 2, 0);
+		snprintf(Text, sizeof(Text), "  DROPPED:   %-7d", MIN((int)Stats->NumDropped, 9999999));
+		ConvertText(Text, Row + 3, 0);
+	}
+}
+
 void InitializeFirmwareUpdateScreen()
 {
 	ConvertText("  FIRMWARE UPDATER  ", 0, 0);
@@ -1912,6 +2447,7 @@ extern "C" void app_main(void)
 	PWMPeripherialInit();
 	SetDefaultMenuState();
 	RestoreMenuState();
+	RestorePointerState();
 	InitializeChooseCable();
 
 	xTaskCreatePinnedToCore(&WiimoteTask, "WiimoteTask", 8192, NULL, 5, NULL, 0);
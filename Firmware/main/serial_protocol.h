@@ -0,0 +1,68 @@
+// (c) Charlie Cole 2017
+//
+// This is licensed under
+// - Creative Commons Attribution-NonCommercial 3.0 Unported
+// - https://creativecommons.org/licenses/by-nc/3.0/
+// - Or see LICENSE.txt
+//
+// The short of it is...
+//   You are free to:
+//     Share — copy and redistribute the material in any medium or format
+//     Adapt — remix, transform, and build upon the material
+//   Under the following terms:
+//     NonCommercial — You may not use the material for commercial purposes.
+//     Attribution — You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+
+
+#ifndef __SERIAL_PROTOCOL_H__
+#define __SERIAL_PROTOCOL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Framed protocol for active cables on the serial IO type (ActiveCables/PSXGun.ino decodes it). One frame per
+// video field, started a few lines after vertical sync, carrying both players, little endian throughout:
+//
+//   0      Sync (0xA5)
+//   1      Version
+//   2      Sequence, goes up by one each frame so the cable can count what it missed
+//   3      Payload length (bytes 4 onwards up to the CRC), lets a cable skip fields it doesn't know about
+//   4-7    Time of the vertical sync the frame belongs to (microseconds, wraps, 0 if there's no video)
+//   8-14   Player 1: X (0-1023), Y (0-767), buttons (WiimoteData::kButton_*), flags
+//   15-21  Player 2
+//   22-25  Player 1 spot timing: line after vertical sync, time after the start of horizontal sync (80ths of a
+//          microsecond). Where the spot generator draws the reticule so a cable can give a console the same
+//          timing a light gun would see. Line is 0xFFFF when there's no spot. (Version 2)
+//   26-29  Player 2 spot timing
+//   30-31  CRC-16/CCITT (0x1021, starting at 0xFFFF) of bytes 1 to 29
+//
+// The sync byte can turn up elsewhere so receivers should only trust a frame once the CRC matches.
+
+#define SERIAL_PROTOCOL_SYNC 0xA5
+#define SERIAL_PROTOCOL_VERSION 2
+#define SERIAL_PROTOCOL_BAUD 1000000	// Exact on a 16MHz AVR with double speed
+#define SERIAL_PROTOCOL_HEADER_SIZE 4
+#define SERIAL_PROTOCOL_PLAYER_SIZE 7
+#define SERIAL_PROTOCOL_TIMING_SIZE 4
+#define SERIAL_PROTOCOL_PAYLOAD_SIZE (4 + 2 * (SERIAL_PROTOCOL_PLAYER_SIZE + SERIAL_PROTOCOL_TIMING_SIZE))
+#define SERIAL_PROTOCOL_FRAME_SIZE (SERIAL_PROTOCOL_HEADER_SIZE + SERIAL_PROTOCOL_PAYLOAD_SIZE + 2)
+
+#define SERIAL_PROTOCOL_FLAG_VISIBLE (1 << 0)	// X and Y are on the screen
+#define SERIAL_PROTOCOL_FLAG_CONNECTED (1 << 1)	// Wiimote is connected
+
+struct SerialPlayerState
+{
+	uint16_t X;
+	uint16_t Y;
+	uint16_t Buttons;
+	uint8_t Flags;
+	uint16_t Line;
+	uint16_t LineTime;
+};
+
+uint16_t SerialProtocolCRC(const uint8_t *Data, size_t Size);
+
+// Fills Frame (SERIAL_PROTOCOL_FRAME_SIZE bytes) and returns how many bytes to send
+size_t EncodeSerialFrame(uint8_t *Frame, uint8_t Sequence, uint32_t VSyncTime, const SerialPlayerState *Players);
+
+#endif // __SERIAL_PROTOCOL_H__
@@ -0,0 +1,36 @@
+// (c) Charlie Cole 2017
+//
+// This is licensed under
+// - Creative Commons Attribution-NonCommercial 3.0 Unported
+// - https://creativecommons.org/licenses/by-nc/3.0/
+// - Or see LICENSE.txt
+//
+// The short of it is...
+//   You are free to:
+//     Share — copy and redistribute the material in any medium or format
+//     Adapt — remix, transform, and build upon the material
+//   Under the following terms:
+//     NonCommercial — You may not use the material for commercial purposes.
+//     Attribution — You must give appropriate credit, provide a link to the license, and indicate if changes were made. You may do so in any reasonable manner, but not in any way that suggests the licensor endorses you or your use.
+
+#ifndef __VIDEO_TIMING_H__
+#define __VIDEO_TIMING_H__
+
+// Video timing the spot generator works to, shared with the tools that model it
+
+#define TIMING_RETICULE_WIDTH 75.0f // Generates a circle in PAL but might need adjusting for NTSC (In 80ths of a microsecond)
+#define TIMING_BACK_PORCH 7*80		// In 80ths of a microsecond	(Should be about 6*80)
+#define TIMING_LINE_DURATION  (8*465+100) // In 80ths of a microsecond  (Should be about 52*80 but need to clip when off edge)
+#define TIMING_LINE_DURATION_NTSC  (8*460+100) // Not correct. Backporch should be altered instead
+#define TIMING_BLANKED_LINES 28		// Should be about 16?
+#define TIMING_VISIBLE_LINES 258	// Should be 288
+#define TIMING_VISIBLE_LINES_NTSC 206	// Should be 240
+#define TIMING_VSYNC_THRESHOLD (40*16) // If sync is longer than this then doing a vertical sync
+#define TIMING_SHORT_SYNC_THRESHOLD (40*3) // If sync is shorter than this it's a short sync
+#define TIMING_SYNC_DEBOUNCE (2*80)  // At the end of the sync check to see if it's real (noisy signals can cause errors)
+#define TIMING_MAX_FIELD_PERIOD 25000 // Longer than this between vertical syncs and the video signal was lost (in microseconds)
+#define TIMING_NORMAL_SYNC_THRESHOLD (40*7) // Syncs shorter than this are equalising pulses (2.3us rather than 4.7us)
+#define TIMING_MIN_LINE_PERIOD (50*80) // Time between syncs that counts as a whole line (in 80ths of a microsecond)
+#define TIMING_MAX_LINE_PERIOD (80*80)
+
+#endif // __VIDEO_TIMING_H__